@@ -0,0 +1,99 @@
+/*
+ * Bloom filter of byte strings, sized for about 1% false positives at
+ * the expected number of items.
+ */
+
+#include <string.h>
+
+#include "erl_nif.h"
+#include "bloom.h"
+
+#define BITS_PER_ITEM 10
+#define HASHES 7
+
+struct bloom_t
+{
+    size_t bits;
+    unsigned char *data;
+};
+
+bloom *
+bloom_create(size_t expected)
+{
+    bloom *ret;
+
+    ret = (bloom *) enif_alloc(sizeof(struct bloom_t));
+    if(ret == NULL)
+      return NULL;
+
+    if(expected < 64)
+      expected = 64;
+    ret->bits = expected * BITS_PER_ITEM;
+    ret->data = (unsigned char *) enif_alloc((ret->bits + 7) / 8);
+    if(ret->data == NULL) {
+      enif_free(ret);
+      return NULL;
+    }
+    memset(ret->data, 0, (ret->bits + 7) / 8);
+
+    return ret;
+}
+
+void
+bloom_destroy(bloom *bloom)
+{
+    enif_free(bloom->data);
+    enif_free(bloom);
+}
+
+/* two independent hashes, the others are made by double hashing */
+static void
+bloom_hash(const void *bytes, size_t size, unsigned long long *h1, unsigned long long *h2)
+{
+    const unsigned char *p = (const unsigned char *) bytes;
+    unsigned long long h = 14695981039346656037ULL; /* FNV-1a */
+    size_t i;
+
+    for(i = 0; i < size; i++)
+      h = (h ^ p[i]) * 1099511628211ULL;
+    *h1 = h;
+
+    /* splitmix64 finalizer */
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    *h2 = h | 1;
+}
+
+void
+bloom_add(bloom *bloom, const void *bytes, size_t size)
+{
+    unsigned long long h1, h2;
+    size_t bit;
+    int i;
+
+    bloom_hash(bytes, size, &h1, &h2);
+    for(i = 0; i < HASHES; i++) {
+      bit = (size_t) ((h1 + i * h2) % bloom->bits);
+      bloom->data[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+int
+bloom_may_contain(bloom *bloom, const void *bytes, size_t size)
+{
+    unsigned long long h1, h2;
+    size_t bit;
+    int i;
+
+    bloom_hash(bytes, size, &h1, &h2);
+    for(i = 0; i < HASHES; i++) {
+      bit = (size_t) ((h1 + i * h2) % bloom->bits);
+      if(!(bloom->data[bit / 8] & (1 << (bit % 8))))
+        return 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,19 @@
+/*
+ * Bloom filter of byte strings, used to answer lookups of absent keys
+ * without touching the database. Not thread safe, the user locks.
+ */
+
+#ifndef ESQLITE_BLOOM_H
+#define ESQLITE_BLOOM_H
+
+#include <stddef.h>
+
+typedef struct bloom_t bloom;
+
+bloom * bloom_create(size_t expected);
+void bloom_destroy(bloom *bloom);
+
+void bloom_add(bloom *bloom, const void *bytes, size_t size);
+int bloom_may_contain(bloom *bloom, const void *bytes, size_t size);
+
+#endif
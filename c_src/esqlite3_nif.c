@@ -18,22 +18,108 @@
  * sqlite3_nif -- an erlang sqlite nif.
 */
 
+#include <ctype.h>
 #include <erl_nif.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <stdio.h> /* for debugging */
 
+#include "bloom.h"
 #include "queue.h"
 #include "sqlite3.h"
 
 #define MAX_ATOM_LENGTH 255 /* from atom.h, not exposed in erlang include */
 #define MAX_PATHNAME 512 /* unfortunately not in sqlite.h. */
+#define MAX_HEAP_BINARY 64 /* ERL_ONHEAP_BIN_LIMIT, not exposed in erlang include */
+#define MAX_DICTIONARY_ENTRIES 4096 /* distinct values remembered per chunk */
+#define CACHE_BUCKETS 256 /* buckets of the query cache of a connection */
+#define MAX_CACHE_ENTRIES 1024 /* cached results per connection */
+#define BACKUP_BUSY_TIMEOUT 500 /* ms a busy backup keeps retrying before it gives up */
+#define MAX_FILTER_PENDING 1024 /* rows written around a kv store added to its filter one by one */
+#define YIELD_CELLS 1000 /* result set cells made between timeslice checks */
+#define MAX_CHANGES 65536 /* changes buffered for subscribers per transaction */
 
 static ErlNifResourceType *esqlite_connection_type = NULL;
 static ErlNifResourceType *esqlite_statement_type = NULL;
+static ErlNifResourceType *esqlite_result_set_type = NULL;
+static ErlNifResourceType *esqlite_kv_type = NULL;
+static ErlNifResourceType *esqlite_blob_type = NULL;
+
+/* bloom filter of the blob keys of a kv store, owned by the
+ * connection thread */
+typedef struct esqlite_kv_filter {
+     struct esqlite_kv_filter *next;
+     char *table;             /* name of the table */
+     char *quoted;            /* quoted name, for sql */
+     size_t expected;         /* number of keys the filter is sized for */
+
+     ErlNifRWLock *lock;      /* the kv nif reads the filter */
+     bloom *bloom;
+     int valid;               /* 0 after writes the filter has not seen */
+
+     int writing;             /* own put in progress */
+
+     /* rows written around the store, their keys are added before the
+      * filter is used again. Too many and the filter is rebuilt. */
+     sqlite3_int64 *pending;
+     unsigned int n_pending;
+     int rebuild;
+} esqlite_kv_filter;
+
+/* table read by cached queries */
+typedef struct esqlite_cached_table {
+     struct esqlite_cached_table *next;
+     char *database;          /* main, temp or the name of an attached database */
+     char *name;
+     unsigned int generation; /* bumped when the table changes */
+} esqlite_cached_table;
+
+/* cached result of a read only query */
+typedef struct esqlite_cache_entry {
+     struct esqlite_cache_entry *next;
+     unsigned int hash;
+     unsigned char *key;      /* sql and parameters in external term format */
+     size_t size;
+     ErlNifEnv *env;
+     ERL_NIF_TERM rows;       /* in env */
+     unsigned int count;
+     esqlite_cached_table **tables;
+     unsigned int *generations; /* of the tables when the rows were read */
+} esqlite_cache_entry;
+
+/* query cache, read by the cached_query nif under the lock */
+typedef struct {
+     esqlite_cache_entry *buckets[CACHE_BUCKETS];
+     unsigned int entries;
+     esqlite_cached_table *tables;
+
+     /* tables read by the statement being prepared */
+     int collecting;
+     esqlite_cached_table **read;
+     unsigned int read_count;
+     unsigned int read_size;
+} esqlite_cache;
+
+/* process which receives the changes of a connection */
+typedef struct esqlite_subscriber {
+     struct esqlite_subscriber *next;
+     ErlNifPid pid;
+     ErlNifEnv *env;
+     ERL_NIF_TERM ref;        /* in env, tags the messages */
+} esqlite_subscriber;
+
+/* open savepoint of the transaction, for the change feed */
+typedef struct esqlite_savepoint {
+     struct esqlite_savepoint *next;
+     char name[MAX_ATOM_LENGTH + 1];
+     unsigned int mark;       /* changes buffered when it was opened */
+} esqlite_savepoint;
 
-/* database connection context */
+/* database connection context, owned by the connection thread */
 typedef struct {
      ErlNifTid tid;
      ErlNifThreadOpts* opts;
@@ -41,15 +127,152 @@ typedef struct {
      sqlite3 *db;
      queue *commands;
 
+     esqlite_kv_filter *filters; /* seen by the update hook */
+
+     /* change feed, changes are buffered until the commit */
+     esqlite_subscriber *subscribers;
+     ErlNifEnv *changes_env;
+     ERL_NIF_TERM changes;    /* {Op, Database, Table, Rowid}, last change first */
+     unsigned int n_changes;  /* length of changes */
+     int overflow;            /* more than MAX_CHANGES, the changes were dropped */
+     int committed;           /* the buffered changes were committed */
+     esqlite_savepoint *savepoints; /* the last one opened first */
+
+     ErlNifMutex *cache_lock;
+     esqlite_cache *cache;
+     int authorizer;          /* the authorizer is installed */
+     int dropping;            /* the authorizer saw a drop just now */
+
+     char *write_back;        /* file the database is copied to on close */
+
      int alive;
 } esqlite_connection;
 
+/* erlang handle on a connection */
+typedef struct {
+     esqlite_connection *connection;
+} esqlite_handle;
+
+/* how the rows of a statement are decoded */
+typedef enum {
+     plan_typed,     /* every column has a predicted type */
+     plan_integers   /* all columns are predicted to be integers */
+} decoder_plan;
+
+struct esqlite_chunk;
+
+/* shape of the rows of a statement */
+typedef enum {
+     row_tuple,
+     row_map         /* maps keyed by column name */
+} row_format;
+
+/* how the rows of a statement are sent */
+typedef enum {
+     encoding_term,
+     encoding_etf,   /* one binary in external term format */
+     encoding_json   /* one binary with json, made without terms */
+} row_encoding;
+
+typedef ERL_NIF_TERM (*cell_decoder)(ErlNifEnv *env, struct esqlite_chunk *chunk,
+				     sqlite3_stmt *stmt, unsigned int i, size_t cell);
+
 /* prepared statement */
 typedef struct {
-    esqlite_connection *connection;
+    esqlite_handle *handle;
     sqlite3_stmt *statement;
+
+    /* row decoder, made from the first row and owned by the connection
+     * thread */
+    int columns;             /* -1 when there is no plan yet */
+    decoder_plan plan;
+    cell_decoder *decoders;  /* decoder of the predicted type per column */
+    unsigned char *types;    /* predicted type per column */
+    ERL_NIF_TERM *row;       /* cells of the row being made */
+
+    /* map rows, the keys are made once per plan and kept in keys_env */
+    row_format format;
+    ErlNifEnv *keys_env;
+    ERL_NIF_TERM atoms;      /* column names which may become atom keys */
+    ERL_NIF_TERM *keys;      /* key per column, in keys_env */
+    ERL_NIF_TERM *row_keys;  /* keys copied into the env of the answer */
+
+    row_encoding encoding;
+    int text_binary;         /* text cells are binaries instead of strings */
+    int done_info;           /* done is {done, Changes, LastRowid} instead of '$done' */
+
+    /* answers of steps read ahead by the connection thread, served by
+     * the step nif without a queue hop */
+    unsigned int read_ahead; /* rows to read ahead, 0 for none */
+    ErlNifMutex *ahead_lock;
+    ErlNifEnv *ahead_env;    /* owns the answers of the current batch */
+    ERL_NIF_TERM *ahead;
+    ERL_NIF_TERM *ahead_fill; /* batch being read, connection thread only */
+    unsigned int ahead_next;
+    unsigned int ahead_count;
+    int ahead_end;           /* batch ends with the last answer of the statement */
+    int ahead_pending;       /* a read ahead command is queued */
+    unsigned int generation; /* bumped when the buffered answers are dropped */
 } esqlite_statement;
 
+/* a cell of a materialized result */
+typedef struct {
+     int type;
+     unsigned int size;
+     union {
+	  sqlite3_int64 i;
+	  double d;
+	  size_t offset; /* of text and blob bytes in the data buffer */
+     } v;
+} esqlite_value;
+
+/* materialized result of a statement, immutable once created */
+typedef struct {
+     unsigned int columns;
+     unsigned int rows;
+     esqlite_value *values;  /* rows * columns cells, row by row */
+     unsigned char *data;    /* text and blob bytes */
+} esqlite_result_set;
+
+/* key value store over a table, its statements stay prepared */
+typedef struct {
+     esqlite_handle *handle;
+     sqlite3_stmt *get;
+     sqlite3_stmt *put;
+     sqlite3_stmt *del;
+     sqlite3_stmt *range;
+     esqlite_kv_filter *filter;  /* NULL when the store has no filter */
+} esqlite_kv;
+
+/* open blob of a cell, for incremental reads and writes */
+typedef struct {
+     esqlite_handle *handle;
+     sqlite3_blob *blob;      /* NULL when closed */
+} esqlite_blob;
+
+/* online backup, copied a number of pages at a time */
+typedef struct {
+     sqlite3 *file;
+     sqlite3_backup *backup;
+     int pages;               /* pages per step, -1 for all */
+     int restore;             /* copy the file into the database instead */
+     int write_back;          /* after a restore, copy back on close */
+     char *filename;          /* kept for write_back */
+     int progress;            /* send progress messages to progress_pid */
+     ErlNifPid progress_pid;
+     int busy;                /* the last step was busy */
+     ErlNifTime busy_since;   /* ms, monotonic, when the steps became busy */
+} esqlite_backup;
+
+/* joins the threads of connections which have been torn down */
+static struct {
+     ErlNifTid tid;
+     queue *finished;
+     ErlNifMutex *lock;
+     int running;
+     int stopping;
+} reaper;
+
 
 typedef enum {
      cmd_unknown,
@@ -59,6 +282,25 @@ typedef enum {
      cmd_bind,
      cmd_step,
      cmd_column_names,
+     cmd_fetch,
+     cmd_result_set,
+     cmd_columnar,
+     cmd_read_ahead,
+     cmd_multi_get,
+     cmd_kv_open,
+     cmd_kv,
+     cmd_kv_close,
+     cmd_pipeline,
+     cmd_transaction,
+     cmd_exec_script,
+     cmd_subscribe,
+     cmd_unsubscribe,
+     cmd_read_query,
+     cmd_blob_open,
+     cmd_blob,
+     cmd_blob_close,
+     cmd_backup,
+     cmd_finalize,
      cmd_close,
      cmd_stop
 } command_type;
@@ -70,7 +312,23 @@ typedef struct {
      ERL_NIF_TERM ref;
      ErlNifPid pid;
      ERL_NIF_TERM arg;
-     sqlite3_stmt *stmt;
+
+     /* resources kept alive while the command is queued */
+     esqlite_handle *handle;
+     esqlite_statement *stmt;
+     esqlite_kv *kv;
+     esqlite_blob *blob;
+
+     /* handle of a statement which was garbage collected */
+     sqlite3_stmt *orphan;
+     /* filter of a kv store which was garbage collected */
+     esqlite_kv_filter *orphan_filter;
+     /* blob which was garbage collected */
+     sqlite3_blob *orphan_blob;
+
+     /* backup in progress, the command is queued again after each step */
+     esqlite_backup *backup;
+     int requeue;
 } esqlite_command;
 
 static ERL_NIF_TERM
@@ -90,6 +348,19 @@ make_ok_tuple(ErlNifEnv *env, ERL_NIF_TERM value)
      return enif_make_tuple2(env, make_atom(env, "ok"), value);
 }
 
+/*
+ * The number of changes and the rowid of the last insert on the
+ * connection, made on the connection thread so no other command can
+ * get in between.
+ */
+static ERL_NIF_TERM
+make_done_info(ErlNifEnv *env, sqlite3 *db)
+{
+     return enif_make_tuple3(env, make_atom(env, "done"),
+			     enif_make_int(env, sqlite3_changes(db)),
+			     enif_make_int64(env, sqlite3_last_insert_rowid(db)));
+}
+
 static ERL_NIF_TERM
 make_error_tuple(ErlNifEnv *env, const char *reason)
 {
@@ -104,6 +375,18 @@ make_sqlite3_error_tuple(ErlNifEnv *env, const char *msg)
 					      enif_make_string(env, msg, ERL_NIF_LATIN1)));
 }
 
+static void
+backup_destroy(esqlite_backup *backup)
+{
+     if(backup->backup)
+	  sqlite3_backup_finish(backup->backup);
+     if(backup->file)
+	  sqlite3_close(backup->file);
+     if(backup->filename)
+	  enif_free(backup->filename);
+     enif_free(backup);
+}
+
 static void
 command_destroy(void *obj)
 {
@@ -111,6 +394,16 @@ command_destroy(void *obj)
 
      if(cmd->env != NULL)
 	  enif_free_env(cmd->env);
+     if(cmd->handle != NULL)
+	  enif_release_resource(cmd->handle);
+     if(cmd->stmt != NULL)
+	  enif_release_resource(cmd->stmt);
+     if(cmd->kv != NULL)
+	  enif_release_resource(cmd->kv);
+     if(cmd->blob != NULL)
+	  enif_release_resource(cmd->blob);
+     if(cmd->backup != NULL)
+	  backup_destroy(cmd->backup);
 
      enif_free(cmd);
 }
@@ -122,6 +415,10 @@ command_create()
      if(cmd == NULL)
 	  return NULL;
 
+     cmd->handle = NULL;
+     cmd->stmt = NULL;
+     cmd->kv = NULL;
+     cmd->blob = NULL;
      cmd->env = enif_alloc_env();
      if(cmd->env == NULL) {
 	  command_destroy(cmd);
@@ -131,38 +428,109 @@ command_create()
      cmd->type = cmd_unknown;
      cmd->ref = 0;
      cmd->arg = 0;
-     cmd->stmt = NULL;
+     cmd->orphan = NULL;
+     cmd->orphan_filter = NULL;
+     cmd->orphan_blob = NULL;
+     cmd->backup = NULL;
+     cmd->requeue = 0;
 
      return cmd;
 }
 
+static ERL_NIF_TERM
+push_command(ErlNifEnv *env, esqlite_connection *conn, esqlite_command *cmd)
+{
+     if(!queue_push(conn->commands, cmd)) {
+	  command_destroy(cmd);
+	  return make_error_tuple(env, "command_push_failed");
+     }
+
+     return make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM
+make_answer(esqlite_command *cmd, ERL_NIF_TERM answer)
+{
+     return enif_make_tuple2(cmd->env, cmd->ref, answer);
+}
+
+static void
+command_keep_handle(esqlite_command *cmd, esqlite_handle *handle)
+{
+     enif_keep_resource(handle);
+     cmd->handle = handle;
+}
+
+static void
+command_keep_statement(esqlite_command *cmd, esqlite_statement *stmt)
+{
+     enif_keep_resource(stmt);
+     cmd->stmt = stmt;
+}
+
+static void
+command_keep_kv(esqlite_command *cmd, esqlite_kv *kv)
+{
+     enif_keep_resource(kv);
+     cmd->kv = kv;
+}
+
+static void
+command_keep_blob(esqlite_command *cmd, esqlite_blob *blob)
+{
+     enif_keep_resource(blob);
+     cmd->blob = blob;
+}
+
 /*
- *
+ * Queued commands and statements keep the handle alive, so the stop
+ * command is always the last one the thread sees. The thread closes
+ * the database itself and hands itself to the reaper, this destructor
+ * never waits for it.
  */
 static void
 destruct_esqlite_connection(ErlNifEnv *env, void *arg)
 {
-     esqlite_connection *db = (esqlite_connection *) arg;
-     esqlite_command *cmd = command_create();
+     esqlite_handle *handle = (esqlite_handle *) arg;
+     esqlite_command *cmd;
 
-     /* Send the stop command
+     if(!handle->connection)
+	  return;
+
+     /* Without memory for the stop command the thread and the database
+      * are leaked, crashing here would take the whole vm down.
       */
+     cmd = command_create();
+     if(!cmd)
+	  return;
+
      cmd->type = cmd_stop;
-     queue_push(db->commands, cmd);
-     queue_send(db->commands, cmd);
+     if(!queue_push(handle->connection->commands, cmd))
+	  command_destroy(cmd);
+}
 
-     /* Wait for the thread to finish
-      */
-     enif_thread_join(db->tid, NULL);
-     enif_thread_opts_destroy(db->opts);
+/*
+ * The connection thread may be using the database right now, so let it
+ * finalize a garbage collected statement when it gets to it. No answer
+ * is sent for this command.
+ */
+static void
+finalize_orphan(esqlite_handle *handle, sqlite3_stmt *statement)
+{
+     esqlite_command *cmd;
 
-     /* The thread has finished... now remove the command queue, and close
-      * the datbase (if it was still open).
-      */
-     queue_destroy(db->commands);
+     cmd = command_create();
+     if(cmd) {
+	  cmd->type = cmd_finalize;
+	  cmd->orphan = statement;
+	  if(!queue_push(handle->connection->commands, cmd)) {
+	       command_destroy(cmd);
+	       cmd = NULL;
+	  }
+     }
 
-     if(db->db)
-	  sqlite3_close(db->db);
+     if(!cmd)
+	  sqlite3_finalize(statement);
 }
 
 static void
@@ -171,11 +539,99 @@ destruct_esqlite_statement(ErlNifEnv *env, void *arg)
      esqlite_statement *stmt = (esqlite_statement *) arg;
 
      if(stmt->statement) {
-	  sqlite3_finalize(stmt->statement);
+	  finalize_orphan(stmt->handle, stmt->statement);
 	  stmt->statement = NULL;
      }
 
-     enif_release_resource(stmt->connection);
+     if(stmt->decoders)
+	  enif_free(stmt->decoders);
+     if(stmt->types)
+	  enif_free(stmt->types);
+     if(stmt->row)
+	  enif_free(stmt->row);
+     if(stmt->keys)
+	  enif_free(stmt->keys);
+     if(stmt->row_keys)
+	  enif_free(stmt->row_keys);
+     if(stmt->keys_env)
+	  enif_free_env(stmt->keys_env);
+     if(stmt->ahead_lock)
+	  enif_mutex_destroy(stmt->ahead_lock);
+     if(stmt->ahead_env)
+	  enif_free_env(stmt->ahead_env);
+     if(stmt->ahead)
+	  enif_free(stmt->ahead);
+     if(stmt->ahead_fill)
+	  enif_free(stmt->ahead_fill);
+
+     if(stmt->handle)
+	  enif_release_resource(stmt->handle);
+}
+
+static void
+destruct_esqlite_result_set(ErlNifEnv *env, void *arg)
+{
+     esqlite_result_set *rs = (esqlite_result_set *) arg;
+
+     if(rs->values)
+	  enif_free(rs->values);
+     if(rs->data)
+	  enif_free(rs->data);
+}
+
+static void
+destruct_esqlite_kv(ErlNifEnv *env, void *arg)
+{
+     esqlite_kv *kv = (esqlite_kv *) arg;
+     esqlite_command *cmd;
+
+     if(kv->get)
+	  finalize_orphan(kv->handle, kv->get);
+     if(kv->put)
+	  finalize_orphan(kv->handle, kv->put);
+     if(kv->del)
+	  finalize_orphan(kv->handle, kv->del);
+     if(kv->range)
+	  finalize_orphan(kv->handle, kv->range);
+
+     /* the update hook of the connection thread may be looking at the
+      * filter, so the thread unlinks and frees it */
+     if(kv->filter) {
+	  cmd = command_create();
+	  if(cmd) {
+	       cmd->type = cmd_kv_close;
+	       cmd->orphan_filter = kv->filter;
+	       if(!queue_push(kv->handle->connection->commands, cmd))
+		    command_destroy(cmd);
+	  }
+     }
+
+     if(kv->handle)
+	  enif_release_resource(kv->handle);
+}
+
+static void
+destruct_esqlite_blob(ErlNifEnv *env, void *arg)
+{
+     esqlite_blob *b = (esqlite_blob *) arg;
+     esqlite_command *cmd = NULL;
+
+     if(b->blob) {
+	  cmd = command_create();
+	  if(cmd) {
+	       cmd->type = cmd_blob_close;
+	       cmd->orphan_blob = b->blob;
+	       if(!queue_push(b->handle->connection->commands, cmd)) {
+		    command_destroy(cmd);
+		    cmd = NULL;
+	       }
+	  }
+	  if(!cmd)
+	       sqlite3_blob_close(b->blob);
+     }
+
+     if(b->handle)
+	  enif_release_resource(b->handle);
 }
 
 static ERL_NIF_TERM
@@ -204,50 +660,461 @@ do_open(ErlNifEnv *env, esqlite_connection *db, const ERL_NIF_TERM arg)
      return make_atom(env, "ok");
 }
 
+/*
+ * Get the {done, atom} or {done, info} option. With info the result of
+ * a write is {done, Changes, LastRowid}.
+ */
+static int
+get_done_option(ErlNifEnv *env, const ERL_NIF_TERM value, int *done_info)
+{
+     if(enif_is_identical(value, make_atom(env, "atom")))
+	  *done_info = 0;
+     else if(enif_is_identical(value, make_atom(env, "info")))
+	  *done_info = 1;
+     else
+	  return 0;
+
+     return 1;
+}
+
+/*
+ * The options of exec, only {done, atom | info}.
+ */
+static int
+done_option(ErlNifEnv *env, ERL_NIF_TERM opts, int *done_info)
+{
+     ERL_NIF_TERM head;
+     const ERL_NIF_TERM *option;
+     int arity;
+
+     while(enif_get_list_cell(env, opts, &head, &opts)) {
+	  if(!enif_get_tuple(env, head, &arity, &option) || arity != 2)
+	       return 0;
+	  if(!enif_is_identical(option[0], make_atom(env, "done")))
+	       return 0;
+	  if(!get_done_option(env, option[1], done_info))
+	       return 0;
+     }
+
+     return enif_is_empty_list(env, opts);
+}
+
+/*
+ * Skip white space and comments.
+ */
+static const char *
+sql_skip(const char *sql)
+{
+     while(*sql) {
+	  if(isspace((unsigned char) *sql)) {
+	       sql++;
+	  } else if(sql[0] == '-' && sql[1] == '-') {
+	       while(*sql && *sql != '\n')
+		    sql++;
+	  } else if(sql[0] == '/' && sql[1] == '*') {
+	       sql = strstr(sql + 2, "*/");
+	       if(!sql)
+		    return "";
+	       sql += 2;
+	  } else {
+	       break;
+	  }
+     }
+
+     return sql;
+}
+
+/*
+ * Is the next word of sql the keyword? When it is sql is moved past it.
+ */
+static int
+sql_keyword(const char **sql, const char *keyword)
+{
+     const char *p = sql_skip(*sql);
+     size_t n = strlen(keyword);
+
+     if(sqlite3_strnicmp(p, keyword, n) != 0 || isalnum((unsigned char) p[n]) || p[n] == '_')
+	  return 0;
+
+     *sql = p + n;
+     return 1;
+}
+
+/*
+ * Copy the name which comes next in sql, without its quotes.
+ */
+static int
+sql_name(const char *sql, char *name, size_t size)
+{
+     const char *p = sql_skip(sql);
+     char quote = 0;
+     size_t n = 0;
+
+     if(*p == '[') {
+	  quote = ']';
+	  p++;
+     } else if(*p == '"' || *p == '\'' || *p == '`') {
+	  quote = *p++;
+     }
+
+     while(*p && n + 1 < size) {
+	  if(quote ? *p == quote :
+	     !(isalnum((unsigned char) *p) || *p == '_' || *p == '$' || (unsigned char) *p >= 0x80))
+	       break;
+	  name[n++] = *p++;
+     }
+     name[n] = '\0';
+
+     return n > 0;
+}
+
+static void
+savepoints_clear(esqlite_connection *conn)
+{
+     esqlite_savepoint *sp;
+
+     while((sp = conn->savepoints)) {
+	  conn->savepoints = sp->next;
+	  enif_free(sp);
+     }
+}
+
+/*
+ * Drop the buffered changes, after a commit or a rollback.
+ */
+static void
+changes_clear(esqlite_connection *conn)
+{
+     enif_clear_env(conn->changes_env);
+     conn->changes = enif_make_list(conn->changes_env, 0);
+     conn->n_changes = 0;
+     conn->overflow = 0;
+     savepoints_clear(conn);
+}
+
+/*
+ * Drop the changes buffered after the first mark of them, they were
+ * undone.
+ */
+static void
+changes_truncate(esqlite_connection *conn, unsigned int mark)
+{
+     ERL_NIF_TERM head;
+
+     if(conn->overflow)
+	  return;
+
+     while(conn->n_changes > mark &&
+	   enif_get_list_cell(conn->changes_env, conn->changes, &head, &conn->changes))
+	  conn->n_changes--;
+}
+
+/*
+ * Follow the savepoints of the transaction, so a rollback to a
+ * savepoint drops the changes buffered after it was opened. Called
+ * when a statement is done.
+ */
+static void
+changes_savepoint(esqlite_connection *conn, const char *sql)
+{
+     esqlite_savepoint *sp, *next;
+     char name[MAX_ATOM_LENGTH + 1];
+     int rollback = 0;
+
+     if(!sql)
+	  return;
+
+     if(sql_keyword(&sql, "savepoint")) {
+	  if(!sql_name(sql, name, sizeof(name)))
+	       return;
+	  sp = enif_alloc(sizeof(esqlite_savepoint));
+	  if(!sp)
+	       return;
+	  strcpy(sp->name, name);
+	  sp->mark = conn->n_changes;
+	  sp->next = conn->savepoints;
+	  conn->savepoints = sp;
+	  return;
+     }
+
+     if(sql_keyword(&sql, "release")) {
+	  sql_keyword(&sql, "savepoint");
+     } else if(sql_keyword(&sql, "rollback")) {
+	  sql_keyword(&sql, "transaction");
+	  if(!sql_keyword(&sql, "to"))
+	       return;
+	  sql_keyword(&sql, "savepoint");
+	  rollback = 1;
+     } else {
+	  return;
+     }
+
+     if(!sql_name(sql, name, sizeof(name)))
+	  return;
+     for(sp = conn->savepoints; sp; sp = sp->next) {
+	  if(sqlite3_strnicmp(sp->name, name, strlen(name) + 1) == 0)
+	       break;
+     }
+     if(!sp)
+	  return;
+
+     /* the savepoints opened after it are gone as well, a rollback to
+      * it keeps it open */
+     while(conn->savepoints != sp) {
+	  next = conn->savepoints->next;
+	  enif_free(conn->savepoints);
+	  conn->savepoints = next;
+     }
+     if(rollback) {
+	  changes_truncate(conn, sp->mark);
+     } else {
+	  conn->savepoints = sp->next;
+	  enif_free(sp);
+     }
+}
+
+/*
+ * Step a statement of the connection. When a statement fails inside a
+ * transaction its own changes are undone, they are dropped from the
+ * buffer of the subscribers as well.
+ */
+static int
+connection_step(esqlite_connection *conn, sqlite3_stmt *stmt)
+{
+     unsigned int mark = conn->n_changes;
+     int rc;
+
+     rc = sqlite3_step(stmt);
+     if(!conn->subscribers)
+	  return rc;
+
+     if(sqlite3_get_autocommit(conn->db))
+	  savepoints_clear(conn);
+     else if(rc == SQLITE_DONE)
+	  changes_savepoint(conn, sqlite3_sql(stmt));
+     else if(rc != SQLITE_ROW && rc != SQLITE_BUSY)
+	  changes_truncate(conn, mark);
+
+     return rc;
+}
+
 /*
  */
 static ERL_NIF_TERM
 do_exec(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM arg)
 {
      ErlNifBinary bin;
-     int rc;
+     ERL_NIF_TERM sql = arg, error;
+     const ERL_NIF_TERM *sql_opts;
+     sqlite3_stmt *stmt;
+     const char *next, *end;
+     int rc, arity, done_info = 0;
 
-     enif_inspect_iolist_as_binary(env, arg, &bin);
+     if(enif_get_tuple(env, arg, &arity, &sql_opts) && arity == 2) {
+	  sql = sql_opts[0];
+	  if(!done_option(env, sql_opts[1], &done_info))
+	       return make_error_tuple(env, "invalid_option");
+     }
 
-     rc = sqlite3_exec(conn->db, (char *) bin.data, NULL, NULL, NULL);
-     if(rc != SQLITE_OK)
-	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+     enif_inspect_iolist_as_binary(env, sql, &bin);
+
+     /* as sqlite3_exec, but the statements are stepped one by one for
+      * the change feed */
+     next = (const char *) bin.data;
+     end = next + bin.size;
+     while(next < end && *next) {
+	  if(sqlite3_prepare_v2(conn->db, next, end - next, &stmt, &next) != SQLITE_OK)
+	       return make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+	  if(!stmt)
+	       continue; /* whitespace or a comment */
+
+	  while((rc = connection_step(conn, stmt)) == SQLITE_ROW)
+	       ;
+	  if(rc != SQLITE_DONE) {
+	       error = make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+	       sqlite3_finalize(stmt);
+	       return error;
+	  }
+	  sqlite3_finalize(stmt);
+     }
+
+     if(done_info)
+	  return make_done_info(env, conn->db);
 
      return make_atom(env, "ok");
 }
 
+/*
+ * Set the options of a statement. Supported are {row, tuple},
+ * {row, map} and {row, {map, Atoms}}. Map rows are keyed by binary
+ * column names, except for the names in Atoms which get atom keys.
+ * With {encoding, etf} rows are sent as a binary in external term
+ * format, with {encoding, json} as a json binary. {encoding, term} is
+ * the default. {text, binary} gives text cells as binaries instead of
+ * strings. {read_ahead, K} makes the connection thread read up to K
+ * rows ahead for step. With {done, info} step gives
+ * {done, Changes, LastRowid} instead of '$done'.
+ */
+static int
+statement_options(ErlNifEnv *env, esqlite_statement *stmt, ERL_NIF_TERM opts)
+{
+     ERL_NIF_TERM head, atoms, atom;
+     const ERL_NIF_TERM *option, *map;
+     int arity;
+
+     while(enif_get_list_cell(env, opts, &head, &opts)) {
+	  if(!enif_get_tuple(env, head, &arity, &option) || arity != 2)
+	       return 0;
+
+	  if(enif_is_identical(option[0], make_atom(env, "encoding"))) {
+	       if(enif_is_identical(option[1], make_atom(env, "term")))
+		    stmt->encoding = encoding_term;
+	       else if(enif_is_identical(option[1], make_atom(env, "etf")))
+		    stmt->encoding = encoding_etf;
+	       else if(enif_is_identical(option[1], make_atom(env, "json")))
+		    stmt->encoding = encoding_json;
+	       else
+		    return 0;
+	       continue;
+	  }
+
+	  if(enif_is_identical(option[0], make_atom(env, "text"))) {
+	       if(enif_is_identical(option[1], make_atom(env, "string")))
+		    stmt->text_binary = 0;
+	       else if(enif_is_identical(option[1], make_atom(env, "binary")))
+		    stmt->text_binary = 1;
+	       else
+		    return 0;
+	       continue;
+	  }
+
+	  if(enif_is_identical(option[0], make_atom(env, "done"))) {
+	       if(!get_done_option(env, option[1], &stmt->done_info))
+		    return 0;
+	       continue;
+	  }
+
+	  if(enif_is_identical(option[0], make_atom(env, "read_ahead"))) {
+	       if(!enif_get_uint(env, option[1], &stmt->read_ahead))
+		    return 0;
+	       continue;
+	  }
+
+	  if(!enif_is_identical(option[0], make_atom(env, "row")))
+	       return 0;
+
+	  if(enif_is_identical(option[1], make_atom(env, "tuple"))) {
+	       stmt->format = row_tuple;
+	       continue;
+	  }
+
+	  atoms = enif_make_list(env, 0);
+	  if(!enif_is_identical(option[1], make_atom(env, "map"))) {
+	       if(!enif_get_tuple(env, option[1], &arity, &map) || arity != 2)
+		    return 0;
+	       if(!enif_is_identical(map[0], make_atom(env, "map")))
+		    return 0;
+
+	       atoms = map[1];
+	       while(enif_get_list_cell(env, atoms, &atom, &atoms)) {
+		    if(!enif_is_atom(env, atom))
+			 return 0;
+	       }
+	       if(!enif_is_empty_list(env, atoms))
+		    return 0;
+	       atoms = map[1];
+	  }
+
+	  if(!stmt->keys_env) {
+	       stmt->keys_env = enif_alloc_env();
+	       if(!stmt->keys_env)
+		    return 0;
+	  }
+	  stmt->format = row_map;
+	  stmt->atoms = enif_make_copy(stmt->keys_env, atoms);
+     }
+
+     return enif_is_empty_list(env, opts);
+}
+
 /*
  */
 static ERL_NIF_TERM
-do_prepare(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM arg)
+do_prepare(ErlNifEnv *env, esqlite_handle *handle, const ERL_NIF_TERM arg)
 {
+     esqlite_connection *conn = handle->connection;
      ErlNifBinary bin;
      esqlite_statement *stmt;
-     ERL_NIF_TERM esqlite_stmt;
+     ERL_NIF_TERM esqlite_stmt, sql = arg, opts;
+     const ERL_NIF_TERM *sql_opts;
      const char *tail;
-     int rc;
+     int rc, arity;
      int retries = 0;
 
-     enif_inspect_iolist_as_binary(env, arg, &bin);
+     opts = enif_make_list(env, 0);
+     if(enif_get_tuple(env, arg, &arity, &sql_opts) && arity == 2) {
+	  sql = sql_opts[0];
+	  opts = sql_opts[1];
+     }
+
+     enif_inspect_iolist_as_binary(env, sql, &bin);
 
      stmt = enif_alloc_resource(esqlite_statement_type, sizeof(esqlite_statement));
      if(!stmt)
 	  return make_error_tuple(env, "no_memory");
 
+     stmt->handle = NULL;
+     stmt->columns = -1;
+     stmt->plan = plan_typed;
+     stmt->decoders = NULL;
+     stmt->types = NULL;
+     stmt->row = NULL;
+     stmt->format = row_tuple;
+     stmt->keys_env = NULL;
+     stmt->keys = NULL;
+     stmt->row_keys = NULL;
+     stmt->encoding = encoding_term;
+     stmt->text_binary = 0;
+     stmt->done_info = 0;
+     stmt->read_ahead = 0;
+     stmt->ahead_lock = NULL;
+     stmt->ahead_env = NULL;
+     stmt->ahead = NULL;
+     stmt->ahead_fill = NULL;
+     stmt->ahead_next = 0;
+     stmt->ahead_count = 0;
+     stmt->ahead_end = 0;
+     stmt->ahead_pending = 0;
+     stmt->generation = 0;
+     stmt->statement = NULL;
+
+     if(!statement_options(env, stmt, opts)) {
+	  enif_release_resource(stmt);
+	  return make_error_tuple(env, "invalid_option");
+     }
+
+     if(stmt->read_ahead) {
+	  stmt->ahead_lock = enif_mutex_create("esqlite_read_ahead");
+	  stmt->ahead = enif_alloc(sizeof(ERL_NIF_TERM) * stmt->read_ahead);
+	  stmt->ahead_fill = enif_alloc(sizeof(ERL_NIF_TERM) * stmt->read_ahead);
+	  if(!stmt->ahead_lock || !stmt->ahead || !stmt->ahead_fill) {
+	       enif_release_resource(stmt);
+	       return make_error_tuple(env, "no_memory");
+	  }
+     }
+
      do {
        rc = sqlite3_prepare_v2(conn->db, (char *) bin.data, bin.size, &(stmt->statement), &tail);
        usleep(retries * 100);
      } while (rc == SQLITE_BUSY && retries++ < 100);
-     if(rc != SQLITE_OK)
+     if(rc != SQLITE_OK) {
+	  stmt->statement = NULL;
+	  enif_release_resource(stmt);
 	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+     }
 
-     enif_keep_resource(conn);
-     stmt->connection = conn;
+     enif_keep_resource(handle);
+     stmt->handle = handle;
 
      esqlite_stmt = enif_make_resource(env, stmt);
      enif_release_resource(stmt);
@@ -259,6 +1126,7 @@ static int
 bind_cell(ErlNifEnv *env, const ERL_NIF_TERM cell, sqlite3_stmt *stmt, unsigned int i)
 {
      int the_int;
+     ErlNifSInt64 the_int64;
      double the_double;
      char the_atom[MAX_ATOM_LENGTH+1];
      ErlNifBinary the_blob;
@@ -266,6 +1134,9 @@ bind_cell(ErlNifEnv *env, const ERL_NIF_TERM cell, sqlite3_stmt *stmt, unsigned
      if(enif_get_int(env, cell, &the_int))
 	  return sqlite3_bind_int(stmt, i, the_int);
 
+     if(enif_get_int64(env, cell, &the_int64))
+	  return sqlite3_bind_int64(stmt, i, (sqlite3_int64) the_int64);
+
      if(enif_get_double(env, cell, &the_double))
 	  return sqlite3_bind_double(stmt, i, the_double);
 
@@ -292,11 +1163,16 @@ bind_cell(ErlNifEnv *env, const ERL_NIF_TERM cell, sqlite3_stmt *stmt, unsigned
 static ERL_NIF_TERM
 do_bind(ErlNifEnv *env, sqlite3 *db, sqlite3_stmt *stmt, const ERL_NIF_TERM arg)
 {
-     int parameter_count = sqlite3_bind_parameter_count(stmt);
+     int parameter_count;
      int i, is_list, r;
      ERL_NIF_TERM list, head, tail;
      unsigned int list_length;
 
+     if(!stmt)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     parameter_count = sqlite3_bind_parameter_count(stmt);
+
      is_list = enif_get_list_length(env, arg, &list_length);
      if(!is_list)
 	  return make_error_tuple(env, "bad_arg_list");
@@ -324,6 +1200,15 @@ make_binary(ErlNifEnv *env, const void *bytes, unsigned int size)
 {
      ErlNifBinary blob;
      ERL_NIF_TERM term;
+     unsigned char *data;
+
+     /* Small binaries are made on the heap, without a refc binary */
+     if(size <= MAX_HEAP_BINARY) {
+	  data = enif_make_new_binary(env, size, &term);
+	  if(size)
+	       memcpy(data, bytes, size);
+	  return term;
+     }
 
      if(!enif_alloc_binary(size, &blob)) {
 	  /* TODO: fix this */
@@ -337,251 +1222,4530 @@ make_binary(ErlNifEnv *env, const void *bytes, unsigned int size)
      return term;
 }
 
-static ERL_NIF_TERM
-make_cell(ErlNifEnv *env, sqlite3_stmt *statement, unsigned int i)
-{
-     int type = sqlite3_column_type(statement, i);
+/* growable binary, turned into a term without copying */
+typedef struct {
+     ErlNifBinary bin;
+     size_t size;
+} esqlite_buffer;
 
-     switch(type) {
-     case SQLITE_INTEGER:
-	  return enif_make_int(env, sqlite3_column_int(statement, i));
-     case SQLITE_FLOAT:
-	  return enif_make_double(env, sqlite3_column_double(statement, i));
-     case SQLITE_BLOB:
-	  return make_binary(env, sqlite3_column_blob(statement, i), sqlite3_column_bytes(statement, i));
-     case SQLITE_NULL:
-	  return make_atom(env, "undefined");
-     case SQLITE_TEXT:
-	  /* TODO, make some tests to see what happens when you insert a utf-8 string */
-	  return enif_make_string(env, (char *) sqlite3_column_text(statement, i), ERL_NIF_LATIN1);
-     default:
-	  return make_atom(env, "should_not_happen");
+static void
+buffer_init(esqlite_buffer *buf)
+{
+     buf->bin.data = NULL;
+     buf->bin.size = 0;
+     buf->size = 0;
+}
+
+static void
+buffer_release(esqlite_buffer *buf)
+{
+     if(buf->bin.data)
+	  enif_release_binary(&buf->bin);
+     buffer_init(buf);
+}
+
+static unsigned char *
+buffer_reserve(esqlite_buffer *buf, size_t size)
+{
+     size_t needed = buf->size + size;
+     size_t new_size;
+
+     if(needed > buf->bin.size) {
+	  new_size = needed < 64 ? 64 : needed * 2;
+	  if(!buf->bin.data) {
+	       if(!enif_alloc_binary(new_size, &buf->bin))
+		    return NULL;
+	  } else if(!enif_realloc_binary(&buf->bin, new_size)) {
+	       return NULL;
+	  }
      }
+
+     return buf->bin.data + buf->size;
+}
+
+static int
+buffer_append(esqlite_buffer *buf, const void *bytes, size_t size)
+{
+     unsigned char *p = buffer_reserve(buf, size);
+
+     if(!p)
+	  return 0;
+
+     if(size)
+	  memcpy(p, bytes, size);
+     buf->size += size;
+     return 1;
+}
+
+static int
+buffer_append_zeros(esqlite_buffer *buf, size_t size)
+{
+     /* reserve a byte at least, so the buffer is allocated */
+     unsigned char *p = buffer_reserve(buf, size ? size : 1);
+
+     if(!p)
+	  return 0;
+
+     memset(p, 0, size);
+     buf->size += size;
+     return 1;
 }
 
+/*
+ * Make a binary term of the buffer. The buffer is empty afterwards.
+ */
 static ERL_NIF_TERM
-make_row(ErlNifEnv *env, sqlite3_stmt *statement)
+buffer_make_binary(ErlNifEnv *env, esqlite_buffer *buf)
 {
-     int i, size;
-     ERL_NIF_TERM *array;
-     ERL_NIF_TERM row;
+     ERL_NIF_TERM term;
 
-     size = sqlite3_column_count(statement);
-     array = (ERL_NIF_TERM *) malloc(sizeof(ERL_NIF_TERM)*size);
+     if(!buf->bin.data && !enif_alloc_binary(0, &buf->bin))
+	  return make_atom(env, "error");
+     if(buf->bin.size != buf->size)
+	  enif_realloc_binary(&buf->bin, buf->size);
 
-     if(!array)
-	  return make_error_tuple(env, "no_memory");
+     term = enif_make_binary(env, &buf->bin);
+     buffer_init(buf);
+     return term;
+}
+
+/* blob cell of a chunk, pointing into the arena of the chunk */
+typedef struct {
+     size_t cell;
+     size_t offset;
+     size_t size;
+} esqlite_arena_slice;
+
+/* text or large blob seen earlier in a chunk */
+typedef struct {
+     int type;                /* SQLITE_TEXT or SQLITE_BLOB, 0 for a free slot */
+     unsigned int hash;
+     size_t offset;           /* of the bytes in the arena */
+     size_t size;
+} esqlite_dict_entry;
+
+/* rows of one fetch, the bytes of large blobs share one arena binary */
+typedef struct esqlite_chunk {
+     unsigned int columns;
+     unsigned int rows;
+     ERL_NIF_TERM *cells;     /* rows * columns cells, row by row */
+     size_t max_cells;
+     esqlite_buffer arena;
+     esqlite_arena_slice *slices;
+     size_t n_slices;
+     size_t max_slices;
+     int failed;
+
+     /* repeated values share the arena bytes of their first cell,
+      * sub binaries stay shared when the rows are sent */
+     esqlite_dict_entry *dict;
+     size_t dict_slots;       /* power of two */
+     size_t dict_entries;
+} esqlite_chunk;
+
+static void
+chunk_init(esqlite_chunk *chunk, unsigned int columns)
+{
+     chunk->columns = columns;
+     chunk->rows = 0;
+     chunk->cells = NULL;
+     chunk->max_cells = 0;
+     buffer_init(&chunk->arena);
+     chunk->slices = NULL;
+     chunk->n_slices = 0;
+     chunk->max_slices = 0;
+     chunk->failed = 0;
+     chunk->dict = NULL;
+     chunk->dict_slots = 0;
+     chunk->dict_entries = 0;
+}
+
+static void
+chunk_release(esqlite_chunk *chunk)
+{
+     if(chunk->cells)
+	  enif_free(chunk->cells);
+     if(chunk->slices)
+	  enif_free(chunk->slices);
+     if(chunk->dict)
+	  enif_free(chunk->dict);
+     buffer_release(&chunk->arena);
+     chunk_init(chunk, 0);
+}
+
+/*
+ * Point the cell at bytes in the arena. The cell is filled in when the
+ * arena is complete.
+ */
+static int
+chunk_push_slice(esqlite_chunk *chunk, size_t cell, size_t offset, size_t size)
+{
+     esqlite_arena_slice *slice;
+     void *p;
+
+     if(chunk->n_slices == chunk->max_slices) {
+	  chunk->max_slices = chunk->max_slices ? chunk->max_slices * 2 : 16;
+	  p = enif_realloc(chunk->slices, sizeof(esqlite_arena_slice) * chunk->max_slices);
+	  if(!p)
+	       return 0;
+	  chunk->slices = p;
+     }
+
+     slice = chunk->slices + chunk->n_slices++;
+     slice->cell = cell;
+     slice->offset = offset;
+     slice->size = size;
+
+     return 1;
+}
+
+/*
+ * Copy a large blob into the arena.
+ */
+static int
+chunk_add_slice(esqlite_chunk *chunk, size_t cell, const void *bytes, size_t size)
+{
+     return chunk_push_slice(chunk, cell, chunk->arena.size, size) &&
+	  buffer_append(&chunk->arena, bytes, size);
+}
+
+static unsigned int
+hash_bytes(int type, const unsigned char *bytes, size_t size)
+{
+     unsigned int hash = 2166136261u ^ type; /* FNV-1a */
+     size_t i;
 
      for(i = 0; i < size; i++)
-	  array[i] = make_cell(env, statement, i);
+	  hash = (hash ^ bytes[i]) * 16777619u;
 
-     row = enif_make_tuple_from_array(env, array, size);
-     free(array);
-     return row;
+     return hash;
+}
+
+/*
+ * Find the entry of an earlier cell with the same value, or the free
+ * slot for it. NULL when the chunk has no dictionary.
+ */
+static esqlite_dict_entry *
+chunk_find(esqlite_chunk *chunk, int type, unsigned int hash, const void *bytes, size_t size)
+{
+     esqlite_dict_entry *entry;
+     size_t slot;
+
+     if(!chunk->dict)
+	  return NULL;
+
+     for(slot = hash & (chunk->dict_slots - 1); ; slot = (slot + 1) & (chunk->dict_slots - 1)) {
+	  entry = chunk->dict + slot;
+	  if(!entry->type)
+	       return entry;
+	  if(entry->type != type || entry->hash != hash || entry->size != size)
+	       continue;
+
+	  if(memcmp(chunk->arena.bin.data + entry->offset, bytes, size) == 0)
+	       return entry;
+     }
+}
+
+/*
+ * Make room for one more entry, keeping at least half of the slots
+ * free. Returns 0 when no more values can be remembered.
+ */
+static int
+chunk_grow_dict(esqlite_chunk *chunk)
+{
+     esqlite_dict_entry *old = chunk->dict, *entry;
+     size_t old_slots = chunk->dict_slots, i, slot;
+
+     if(chunk->dict_entries >= MAX_DICTIONARY_ENTRIES)
+	  return 0;
+     if(chunk->dict && (chunk->dict_entries + 1) * 2 <= chunk->dict_slots)
+	  return 1;
+
+     chunk->dict_slots = old_slots ? old_slots * 2 : 64;
+     chunk->dict = enif_alloc(sizeof(esqlite_dict_entry) * chunk->dict_slots);
+     if(!chunk->dict) {
+	  chunk->dict = old;
+	  chunk->dict_slots = old_slots;
+	  return 0;
+     }
+     memset(chunk->dict, 0, sizeof(esqlite_dict_entry) * chunk->dict_slots);
+
+     for(i = 0; i < old_slots; i++) {
+	  if(!old[i].type)
+	       continue;
+	  slot = old[i].hash & (chunk->dict_slots - 1);
+	  while(chunk->dict[slot].type)
+	       slot = (slot + 1) & (chunk->dict_slots - 1);
+	  entry = chunk->dict + slot;
+	  *entry = old[i];
+     }
+
+     if(old)
+	  enif_free(old);
+     return 1;
+}
+
+/*
+ * Remember a value which was just copied into the arena at offset.
+ */
+static void
+chunk_remember(esqlite_chunk *chunk, int type, unsigned int hash, const void *bytes,
+	       size_t size, size_t offset)
+{
+     esqlite_dict_entry *entry;
+
+     if(!chunk_grow_dict(chunk))
+	  return;
+
+     entry = chunk_find(chunk, type, hash, bytes, size);
+     entry->type = type;
+     entry->hash = hash;
+     entry->offset = offset;
+     entry->size = size;
+     chunk->dict_entries++;
+}
+
+/*
+ * Point the cell at the bytes of a value in the arena. Repeats point at
+ * the bytes of the first one. The cell is filled in when the arena is
+ * complete.
+ */
+static void
+chunk_share(esqlite_chunk *chunk, int type, size_t cell, const void *bytes, size_t size)
+{
+     esqlite_dict_entry *entry;
+     unsigned int hash;
+     size_t offset;
+
+     hash = hash_bytes(type, bytes, size);
+     entry = chunk_find(chunk, type, hash, bytes, size);
+     if(entry && entry->type) {
+	  if(!chunk_push_slice(chunk, cell, entry->offset, size))
+	       chunk->failed = 1;
+	  return;
+     }
+
+     offset = chunk->arena.size;
+     if(!chunk_add_slice(chunk, cell, bytes, size))
+	  chunk->failed = 1;
+     else
+	  chunk_remember(chunk, type, hash, bytes, size, offset);
 }
 
+/*
+ * Cell decoders. Each one expects the cell to be of its type. When a
+ * chunk is given, the bytes of large blobs and of binary text are added
+ * to its arena.
+ */
 static ERL_NIF_TERM
-do_step(ErlNifEnv *env, sqlite3_stmt *stmt)
+decode_integer(ErlNifEnv *env, esqlite_chunk *chunk, sqlite3_stmt *stmt, unsigned int i, size_t cell)
 {
-     int rc = sqlite3_step(stmt);
+     return enif_make_int64(env, sqlite3_column_int64(stmt, i));
+}
 
-     if(rc == SQLITE_DONE)
-	  return make_atom(env, "$done");
-     if(rc == SQLITE_BUSY)
-	  return make_atom(env, "$busy");
-     if(rc == SQLITE_ROW)
-	  return make_row(env, stmt);
+static ERL_NIF_TERM
+decode_float(ErlNifEnv *env, esqlite_chunk *chunk, sqlite3_stmt *stmt, unsigned int i, size_t cell)
+{
+     return enif_make_double(env, sqlite3_column_double(stmt, i));
+}
 
-     return make_error_tuple(env, "unexpected_return_value");
+static ERL_NIF_TERM
+decode_text(ErlNifEnv *env, esqlite_chunk *chunk, sqlite3_stmt *stmt, unsigned int i, size_t cell)
+{
+     return enif_make_string(env, (char *) sqlite3_column_text(stmt, i), ERL_NIF_LATIN1);
 }
 
+/*
+ * Text as a binary. In a chunk every distinct value is copied into the
+ * arena once, so low cardinality columns cost one sub binary per cell.
+ */
 static ERL_NIF_TERM
-do_column_names(ErlNifEnv *env, sqlite3_stmt *stmt)
+decode_text_binary(ErlNifEnv *env, esqlite_chunk *chunk, sqlite3_stmt *stmt, unsigned int i, size_t cell)
 {
-     int i, size;
+     const unsigned char *bytes = sqlite3_column_text(stmt, i);
+     size_t size = sqlite3_column_bytes(stmt, i);
+
+     if(!chunk)
+	  return make_binary(env, bytes, size);
+
+     chunk_share(chunk, SQLITE_TEXT, cell, bytes, size);
+     return 0;
+}
+
+static ERL_NIF_TERM
+decode_blob(ErlNifEnv *env, esqlite_chunk *chunk, sqlite3_stmt *stmt, unsigned int i, size_t cell)
+{
+     const void *bytes = sqlite3_column_blob(stmt, i);
+     size_t size = sqlite3_column_bytes(stmt, i);
+
+     /* small blobs are made on the heap of the receiver, a sub binary
+      * would not be smaller */
+     if(!chunk || size <= MAX_HEAP_BINARY)
+	  return make_binary(env, bytes, size);
+
+     chunk_share(chunk, SQLITE_BLOB, cell, bytes, size);
+     return 0;
+}
+
+static ERL_NIF_TERM
+decode_null(ErlNifEnv *env, esqlite_chunk *chunk, sqlite3_stmt *stmt, unsigned int i, size_t cell)
+{
+     return make_atom(env, "undefined");
+}
+
+/* indexed by sqlite type */
+static const cell_decoder type_decoders[] = {
+     decode_null, decode_integer, decode_float, decode_text, decode_blob, decode_null
+};
+
+static ERL_NIF_TERM
+decode_any(ErlNifEnv *env, esqlite_chunk *chunk, sqlite3_stmt *stmt, unsigned int i, size_t cell)
+{
+     return type_decoders[sqlite3_column_type(stmt, i)](env, chunk, stmt, i, cell);
+}
+
+/* decoder of a type for the statement */
+static cell_decoder
+statement_decoder(esqlite_statement *stmt, int type)
+{
+     if(type == SQLITE_TEXT && stmt->text_binary)
+	  return decode_text_binary;
+     return type_decoders[type];
+}
+
+/*
+ * Type of a column according to its declared type, using the affinity
+ * rules of sqlite. SQLITE_NULL when nothing can be predicted.
+ */
+static int
+declared_type(const char *decltype)
+{
+     static const struct { const char *name; int type; } affinities[] = {
+	  {"INT", SQLITE_INTEGER},
+	  {"CHAR", SQLITE_TEXT}, {"CLOB", SQLITE_TEXT}, {"TEXT", SQLITE_TEXT},
+	  {"BLOB", SQLITE_BLOB},
+	  {"REAL", SQLITE_FLOAT}, {"FLOA", SQLITE_FLOAT}, {"DOUB", SQLITE_FLOAT}
+     };
+     const char *p;
+     unsigned int i, j;
+
+     if(!decltype)
+	  return SQLITE_NULL;
+
+     for(i = 0; i < sizeof(affinities) / sizeof(affinities[0]); i++) {
+	  for(p = decltype; *p; p++) {
+	       for(j = 0; affinities[i].name[j]; j++) {
+		    if((p[j] & ~0x20) != affinities[i].name[j])
+			 break;
+	       }
+	       if(!affinities[i].name[j])
+		    return affinities[i].type;
+	  }
+     }
+
+     return SQLITE_NULL;
+}
+
+/*
+ * Make the map key of every column. Names found in the atoms of the
+ * statement become atoms, the others binaries. Atoms are never created
+ * from column names.
+ */
+static int
+statement_keys(esqlite_statement *stmt, int columns)
+{
+     char atom[MAX_ATOM_LENGTH+1];
+     ERL_NIF_TERM atoms, head;
      const char *name;
-     ERL_NIF_TERM *array;
-     ERL_NIF_TERM column_names;
+     void *p;
+     int i;
+
+     p = enif_realloc(stmt->keys, sizeof(ERL_NIF_TERM) * (columns + 1));
+     if(!p)
+	  return 0;
+     stmt->keys = p;
+     p = enif_realloc(stmt->row_keys, sizeof(ERL_NIF_TERM) * (columns + 1));
+     if(!p)
+	  return 0;
+     stmt->row_keys = p;
+
+     for(i = 0; i < columns; i++) {
+	  name = sqlite3_column_name(stmt->statement, i);
+	  if(!name)
+	       return 0;
+
+	  stmt->keys[i] = 0;
+	  atoms = stmt->atoms;
+	  while(enif_get_list_cell(stmt->keys_env, atoms, &head, &atoms)) {
+	       if(enif_get_atom(stmt->keys_env, head, atom, sizeof(atom), ERL_NIF_LATIN1) &&
+		  strcmp(atom, name) == 0) {
+		    stmt->keys[i] = head;
+		    break;
+	       }
+	  }
 
-     size = sqlite3_column_count(stmt);
-     array = (ERL_NIF_TERM *) malloc(sizeof(ERL_NIF_TERM) * size);
+	  if(!stmt->keys[i])
+	       stmt->keys[i] = make_binary(stmt->keys_env, name, strlen(name));
+     }
 
-     if(!array)
-	  return make_error_tuple(env, "no_memory");
+     return 1;
+}
+
+/*
+ * Make the decoder plan of the statement from the current row, unless
+ * the statement already has a plan for this number of columns. The
+ * type of each column is predicted from this row, or from its declared
+ * type when the cell is NULL.
+ */
+static int
+statement_plan(esqlite_statement *stmt)
+{
+     sqlite3_stmt *s = stmt->statement;
+     int i, type, columns = sqlite3_column_count(s);
+     int integers = 1;
+     void *p;
+
+     if(columns == stmt->columns)
+	  return 1;
+
+     stmt->columns = -1;
+     p = enif_realloc(stmt->decoders, sizeof(cell_decoder) * (columns + 1));
+     if(!p)
+	  return 0;
+     stmt->decoders = p;
+     p = enif_realloc(stmt->types, columns + 1);
+     if(!p)
+	  return 0;
+     stmt->types = p;
+     p = enif_realloc(stmt->row, sizeof(ERL_NIF_TERM) * (columns + 1));
+     if(!p)
+	  return 0;
+     stmt->row = p;
+
+     if(stmt->format == row_map && !statement_keys(stmt, columns))
+	  return 0;
+
+     for(i = 0; i < columns; i++) {
+	  type = sqlite3_column_type(s, i);
+	  if(type == SQLITE_NULL)
+	       type = declared_type(sqlite3_column_decltype(s, i));
+
+	  stmt->types[i] = type;
+	  stmt->decoders[i] = statement_decoder(stmt, type);
+	  integers = integers && type == SQLITE_INTEGER;
+     }
+
+     stmt->plan = integers ? plan_integers : plan_typed;
+     stmt->columns = columns;
+     return 1;
+}
+
+/*
+ * Decode the current row into cells with the plan of the statement.
+ * Cells which differ from the predicted type take the generic path.
+ */
+static void
+decode_row(ErlNifEnv *env, esqlite_statement *stmt, esqlite_chunk *chunk,
+	   ERL_NIF_TERM *cells, size_t first)
+{
+     sqlite3_stmt *s = stmt->statement;
+     int i, type;
+
+     if(stmt->plan == plan_integers) {
+	  for(i = 0; i < stmt->columns; i++) {
+	       type = sqlite3_column_type(s, i);
+	       if(type == SQLITE_INTEGER)
+		    cells[i] = enif_make_int64(env, sqlite3_column_int64(s, i));
+	       else
+		    cells[i] = statement_decoder(stmt, type)(env, chunk, s, i, first + i);
+	  }
+	  return;
+     }
+
+     for(i = 0; i < stmt->columns; i++) {
+	  type = sqlite3_column_type(s, i);
+	  if(type == stmt->types[i])
+	       cells[i] = stmt->decoders[i](env, chunk, s, i, first + i);
+	  else
+	       cells[i] = statement_decoder(stmt, type)(env, chunk, s, i, first + i);
+     }
+}
 
+/*
+ * Copy the keys of the statement into env, once per answer.
+ */
+static void
+copy_keys(ErlNifEnv *env, esqlite_statement *stmt)
+{
+     int i;
+
+     for(i = 0; i < stmt->columns; i++)
+	  stmt->row_keys[i] = enif_make_copy(env, stmt->keys[i]);
+}
+
+/*
+ * Make a row from decoded cells, a tuple or a map with the copied keys.
+ * Fails when the map would have duplicate keys.
+ */
+static int
+make_row_term(ErlNifEnv *env, esqlite_statement *stmt, ERL_NIF_TERM *cells, ERL_NIF_TERM *row)
+{
+     if(stmt->format == row_tuple) {
+	  *row = enif_make_tuple_from_array(env, cells, stmt->columns);
+	  return 1;
+     }
+
+     return enif_make_map_from_arrays(env, stmt->row_keys, cells, stmt->columns, row);
+}
+
+/*
+ * Length of the valid utf-8 sequence at the start of text, 0 when it
+ * is not valid. Overlong forms and surrogates are not valid.
+ */
+static size_t
+utf8_length(const unsigned char *text, size_t size)
+{
+     unsigned char c = text[0], lo = 0x80, hi = 0xbf;
+     size_t n, i;
+
+     if(c < 0x80)
+	  return 1;
+     if(c >= 0xc2 && c <= 0xdf)
+	  n = 2;
+     else if(c >= 0xe0 && c <= 0xef)
+	  n = 3;
+     else if(c >= 0xf0 && c <= 0xf4)
+	  n = 4;
+     else
+	  return 0;
+
+     if(c == 0xe0)
+	  lo = 0xa0;
+     else if(c == 0xed)
+	  hi = 0x9f;
+     else if(c == 0xf0)
+	  lo = 0x90;
+     else if(c == 0xf4)
+	  hi = 0x8f;
+
+     if(n > size || text[1] < lo || text[1] > hi)
+	  return 0;
+     for(i = 2; i < n; i++) {
+	  if(text[i] < 0x80 || text[i] > 0xbf)
+	       return 0;
+     }
+     return n;
+}
+
+/*
+ * Json encoding, straight from the columns of the current row. Texts
+ * are expected to be utf-8, invalid bytes become U+FFFD. Blobs become
+ * base64 strings. Map rows are objects keyed by column name, tuple rows
+ * are arrays.
+ */
+static int
+json_append_string(esqlite_buffer *buf, const unsigned char *text, size_t size)
+{
+     static const char hex[] = "0123456789abcdef";
+     unsigned char *start, *p;
+     size_t i, n;
+
+     start = p = buffer_reserve(buf, size * 6 + 2);
+     if(!p)
+	  return 0;
+
+     *p++ = '"';
      for(i = 0; i < size; i++) {
-	  name = sqlite3_column_name(stmt, i);
-	  array[i] = make_atom(env, name);
+	  if(text[i] >= 0x80) {
+	       n = utf8_length(text + i, size - i);
+	       if(n) {
+		    memcpy(p, text + i, n);
+		    p += n;
+		    i += n - 1;
+	       } else {
+		    *p++ = 0xef; *p++ = 0xbf; *p++ = 0xbd;
+	       }
+	       continue;
+	  }
+
+	  switch(text[i]) {
+	  case '"':  *p++ = '\\'; *p++ = '"'; break;
+	  case '\\': *p++ = '\\'; *p++ = '\\'; break;
+	  case '\b': *p++ = '\\'; *p++ = 'b'; break;
+	  case '\f': *p++ = '\\'; *p++ = 'f'; break;
+	  case '\n': *p++ = '\\'; *p++ = 'n'; break;
+	  case '\r': *p++ = '\\'; *p++ = 'r'; break;
+	  case '\t': *p++ = '\\'; *p++ = 't'; break;
+	  default:
+	       if(text[i] < 0x20) {
+		    *p++ = '\\'; *p++ = 'u'; *p++ = '0'; *p++ = '0';
+		    *p++ = hex[text[i] >> 4];
+		    *p++ = hex[text[i] & 0xf];
+	       } else {
+		    *p++ = text[i];
+	       }
+	  }
      }
+     *p++ = '"';
 
-     column_names = enif_make_tuple_from_array(env, array, size);
-     free(array);
-     return column_names;
+     buf->size += p - start;
+     return 1;
 }
 
-static ERL_NIF_TERM
-do_close(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM arg)
+static int
+json_append_base64(esqlite_buffer *buf, const unsigned char *bytes, size_t size)
 {
-     int rc;
+     static const char digits[] =
+	  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+     unsigned char *start, *p;
+     unsigned int n;
+     size_t i;
+
+     start = p = buffer_reserve(buf, (size + 2) / 3 * 4 + 2);
+     if(!p)
+	  return 0;
+
+     *p++ = '"';
+     for(i = 0; i + 2 < size; i += 3) {
+	  n = (bytes[i] << 16) | (bytes[i + 1] << 8) | bytes[i + 2];
+	  *p++ = digits[(n >> 18) & 0x3f];
+	  *p++ = digits[(n >> 12) & 0x3f];
+	  *p++ = digits[(n >> 6) & 0x3f];
+	  *p++ = digits[n & 0x3f];
+     }
+     if(i < size) {
+	  n = bytes[i] << 16;
+	  if(i + 1 < size)
+	       n |= bytes[i + 1] << 8;
+	  *p++ = digits[(n >> 18) & 0x3f];
+	  *p++ = digits[(n >> 12) & 0x3f];
+	  *p++ = i + 1 < size ? digits[(n >> 6) & 0x3f] : '=';
+	  *p++ = '=';
+     }
+     *p++ = '"';
 
-     rc = sqlite3_close(conn->db);
-     if(rc != SQLITE_OK)
-	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+     buf->size += p - start;
+     return 1;
+}
 
-     conn->db = NULL;
-     return make_atom(env, "ok");
+/*
+ * The shortest of %.15g, %.16g and %.17g which reads back as d.
+ */
+static void
+json_double(char *number, size_t size, double d)
+{
+     int precision;
+
+     for(precision = 15; precision < 17; precision++) {
+	  snprintf(number, size, "%.*g", precision, d);
+	  if(strtod(number, NULL) == d)
+	       return;
+     }
+     snprintf(number, size, "%.17g", d);
+}
+
+static int
+json_append_cell(esqlite_buffer *buf, sqlite3_stmt *stmt, int i)
+{
+     char number[32];
+     double d;
+
+     switch(sqlite3_column_type(stmt, i)) {
+     case SQLITE_INTEGER:
+	  snprintf(number, sizeof(number), "%lld", (long long) sqlite3_column_int64(stmt, i));
+	  return buffer_append(buf, number, strlen(number));
+     case SQLITE_FLOAT:
+	  d = sqlite3_column_double(stmt, i);
+	  if(!isfinite(d))
+	       return buffer_append(buf, "null", 4);
+	  json_double(number, sizeof(number), d);
+	  return buffer_append(buf, number, strlen(number));
+     case SQLITE_TEXT:
+	  return json_append_string(buf, sqlite3_column_text(stmt, i), sqlite3_column_bytes(stmt, i));
+     case SQLITE_BLOB:
+	  return json_append_base64(buf, sqlite3_column_blob(stmt, i), sqlite3_column_bytes(stmt, i));
+     default:
+	  return buffer_append(buf, "null", 4);
+     }
+}
+
+static int
+json_append_row(esqlite_buffer *buf, esqlite_statement *stmt)
+{
+     sqlite3_stmt *s = stmt->statement;
+     int object = stmt->format == row_map;
+     int i, columns = sqlite3_column_count(s);
+     const char *name;
+
+     if(!buffer_append(buf, object ? "{" : "[", 1))
+	  return 0;
+
+     for(i = 0; i < columns; i++) {
+	  if(i && !buffer_append(buf, ",", 1))
+	       return 0;
+	  if(object) {
+	       name = sqlite3_column_name(s, i);
+	       if(!name || !json_append_string(buf, (const unsigned char *) name, strlen(name)) ||
+		  !buffer_append(buf, ":", 1))
+		    return 0;
+	  }
+	  if(!json_append_cell(buf, s, i))
+	       return 0;
+     }
+
+     return buffer_append(buf, object ? "}" : "]", 1);
+}
+
+static ERL_NIF_TERM
+make_json_row(ErlNifEnv *env, esqlite_statement *stmt)
+{
+     esqlite_buffer buf;
+
+     buffer_init(&buf);
+     if(!json_append_row(&buf, stmt)) {
+	  buffer_release(&buf);
+	  return make_error_tuple(env, "no_memory");
+     }
+
+     return buffer_make_binary(env, &buf);
+}
+
+/*
+ * Encode rows, or a single row, the way the statement sends them.
+ */
+static ERL_NIF_TERM
+encode_rows(ErlNifEnv *env, esqlite_statement *stmt, ERL_NIF_TERM rows)
+{
+     ErlNifBinary bin;
+
+     if(stmt->encoding == encoding_term)
+	  return rows;
+
+     if(!enif_term_to_binary(env, rows, &bin))
+	  return make_error_tuple(env, "no_memory");
+     return enif_make_binary(env, &bin);
+}
+
+static ERL_NIF_TERM
+make_row(ErlNifEnv *env, esqlite_statement *stmt)
+{
+     ERL_NIF_TERM row;
+
+     if(stmt->encoding == encoding_json)
+	  return make_json_row(env, stmt);
+     if(!statement_plan(stmt))
+	  return make_error_tuple(env, "no_memory");
+
+     decode_row(env, stmt, NULL, stmt->row, 0);
+     if(stmt->format == row_map)
+	  copy_keys(env, stmt);
+     if(!make_row_term(env, stmt, stmt->row, &row))
+	  return make_error_tuple(env, "duplicate_column_names");
+
+     return encode_rows(env, stmt, row);
+}
+
+static ERL_NIF_TERM
+make_done(ErlNifEnv *env, esqlite_statement *stmt)
+{
+     if(stmt->done_info)
+	  return make_done_info(env, stmt->handle->connection->db);
+
+     return make_atom(env, "$done");
+}
+
+/*
+ * Queue a command which reads the next batch of rows ahead, unless one
+ * is queued already.
+ */
+static void
+schedule_read_ahead(esqlite_statement *stmt)
+{
+     esqlite_command *cmd;
+
+     enif_mutex_lock(stmt->ahead_lock);
+     if(stmt->ahead_pending) {
+	  enif_mutex_unlock(stmt->ahead_lock);
+	  return;
+     }
+     stmt->ahead_pending = 1;
+     enif_mutex_unlock(stmt->ahead_lock);
+
+     cmd = command_create();
+     if(cmd) {
+	  cmd->type = cmd_read_ahead;
+	  command_keep_statement(cmd, stmt);
+	  if(queue_push(stmt->handle->connection->commands, cmd))
+	       return;
+	  command_destroy(cmd);
+     }
+
+     enif_mutex_lock(stmt->ahead_lock);
+     stmt->ahead_pending = 0;
+     enif_mutex_unlock(stmt->ahead_lock);
+}
+
+/*
+ * Take the next answer read ahead, copied into env. Returns 0 when
+ * there is none. The next batch is scheduled when this one is used up.
+ */
+static int
+take_read_ahead(ErlNifEnv *env, esqlite_statement *stmt, ERL_NIF_TERM *answer)
+{
+     int refill;
+
+     enif_mutex_lock(stmt->ahead_lock);
+     if(stmt->ahead_next == stmt->ahead_count) {
+	  enif_mutex_unlock(stmt->ahead_lock);
+	  return 0;
+     }
+
+     *answer = enif_make_copy(env, stmt->ahead[stmt->ahead_next++]);
+     refill = stmt->ahead_next == stmt->ahead_count && !stmt->ahead_end;
+     enif_mutex_unlock(stmt->ahead_lock);
+
+     if(refill)
+	  schedule_read_ahead(stmt);
+     return 1;
+}
+
+/*
+ * Drop the answers read ahead, the statement is about to be reset.
+ * Called when the command is made, so no step takes a buffered answer
+ * after it, and again on the connection thread, as a read ahead queued
+ * before the command may have filled the buffer in between.
+ */
+static void
+forget_read_ahead(esqlite_statement *stmt)
+{
+     if(!stmt->read_ahead)
+	  return;
+
+     enif_mutex_lock(stmt->ahead_lock);
+     stmt->generation++;
+     stmt->ahead_next = stmt->ahead_count = 0;
+     stmt->ahead_end = 0;
+     enif_mutex_unlock(stmt->ahead_lock);
+}
+
+/*
+ * Read the next batch of answers while nobody waits for this
+ * statement. The batch is dropped when the answers were forgotten in
+ * the mean time.
+ */
+static void
+do_read_ahead(esqlite_statement *stmt)
+{
+     ErlNifEnv *env;
+     unsigned int generation, n = 0;
+     int rc, busy, end = 0;
+
+     enif_mutex_lock(stmt->ahead_lock);
+     stmt->ahead_pending = 0;
+     generation = stmt->generation;
+     busy = stmt->ahead_next < stmt->ahead_count;
+     enif_mutex_unlock(stmt->ahead_lock);
+
+     if(!stmt->statement || busy)
+	  return;
+
+     env = enif_alloc_env();
+     if(!env)
+	  return;
+
+     while(n < stmt->read_ahead && !end) {
+	  rc = connection_step(stmt->handle->connection, stmt->statement);
+
+	  end = 1;
+	  if(rc == SQLITE_ROW) {
+	       stmt->ahead_fill[n] = make_row(env, stmt);
+	       end = 0;
+	  } else if(rc == SQLITE_DONE) {
+	       stmt->ahead_fill[n] = make_done(env, stmt);
+	  } else if(rc == SQLITE_BUSY) {
+	       stmt->ahead_fill[n] = make_atom(env, "$busy");
+	  } else {
+	       stmt->ahead_fill[n] = make_error_tuple(env, "unexpected_return_value");
+	  }
+	  n++;
+     }
+
+     enif_mutex_lock(stmt->ahead_lock);
+     if(generation == stmt->generation && stmt->ahead_next == stmt->ahead_count) {
+	  if(stmt->ahead_env)
+	       enif_free_env(stmt->ahead_env);
+	  stmt->ahead_env = env;
+	  memcpy(stmt->ahead, stmt->ahead_fill, sizeof(ERL_NIF_TERM) * n);
+	  stmt->ahead_next = 0;
+	  stmt->ahead_count = n;
+	  stmt->ahead_end = end;
+	  env = NULL;
+     }
+     enif_mutex_unlock(stmt->ahead_lock);
+
+     if(env)
+	  enif_free_env(env);
+}
+
+static ERL_NIF_TERM
+do_step(ErlNifEnv *env, esqlite_statement *stmt)
+{
+     ERL_NIF_TERM answer;
+     int rc;
+
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     /* answers read ahead come first */
+     if(stmt->read_ahead && take_read_ahead(env, stmt, &answer))
+	  return answer;
+
+     rc = connection_step(stmt->handle->connection, stmt->statement);
+
+     if(rc == SQLITE_DONE)
+	  return make_done(env, stmt);
+     if(rc == SQLITE_BUSY)
+	  return make_atom(env, "$busy");
+     if(rc == SQLITE_ROW) {
+	  if(stmt->read_ahead)
+	       schedule_read_ahead(stmt);
+	  return make_row(env, stmt);
+     }
+
+     return make_error_tuple(env, "unexpected_return_value");
+}
+
+static int
+chunk_add_row(ErlNifEnv *env, esqlite_chunk *chunk, esqlite_statement *stmt)
+{
+     size_t cell;
+     void *p;
+
+     cell = (size_t) chunk->rows * chunk->columns;
+     if(cell + chunk->columns > chunk->max_cells) {
+	  chunk->max_cells = (cell + chunk->columns) * 2;
+	  p = enif_realloc(chunk->cells, sizeof(ERL_NIF_TERM) * chunk->max_cells);
+	  if(!p)
+	       return 0;
+	  chunk->cells = p;
+     }
+
+     decode_row(env, stmt, chunk, chunk->cells + cell, cell);
+     if(chunk->failed)
+	  return 0;
+
+     chunk->rows++;
+     return 1;
+}
+
+/*
+ * Make the list of rows of the chunk. The large blobs become sub
+ * binaries of a single arena binary.
+ */
+static int
+chunk_make_rows(ErlNifEnv *env, esqlite_chunk *chunk, esqlite_statement *stmt, ERL_NIF_TERM *rows)
+{
+     ERL_NIF_TERM arena, list, row;
+     esqlite_arena_slice *slice;
+     size_t i;
+
+     if(chunk->n_slices) {
+	  arena = buffer_make_binary(env, &chunk->arena);
+	  for(i = 0; i < chunk->n_slices; i++) {
+	       slice = chunk->slices + i;
+	       chunk->cells[slice->cell] = enif_make_sub_binary(env, arena, slice->offset, slice->size);
+	  }
+     }
+
+     if(chunk->rows && stmt->format == row_map)
+	  copy_keys(env, stmt);
+
+     list = enif_make_list(env, 0);
+     for(i = chunk->rows; i > 0; i--) {
+	  if(!make_row_term(env, stmt, chunk->cells + (i - 1) * chunk->columns, &row))
+	       return 0;
+	  list = enif_make_list_cell(env, row, list);
+     }
+
+     *rows = list;
+     return 1;
+}
+
+/*
+ * Run the statement once for every list of parameters. Each run is
+ * bound, stepped until done and reset. The answer has the list of rows
+ * of every run, in order.
+ */
+static ERL_NIF_TERM
+do_multi_get(ErlNifEnv *env, sqlite3 *db, esqlite_statement *stmt, const ERL_NIF_TERM arg)
+{
+     ERL_NIF_TERM params, tail, result, rows, row, list;
+     unsigned int n;
+     int rc;
+
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+     if(!enif_get_list_length(env, arg, &n))
+	  return make_error_tuple(env, "bad_arg_list");
+
+     forget_read_ahead(stmt);
+
+     result = enif_make_list(env, 0);
+     tail = arg;
+     while(enif_get_list_cell(env, tail, &params, &tail)) {
+	  row = do_bind(env, db, stmt->statement, params);
+	  if(!enif_is_identical(row, make_atom(env, "ok"))) {
+	       sqlite3_reset(stmt->statement);
+	       return row;
+	  }
+
+	  rows = enif_make_list(env, 0);
+	  while((rc = connection_step(stmt->handle->connection, stmt->statement)) == SQLITE_ROW)
+	       rows = enif_make_list_cell(env, make_row(env, stmt), rows);
+	  sqlite3_reset(stmt->statement);
+
+	  if(rc == SQLITE_BUSY)
+	       return make_atom(env, "$busy");
+	  if(rc != SQLITE_DONE)
+	       return make_error_tuple(env, "unexpected_return_value");
+
+	  enif_make_reverse_list(env, rows, &list);
+	  result = enif_make_list_cell(env, list, result);
+     }
+
+     enif_make_reverse_list(env, result, &list);
+     return list;
+}
+
+/*
+ * Cached results which read the table become stale. Without a database
+ * name the table is invalidated in every database.
+ */
+static void
+cache_invalidate(esqlite_connection *conn, const char *database, const char *table)
+{
+     esqlite_cached_table *t;
+
+     for(t = conn->cache->tables; t; t = t->next) {
+	  if(strcmp(t->name, table) != 0 || (database && strcmp(t->database, database) != 0))
+	       continue;
+
+	  enif_mutex_lock(conn->cache_lock);
+	  t->generation++;
+	  enif_mutex_unlock(conn->cache_lock);
+     }
+}
+
+static esqlite_cached_table *
+cache_table(esqlite_cache *cache, const char *database, const char *name)
+{
+     esqlite_cached_table *t;
+
+     for(t = cache->tables; t; t = t->next) {
+	  if(strcmp(t->name, name) == 0 && strcmp(t->database, database) == 0)
+	       return t;
+     }
+
+     t = enif_alloc(sizeof(esqlite_cached_table));
+     if(!t)
+	  return NULL;
+     t->database = enif_alloc(strlen(database) + 1);
+     t->name = enif_alloc(strlen(name) + 1);
+     if(!t->database || !t->name) {
+	  if(t->database)
+	       enif_free(t->database);
+	  if(t->name)
+	       enif_free(t->name);
+	  enif_free(t);
+	  return NULL;
+     }
+     strcpy(t->database, database);
+     strcpy(t->name, name);
+     t->generation = 0;
+
+     /* the nif only follows the tables of entries, new tables can be
+      * linked without the lock */
+     t->next = cache->tables;
+     cache->tables = t;
+
+     return t;
+}
+
+/*
+ * Remember a table read by the statement being prepared. Returns 0
+ * when it can not be remembered, the result is not cached then.
+ */
+static int
+cache_collect(esqlite_cache *cache, const char *database, const char *name)
+{
+     esqlite_cached_table *t, **read;
+     unsigned int i;
+
+     t = cache_table(cache, database, name);
+     if(!t)
+	  return 0;
+
+     for(i = 0; i < cache->read_count; i++) {
+	  if(cache->read[i] == t)
+	       return 1;
+     }
+
+     if(cache->read_count == cache->read_size) {
+	  read = enif_realloc(cache->read, sizeof(esqlite_cached_table *) * (cache->read_size + 8));
+	  if(!read)
+	       return 0;
+	  cache->read = read;
+	  cache->read_size += 8;
+     }
+     cache->read[cache->read_count++] = t;
+
+     return 1;
+}
+
+/*
+ * Functions which can give another result for the same rows.
+ */
+static int
+volatile_function(const char *name)
+{
+     static const char *names[] = {
+	  "random", "randomblob", "changes", "total_changes", "last_insert_rowid",
+	  "date", "time", "datetime", "julianday", "strftime",
+	  "current_date", "current_time", "current_timestamp", NULL
+     };
+     int i;
+
+     for(i = 0; names[i]; i++) {
+	  if(sqlite3_strnicmp(name, names[i], strlen(names[i]) + 1) == 0)
+	       return 1;
+     }
+     return 0;
+}
+
+/*
+ * Collects the tables read by cached queries while they are prepared,
+ * queries which call volatile functions are not cached. Deletes are
+ * made row by row, the truncate optimization skips the update hook.
+ * Dropped and altered tables make their cached results stale.
+ */
+static int
+esqlite_authorizer(void *arg, int action, const char *arg1, const char *arg2,
+		   const char *database, const char *trigger)
+{
+     esqlite_connection *conn = (esqlite_connection *) arg;
+     int dropping = conn->dropping;
+
+     conn->dropping = 0;
+
+     switch(action) {
+     case SQLITE_READ:
+	  if(conn->cache && conn->cache->collecting && arg1 &&
+	     (!database || !cache_collect(conn->cache, database, arg1)))
+	       conn->cache->collecting = -1;
+	  return SQLITE_OK;
+     case SQLITE_FUNCTION:
+	  if(conn->cache && conn->cache->collecting && (!arg2 || volatile_function(arg2)))
+	       conn->cache->collecting = -1;
+	  return SQLITE_OK;
+     case SQLITE_DELETE:
+	  /* drop statements check deletes from the schema and from the
+	   * dropped table, ignoring those would skip the drop */
+	  if(dropping || !arg1 || strncmp(arg1, "sqlite_", 7) == 0)
+	       return SQLITE_OK;
+	  return SQLITE_IGNORE;
+     case SQLITE_DROP_TABLE:
+     case SQLITE_DROP_TEMP_TABLE:
+     case SQLITE_DROP_VIEW:
+     case SQLITE_DROP_TEMP_VIEW:
+     case SQLITE_DROP_VTABLE:
+	  if(conn->cache && arg1)
+	       cache_invalidate(conn, database, arg1);
+	  conn->dropping = 1;
+	  return SQLITE_OK;
+     case SQLITE_ALTER_TABLE:
+	  /* arg1 is the database of the altered table */
+	  if(conn->cache && arg2)
+	       cache_invalidate(conn, arg1, arg2);
+	  return SQLITE_OK;
+     default:
+	  return SQLITE_OK;
+     }
+}
+
+static void
+cache_entry_destroy(esqlite_cache_entry *entry)
+{
+     if(entry->env)
+	  enif_free_env(entry->env);
+     if(entry->key)
+	  enif_free(entry->key);
+     if(entry->tables)
+	  enif_free(entry->tables);
+     if(entry->generations)
+	  enif_free(entry->generations);
+     enif_free(entry);
+}
+
+static int
+cache_entry_valid(esqlite_cache_entry *entry)
+{
+     unsigned int i;
+
+     for(i = 0; i < entry->count; i++) {
+	  if(entry->tables[i]->generation != entry->generations[i])
+	       return 0;
+     }
+
+     return 1;
+}
+
+/*
+ * Find the valid entry with the key, stale entries are dropped on the
+ * way. Call with the cache lock held.
+ */
+static esqlite_cache_entry *
+cache_find(esqlite_cache *cache, unsigned int hash, const unsigned char *key, size_t size)
+{
+     esqlite_cache_entry **p, *entry;
+
+     p = &cache->buckets[hash % CACHE_BUCKETS];
+     while((entry = *p)) {
+	  if(!cache_entry_valid(entry)) {
+	       *p = entry->next;
+	       cache->entries--;
+	       cache_entry_destroy(entry);
+	       continue;
+	  }
+	  if(entry->hash == hash && entry->size == size && memcmp(entry->key, key, size) == 0)
+	       return entry;
+	  p = &entry->next;
+     }
+
+     return NULL;
+}
+
+static void
+cache_clear(esqlite_cache *cache)
+{
+     esqlite_cache_entry *entry;
+     unsigned int i;
+
+     for(i = 0; i < CACHE_BUCKETS; i++) {
+	  while((entry = cache->buckets[i])) {
+	       cache->buckets[i] = entry->next;
+	       cache_entry_destroy(entry);
+	  }
+     }
+     cache->entries = 0;
+}
+
+/*
+ * Copy the cached rows of the key into env.
+ */
+static int
+cache_lookup(ErlNifEnv *env, esqlite_connection *conn, const ErlNifBinary *key, ERL_NIF_TERM *rows)
+{
+     esqlite_cache_entry *entry;
+     int hit = 0;
+
+     enif_mutex_lock(conn->cache_lock);
+     if(conn->cache) {
+	  entry = cache_find(conn->cache, hash_bytes(SQLITE_BLOB, key->data, key->size),
+			     key->data, key->size);
+	  if(entry) {
+	       *rows = enif_make_copy(env, entry->rows);
+	       hit = 1;
+	  }
+     }
+     enif_mutex_unlock(conn->cache_lock);
+
+     return hit;
+}
+
+/*
+ * Remember the rows of a query with the tables it read. The cache is
+ * emptied when it is full.
+ */
+static void
+cache_store(esqlite_connection *conn, const ErlNifBinary *key, ERL_NIF_TERM rows)
+{
+     esqlite_cache *cache = conn->cache;
+     esqlite_cache_entry *entry;
+     unsigned int i, hash;
+
+     entry = enif_alloc(sizeof(esqlite_cache_entry));
+     if(!entry)
+	  return;
+
+     entry->next = NULL;
+     entry->count = cache->read_count;
+     entry->env = enif_alloc_env();
+     entry->key = enif_alloc(key->size);
+     entry->tables = enif_alloc(sizeof(esqlite_cached_table *) * (entry->count + 1));
+     entry->generations = enif_alloc(sizeof(unsigned int) * (entry->count + 1));
+     if(!entry->env || !entry->key || !entry->tables || !entry->generations) {
+	  cache_entry_destroy(entry);
+	  return;
+     }
+
+     memcpy(entry->key, key->data, key->size);
+     entry->size = key->size;
+     entry->hash = hash = hash_bytes(SQLITE_BLOB, key->data, key->size);
+     entry->rows = enif_make_copy(entry->env, rows);
+     for(i = 0; i < entry->count; i++) {
+	  entry->tables[i] = cache->read[i];
+	  entry->generations[i] = cache->read[i]->generation;
+     }
+
+     enif_mutex_lock(conn->cache_lock);
+     if(cache->entries >= MAX_CACHE_ENTRIES)
+	  cache_clear(cache);
+     if(!cache_find(cache, hash, entry->key, entry->size)) {
+	  entry->next = cache->buckets[hash % CACHE_BUCKETS];
+	  cache->buckets[hash % CACHE_BUCKETS] = entry;
+	  cache->entries++;
+	  entry = NULL;
+     }
+     enif_mutex_unlock(conn->cache_lock);
+
+     if(entry)
+	  cache_entry_destroy(entry);
+}
+
+static void
+cache_destroy(esqlite_cache *cache)
+{
+     esqlite_cached_table *t;
+
+     cache_clear(cache);
+     while((t = cache->tables)) {
+	  cache->tables = t->next;
+	  enif_free(t->database);
+	  enif_free(t->name);
+	  enif_free(t);
+     }
+     if(cache->read)
+	  enif_free(cache->read);
+     enif_free(cache);
+}
+
+/*
+ * Buffer a change for the subscribers of the connection.
+ */
+static void
+changes_add(esqlite_connection *conn, int op, const char *database, const char *table, sqlite3_int64 rowid)
+{
+     ErlNifEnv *env = conn->changes_env;
+     const char *op_name;
+
+     /* the subscribers are told to start over instead */
+     if(conn->overflow)
+	  return;
+     if(conn->n_changes == MAX_CHANGES) {
+	  enif_clear_env(env);
+	  conn->changes = enif_make_list(env, 0);
+	  conn->n_changes = 0;
+	  conn->overflow = 1;
+	  return;
+     }
+
+     op_name = op == SQLITE_INSERT ? "insert" : op == SQLITE_DELETE ? "delete" : "update";
+
+     conn->changes = enif_make_list_cell(env,
+					 enif_make_tuple4(env, make_atom(env, op_name),
+							  make_binary(env, database, strlen(database)),
+							  make_binary(env, table, strlen(table)),
+							  enif_make_int64(env, rowid)),
+					 conn->changes);
+     conn->n_changes++;
+}
+
+/*
+ * Writes to the tables of kv stores which did not go through the store
+ * make their filters stale. Changes are buffered for the subscribers.
+ */
+static void
+esqlite_update_hook(void *arg, int op, const char *database, const char *table, sqlite3_int64 rowid)
+{
+     esqlite_connection *conn = (esqlite_connection *) arg;
+     esqlite_kv_filter *filter;
+
+     if(conn->subscribers)
+	  changes_add(conn, op, database, table, rowid);
+     if(conn->cache)
+	  cache_invalidate(conn, database, table);
+
+     if(op == SQLITE_DELETE || strcmp(database, "main") != 0)
+	  return;
+
+     for(filter = conn->filters; filter; filter = filter->next) {
+	  if(filter->writing || strcmp(filter->table, table) != 0)
+	       continue;
+
+	  if(filter->valid) {
+	       enif_rwlock_rwlock(filter->lock);
+	       filter->valid = 0;
+	       enif_rwlock_rwunlock(filter->lock);
+	  }
+
+	  /* the key can not be read from within the hook */
+	  if(filter->rebuild)
+	       continue;
+	  if(!filter->pending)
+	       filter->pending = enif_alloc(sizeof(sqlite3_int64) * MAX_FILTER_PENDING);
+	  if(!filter->pending || filter->n_pending == MAX_FILTER_PENDING)
+	       filter->rebuild = 1;
+	  else
+	       filter->pending[filter->n_pending++] = rowid;
+     }
+}
+
+/*
+ * The buffered changes are sent when the command which committed them
+ * is done.
+ */
+static int
+esqlite_commit_hook(void *arg)
+{
+     esqlite_connection *conn = (esqlite_connection *) arg;
+
+     conn->committed = 1;
+     return 0;
+}
+
+static void
+esqlite_rollback_hook(void *arg)
+{
+     esqlite_connection *conn = (esqlite_connection *) arg;
+
+     conn->committed = 0;
+     changes_clear(conn);
+}
+
+/*
+ * Install the hooks of the connection when there are filters or
+ * subscribers, and remove them when there are none.
+ */
+static void
+connection_hooks(esqlite_connection *conn)
+{
+     void *arg = conn->filters || conn->subscribers || conn->cache ? conn : NULL;
+     int authorize = conn->subscribers || conn->cache;
+
+     /* setting the authorizer expires the prepared statements */
+     if(authorize != conn->authorizer) {
+	  sqlite3_set_authorizer(conn->db, authorize ? esqlite_authorizer : NULL, conn);
+	  conn->authorizer = authorize;
+     }
+     sqlite3_update_hook(conn->db, arg ? esqlite_update_hook : NULL, arg);
+     sqlite3_commit_hook(conn->db, conn->subscribers ? esqlite_commit_hook : NULL, conn);
+     sqlite3_rollback_hook(conn->db, conn->subscribers ? esqlite_rollback_hook : NULL, conn);
+}
+
+static void
+subscriber_destroy(esqlite_subscriber *sub)
+{
+     if(sub->env)
+	  enif_free_env(sub->env);
+     enif_free(sub);
+}
+
+/*
+ * Send {Tag, Subscription} to every subscriber.
+ */
+static void
+changes_tell(esqlite_connection *conn, const char *tag)
+{
+     esqlite_subscriber *sub;
+     ErlNifEnv *msg_env;
+
+     msg_env = enif_alloc_env();
+     if(!msg_env)
+	  return;
+     for(sub = conn->subscribers; sub; sub = sub->next) {
+	  enif_send(NULL, &sub->pid, msg_env,
+		    enif_make_tuple2(msg_env, make_atom(msg_env, tag),
+				     enif_make_copy(msg_env, sub->ref)));
+	  enif_clear_env(msg_env);
+     }
+     enif_free_env(msg_env);
+}
+
+/*
+ * Send the committed changes to the subscribers, one message per
+ * subscriber. Subscribers which are gone are dropped. When the
+ * transaction had too many changes they are told to start over.
+ */
+static void
+changes_flush(esqlite_connection *conn)
+{
+     esqlite_subscriber **p, *sub;
+     ErlNifEnv *msg_env;
+     ERL_NIF_TERM changes, msg;
+
+     /* wait until the transaction is over */
+     if(!conn->db || !sqlite3_get_autocommit(conn->db))
+	  return;
+
+     conn->committed = 0;
+     if(conn->overflow) {
+	  changes_tell(conn, "esqlite3_overflow");
+	  changes_clear(conn);
+	  return;
+     }
+     if(enif_is_empty_list(conn->changes_env, conn->changes))
+	  return;
+
+     msg_env = enif_alloc_env();
+     if(msg_env) {
+	  enif_make_reverse_list(conn->changes_env, conn->changes, &changes);
+	  p = &conn->subscribers;
+	  while((sub = *p)) {
+	       msg = enif_make_tuple3(msg_env, make_atom(msg_env, "esqlite3_changes"),
+				      enif_make_copy(msg_env, sub->ref),
+				      enif_make_copy(msg_env, changes));
+	       if(enif_send(NULL, &sub->pid, msg_env, msg)) {
+		    p = &sub->next;
+	       } else {
+		    *p = sub->next;
+		    subscriber_destroy(sub);
+	       }
+	       enif_clear_env(msg_env);
+	  }
+	  enif_free_env(msg_env);
+     }
+
+     changes_clear(conn);
+
+     if(!conn->subscribers)
+	  connection_hooks(conn);
+}
+
+/*
+ * The database was replaced by a restore, which the hooks do not see.
+ * The buffered changes are dropped and the subscribers are told to
+ * read again what they need.
+ */
+static void
+changes_restored(esqlite_connection *conn)
+{
+     if(!conn->subscribers)
+	  return;
+
+     conn->committed = 0;
+     changes_clear(conn);
+     changes_tell(conn, "esqlite3_restored");
+}
+
+static ERL_NIF_TERM
+do_subscribe(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM ref, ErlNifPid pid)
+{
+     esqlite_subscriber *sub;
+
+     if(!conn->changes_env) {
+	  conn->changes_env = enif_alloc_env();
+	  if(!conn->changes_env)
+	       return make_error_tuple(env, "no_memory");
+	  conn->changes = enif_make_list(conn->changes_env, 0);
+     }
+
+     sub = enif_alloc(sizeof(esqlite_subscriber));
+     if(!sub)
+	  return make_error_tuple(env, "no_memory");
+     sub->pid = pid;
+     sub->env = enif_alloc_env();
+     if(!sub->env) {
+	  subscriber_destroy(sub);
+	  return make_error_tuple(env, "no_memory");
+     }
+     sub->ref = enif_make_copy(sub->env, ref);
+
+     sub->next = conn->subscribers;
+     conn->subscribers = sub;
+     connection_hooks(conn);
+
+     return make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM
+do_unsubscribe(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM ref)
+{
+     esqlite_subscriber **p, *sub;
+
+     for(p = &conn->subscribers; (sub = *p); p = &sub->next) {
+	  if(enif_is_identical(sub->ref, ref)) {
+	       *p = sub->next;
+	       subscriber_destroy(sub);
+	       if(!conn->subscribers) {
+		    changes_clear(conn);
+		    connection_hooks(conn);
+	       }
+	       return make_atom(env, "ok");
+	  }
+     }
+
+     return make_error_tuple(env, "not_subscribed");
+}
+
+/*
+ * (Re)build the filter from the blob keys in the table.
+ */
+static void
+kv_filter_build(sqlite3 *db, esqlite_kv_filter *filter)
+{
+     char sql[MAX_ATOM_LENGTH * 2 + 128];
+     sqlite3_stmt *stmt;
+     size_t expected = filter->expected;
+     bloom *new_bloom, *old_bloom;
+
+     snprintf(sql, sizeof(sql), "SELECT count(*) FROM %s", filter->quoted);
+     if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	  return;
+     if(sqlite3_step(stmt) == SQLITE_ROW && (size_t) sqlite3_column_int64(stmt, 0) > expected)
+	  expected = sqlite3_column_int64(stmt, 0);
+     sqlite3_finalize(stmt);
+
+     snprintf(sql, sizeof(sql), "SELECT key FROM %s WHERE typeof(key) = 'blob'", filter->quoted);
+     if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	  return;
+
+     new_bloom = bloom_create(expected);
+     if(!new_bloom) {
+	  sqlite3_finalize(stmt);
+	  return;
+     }
+
+     while(sqlite3_step(stmt) == SQLITE_ROW)
+	  bloom_add(new_bloom, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+     sqlite3_finalize(stmt);
+
+     enif_rwlock_rwlock(filter->lock);
+     old_bloom = filter->bloom;
+     filter->bloom = new_bloom;
+     filter->valid = 1;
+     enif_rwlock_rwunlock(filter->lock);
+     filter->n_pending = 0;
+     filter->rebuild = 0;
+
+     if(old_bloom)
+	  bloom_destroy(old_bloom);
+}
+
+/*
+ * Bring a stale filter up to date. The keys of the rows written around
+ * the store are added, the filter is only rebuilt from the whole table
+ * when there were too many of them.
+ */
+static void
+kv_filter_refresh(sqlite3 *db, esqlite_kv_filter *filter)
+{
+     char sql[MAX_ATOM_LENGTH * 2 + 128];
+     sqlite3_stmt *stmt;
+     unsigned int i;
+     int rc = SQLITE_OK;
+
+     if(filter->rebuild || !filter->bloom) {
+	  kv_filter_build(db, filter);
+	  return;
+     }
+
+     snprintf(sql, sizeof(sql), "SELECT key FROM %s WHERE rowid = ?1", filter->quoted);
+     if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+	  kv_filter_build(db, filter);
+	  return;
+     }
+
+     enif_rwlock_rwlock(filter->lock);
+     for(i = 0; i < filter->n_pending && rc != SQLITE_ERROR; i++) {
+	  sqlite3_bind_int64(stmt, 1, filter->pending[i]);
+	  rc = sqlite3_step(stmt);
+	  if(rc == SQLITE_ROW && sqlite3_column_type(stmt, 0) == SQLITE_BLOB)
+	       bloom_add(filter->bloom, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+	  if(rc != SQLITE_ROW && rc != SQLITE_DONE)
+	       rc = SQLITE_ERROR;
+	  sqlite3_reset(stmt);
+     }
+     if(rc != SQLITE_ERROR) {
+	  filter->n_pending = 0;
+	  filter->valid = 1;
+     }
+     enif_rwlock_rwunlock(filter->lock);
+     sqlite3_finalize(stmt);
+
+     if(rc == SQLITE_ERROR)
+	  kv_filter_build(db, filter);
+}
+
+static void
+kv_filter_destroy(esqlite_kv_filter *filter)
+{
+     if(filter->lock)
+	  enif_rwlock_destroy(filter->lock);
+     if(filter->bloom)
+	  bloom_destroy(filter->bloom);
+     if(filter->table)
+	  enif_free(filter->table);
+     if(filter->quoted)
+	  enif_free(filter->quoted);
+     if(filter->pending)
+	  enif_free(filter->pending);
+     enif_free(filter);
+}
+
+static esqlite_kv_filter *
+kv_filter_create(esqlite_connection *conn, const char *table, const char *quoted, size_t expected)
+{
+     esqlite_kv_filter *filter;
+
+     filter = enif_alloc(sizeof(esqlite_kv_filter));
+     if(!filter)
+	  return NULL;
+
+     filter->next = NULL;
+     filter->expected = expected;
+     filter->bloom = NULL;
+     filter->valid = 0;
+     filter->writing = 0;
+     filter->pending = NULL;
+     filter->n_pending = 0;
+     filter->rebuild = 0;
+     filter->lock = enif_rwlock_create("esqlite_kv_filter");
+     filter->table = enif_alloc(strlen(table) + 1);
+     filter->quoted = enif_alloc(strlen(quoted) + 1);
+     if(!filter->lock || !filter->table || !filter->quoted) {
+	  kv_filter_destroy(filter);
+	  return NULL;
+     }
+     strcpy(filter->table, table);
+     strcpy(filter->quoted, quoted);
+
+     kv_filter_build(conn->db, filter);
+
+     filter->next = conn->filters;
+     conn->filters = filter;
+     connection_hooks(conn);
+
+     return filter;
+}
+
+static void
+kv_filter_close(esqlite_connection *conn, esqlite_kv_filter *filter)
+{
+     esqlite_kv_filter **p;
+
+     for(p = &conn->filters; *p; p = &(*p)->next) {
+	  if(*p == filter) {
+	       *p = filter->next;
+	       break;
+	  }
+     }
+     if(conn->db)
+	  connection_hooks(conn);
+
+     kv_filter_destroy(filter);
+}
+
+/*
+ * Can the key be in the store? Only binary keys are in the filter.
+ */
+static int
+kv_may_contain(ErlNifEnv *env, esqlite_kv_filter *filter, const ERL_NIF_TERM key)
+{
+     ErlNifBinary bin;
+     int result;
+
+     if(!filter || !enif_is_binary(env, key) || !enif_inspect_binary(env, key, &bin))
+	  return 1;
+
+     enif_rwlock_rlock(filter->lock);
+     result = !filter->valid || bloom_may_contain(filter->bloom, bin.data, bin.size);
+     enif_rwlock_runlock(filter->lock);
+
+     return result;
+}
+
+/*
+ * Is the database private to the connection, in memory or a temporary
+ * file?
+ */
+static int
+in_memory(sqlite3 *db, const char *database)
+{
+     sqlite3_stmt *stmt;
+     const char *file;
+     int result = 0;
+
+     if(sqlite3_prepare_v2(db, "PRAGMA database_list", -1, &stmt, NULL) != SQLITE_OK)
+	  return 0;
+
+     while(sqlite3_step(stmt) == SQLITE_ROW) {
+	  if(strcmp((const char *) sqlite3_column_text(stmt, 1), database) != 0)
+	       continue;
+	  file = (const char *) sqlite3_column_text(stmt, 2);
+	  result = !file || !*file;
+	  break;
+     }
+     sqlite3_finalize(stmt);
+
+     return result;
+}
+
+/*
+ * Open a key value store over a table, which is created when it does
+ * not exist yet. The statements of the store are prepared once. With
+ * the option {bloom, ExpectedKeys} the store keeps a bloom filter of
+ * its keys, lookups of absent keys are answered from it.
+ */
+static ERL_NIF_TERM
+do_kv_open(ErlNifEnv *env, esqlite_handle *handle, const ERL_NIF_TERM arg)
+{
+     sqlite3 *db = handle->connection->db;
+     char table[MAX_ATOM_LENGTH * 2 + 1], quoted[MAX_ATOM_LENGTH * 2 + 3];
+     char sql[MAX_ATOM_LENGTH * 2 + 128];
+     ErlNifBinary name;
+     esqlite_kv *kv;
+     ERL_NIF_TERM esqlite_kv_term, table_name = arg, opts, head;
+     const ERL_NIF_TERM *tuple;
+     unsigned long expected = 0;
+     size_t i, n = 0;
+     int arity, single_writer = 0;
+
+     opts = enif_make_list(env, 0);
+     if(enif_get_tuple(env, arg, &arity, &tuple) && arity == 2) {
+	  table_name = tuple[0];
+	  opts = tuple[1];
+     }
+
+     while(enif_get_list_cell(env, opts, &head, &opts)) {
+	  if(enif_is_identical(head, make_atom(env, "single_writer"))) {
+	       single_writer = 1;
+	       continue;
+	  }
+	  if(!enif_get_tuple(env, head, &arity, &tuple) || arity != 2 ||
+	     !enif_is_identical(tuple[0], make_atom(env, "bloom")) ||
+	     !enif_get_ulong(env, tuple[1], &expected))
+	       return make_error_tuple(env, "invalid_option");
+     }
+
+     if(!enif_inspect_iolist_as_binary(env, table_name, &name) || name.size == 0 || name.size > MAX_ATOM_LENGTH)
+	  return make_error_tuple(env, "invalid_table");
+
+     /* The filter only sees the writes of this connection. Other
+      * connections can write to a file, so there absent keys would be
+      * wrong unless the caller knows better.
+      */
+     if(expected && !single_writer && !in_memory(db, "main"))
+	  return make_error_tuple(env, "bloom_needs_single_writer");
+
+     /* quoted identifier */
+     for(i = 0; i < name.size; i++) {
+	  if(!name.data[i])
+	       return make_error_tuple(env, "invalid_table");
+	  if(name.data[i] == '"')
+	       table[n++] = '"';
+	  table[n++] = name.data[i];
+     }
+     table[n] = '\0';
+     snprintf(quoted, sizeof(quoted), "\"%s\"", table);
+
+     snprintf(sql, sizeof(sql),
+	      "CREATE TABLE IF NOT EXISTS \"%s\"(key BLOB PRIMARY KEY, value BLOB)", table);
+     if(sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK)
+	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+
+     kv = enif_alloc_resource(esqlite_kv_type, sizeof(esqlite_kv));
+     if(!kv)
+	  return make_error_tuple(env, "no_memory");
+
+     kv->get = kv->put = kv->del = kv->range = NULL;
+     kv->filter = NULL;
+     enif_keep_resource(handle);
+     kv->handle = handle;
+
+     snprintf(sql, sizeof(sql), "SELECT value FROM \"%s\" WHERE key = ?1", table);
+     if(sqlite3_prepare_v2(db, sql, -1, &kv->get, NULL) != SQLITE_OK)
+	  goto error;
+     snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO \"%s\"(key, value) VALUES(?1, ?2)", table);
+     if(sqlite3_prepare_v2(db, sql, -1, &kv->put, NULL) != SQLITE_OK)
+	  goto error;
+     snprintf(sql, sizeof(sql), "DELETE FROM \"%s\" WHERE key = ?1", table);
+     if(sqlite3_prepare_v2(db, sql, -1, &kv->del, NULL) != SQLITE_OK)
+	  goto error;
+     snprintf(sql, sizeof(sql),
+	      "SELECT key, value FROM \"%s\" WHERE key >= ?1 AND key < ?2 ORDER BY key LIMIT ?3", table);
+     if(sqlite3_prepare_v2(db, sql, -1, &kv->range, NULL) != SQLITE_OK)
+	  goto error;
+
+     if(expected) {
+	  memcpy(table, name.data, name.size);
+	  table[name.size] = '\0';
+	  kv->filter = kv_filter_create(handle->connection, table, quoted, expected);
+	  if(!kv->filter) {
+	       enif_release_resource(kv);
+	       return make_error_tuple(env, "no_memory");
+	  }
+     }
+
+     esqlite_kv_term = enif_make_resource(env, kv);
+     enif_release_resource(kv);
+
+     return make_ok_tuple(env, esqlite_kv_term);
+
+error:
+     esqlite_kv_term = make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+     enif_release_resource(kv);
+     return esqlite_kv_term;
+}
+
+/*
+ * Bind a key or value. Binaries are bound without copying, the
+ * statement is reset before the command is gone.
+ */
+static int
+kv_bind(ErlNifEnv *env, sqlite3_stmt *stmt, int i, const ERL_NIF_TERM cell)
+{
+     ErlNifBinary bin;
+
+     if(enif_is_binary(env, cell) && enif_inspect_binary(env, cell, &bin))
+	  return sqlite3_bind_blob(stmt, i, bin.data, bin.size, SQLITE_STATIC);
+
+     return bind_cell(env, cell, stmt, i);
+}
+
+static ERL_NIF_TERM
+kv_bind_error(ErlNifEnv *env, sqlite3 *db, sqlite3_stmt *stmt, int rc)
+{
+     sqlite3_clear_bindings(stmt);
+     if(rc == -1)
+	  return make_error_tuple(env, "wrong_type");
+     return make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+}
+
+static ERL_NIF_TERM
+kv_step_error(ErlNifEnv *env, sqlite3 *db, int rc)
+{
+     if(rc == SQLITE_BUSY)
+	  return make_atom(env, "$busy");
+     return make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+}
+
+static void
+kv_reset(sqlite3_stmt *stmt)
+{
+     sqlite3_reset(stmt);
+     sqlite3_clear_bindings(stmt);
+}
+
+static ERL_NIF_TERM
+kv_get(ErlNifEnv *env, sqlite3 *db, esqlite_kv *kv, const ERL_NIF_TERM key)
+{
+     ERL_NIF_TERM result;
+     int rc;
+
+     if(!kv_may_contain(env, kv->filter, key))
+	  return make_atom(env, "not_found");
+
+     rc = kv_bind(env, kv->get, 1, key);
+     if(rc != SQLITE_OK)
+	  return kv_bind_error(env, db, kv->get, rc);
+
+     rc = sqlite3_step(kv->get);
+     if(rc == SQLITE_ROW)
+	  result = make_ok_tuple(env, decode_any(env, NULL, kv->get, 0, 0));
+     else if(rc == SQLITE_DONE)
+	  result = make_atom(env, "not_found");
+     else
+	  result = kv_step_error(env, db, rc);
+
+     kv_reset(kv->get);
+     return result;
+}
+
+static ERL_NIF_TERM
+kv_put(ErlNifEnv *env, sqlite3 *db, esqlite_kv *kv, const ERL_NIF_TERM key, const ERL_NIF_TERM value)
+{
+     ErlNifBinary bin;
+     ERL_NIF_TERM result;
+     int rc;
+
+     rc = kv_bind(env, kv->put, 1, key);
+     if(rc == SQLITE_OK)
+	  rc = kv_bind(env, kv->put, 2, value);
+     if(rc != SQLITE_OK)
+	  return kv_bind_error(env, db, kv->put, rc);
+
+     if(kv->filter)
+	  kv->filter->writing = 1;
+     rc = connection_step(kv->handle->connection, kv->put);
+     if(kv->filter)
+	  kv->filter->writing = 0;
+     result = rc == SQLITE_DONE ? make_atom(env, "ok") : kv_step_error(env, db, rc);
+
+     if(rc == SQLITE_DONE && kv->filter && enif_is_binary(env, key) && enif_inspect_binary(env, key, &bin)) {
+	  enif_rwlock_rwlock(kv->filter->lock);
+	  if(kv->filter->bloom)
+	       bloom_add(kv->filter->bloom, bin.data, bin.size);
+	  enif_rwlock_rwunlock(kv->filter->lock);
+     }
+
+     kv_reset(kv->put);
+     return result;
+}
+
+static ERL_NIF_TERM
+kv_delete(ErlNifEnv *env, sqlite3 *db, esqlite_kv *kv, const ERL_NIF_TERM key)
+{
+     ERL_NIF_TERM result;
+     int rc;
+
+     rc = kv_bind(env, kv->del, 1, key);
+     if(rc != SQLITE_OK)
+	  return kv_bind_error(env, db, kv->del, rc);
+
+     rc = connection_step(kv->handle->connection, kv->del);
+     result = rc == SQLITE_DONE ? make_atom(env, "ok") : kv_step_error(env, db, rc);
+
+     kv_reset(kv->del);
+     return result;
+}
+
+static ERL_NIF_TERM
+kv_range(ErlNifEnv *env, sqlite3 *db, esqlite_kv *kv, const ERL_NIF_TERM *args)
+{
+     ERL_NIF_TERM rows, row, list;
+     int rc;
+
+     rc = kv_bind(env, kv->range, 1, args[0]);
+     if(rc == SQLITE_OK)
+	  rc = kv_bind(env, kv->range, 2, args[1]);
+     if(rc == SQLITE_OK)
+	  rc = kv_bind(env, kv->range, 3, args[2]);
+     if(rc != SQLITE_OK)
+	  return kv_bind_error(env, db, kv->range, rc);
+
+     rows = enif_make_list(env, 0);
+     while((rc = sqlite3_step(kv->range)) == SQLITE_ROW) {
+	  row = enif_make_tuple2(env,
+				 decode_any(env, NULL, kv->range, 0, 0),
+				 decode_any(env, NULL, kv->range, 1, 0));
+	  rows = enif_make_list_cell(env, row, rows);
+     }
+
+     if(rc == SQLITE_DONE)
+	  enif_make_reverse_list(env, rows, &list);
+     else
+	  list = kv_step_error(env, db, rc);
+
+     kv_reset(kv->range);
+     return list;
+}
+
+/*
+ * Run an operation on a key value store: {get, Key}, {put, Key, Value},
+ * {delete, Key}, {multi_get, Keys} or {range, From, To, Limit}.
+ */
+static ERL_NIF_TERM
+do_kv(ErlNifEnv *env, sqlite3 *db, esqlite_kv *kv, const ERL_NIF_TERM arg)
+{
+     const ERL_NIF_TERM *op;
+     ERL_NIF_TERM keys, key, results, list;
+     int arity;
+
+     if(!enif_get_tuple(env, arg, &arity, &op) || arity < 2)
+	  return make_error_tuple(env, "invalid_operation");
+
+     /* bring a stale filter up to date before it is used again */
+     if(kv->filter && !kv->filter->valid)
+	  kv_filter_refresh(db, kv->filter);
+
+     if(arity == 2 && enif_is_identical(op[0], make_atom(env, "get")))
+	  return kv_get(env, db, kv, op[1]);
+     if(arity == 3 && enif_is_identical(op[0], make_atom(env, "put")))
+	  return kv_put(env, db, kv, op[1], op[2]);
+     if(arity == 2 && enif_is_identical(op[0], make_atom(env, "delete")))
+	  return kv_delete(env, db, kv, op[1]);
+     if(arity == 4 && enif_is_identical(op[0], make_atom(env, "range")))
+	  return kv_range(env, db, kv, op + 1);
+
+     if(arity == 2 && enif_is_identical(op[0], make_atom(env, "multi_get"))) {
+	  results = enif_make_list(env, 0);
+	  keys = op[1];
+	  while(enif_get_list_cell(env, keys, &key, &keys))
+	       results = enif_make_list_cell(env, kv_get(env, db, kv, key), results);
+	  enif_make_reverse_list(env, results, &list);
+	  return list;
+     }
+
+     return make_error_tuple(env, "invalid_operation");
+}
+
+/*
+ * Copy an iolist into a nul terminated name.
+ */
+static int
+get_name(ErlNifEnv *env, const ERL_NIF_TERM term, char *name, size_t size)
+{
+     ErlNifBinary bin;
+
+     if(!enif_inspect_iolist_as_binary(env, term, &bin) || bin.size == 0 || bin.size >= size)
+	  return 0;
+     if(memchr(bin.data, '\0', bin.size))
+	  return 0;
+
+     memcpy(name, bin.data, bin.size);
+     name[bin.size] = '\0';
+     return 1;
+}
+
+/*
+ * Open the blob in a cell for incremental io, arg is
+ * {Table, Column, Rowid, read | write}.
+ */
+static ERL_NIF_TERM
+do_blob_open(ErlNifEnv *env, esqlite_handle *handle, const ERL_NIF_TERM arg)
+{
+     sqlite3 *db = handle->connection->db;
+     char table[MAX_ATOM_LENGTH + 1], column[MAX_ATOM_LENGTH + 1];
+     const ERL_NIF_TERM *args;
+     ErlNifSInt64 rowid;
+     esqlite_blob *b;
+     ERL_NIF_TERM blob_term;
+     int arity, write;
+
+     if(!enif_get_tuple(env, arg, &arity, &args) || arity != 4)
+	  return make_error_tuple(env, "invalid_blob");
+     if(!get_name(env, args[0], table, sizeof(table)))
+	  return make_error_tuple(env, "invalid_table");
+     if(!get_name(env, args[1], column, sizeof(column)))
+	  return make_error_tuple(env, "invalid_column");
+     if(!enif_get_int64(env, args[2], &rowid))
+	  return make_error_tuple(env, "invalid_rowid");
+
+     write = enif_is_identical(args[3], make_atom(env, "write"));
+     if(!write && !enif_is_identical(args[3], make_atom(env, "read")))
+	  return make_error_tuple(env, "invalid_option");
+
+     b = enif_alloc_resource(esqlite_blob_type, sizeof(esqlite_blob));
+     if(!b)
+	  return make_error_tuple(env, "no_memory");
+     b->blob = NULL;
+     enif_keep_resource(handle);
+     b->handle = handle;
+
+     if(sqlite3_blob_open(db, "main", table, column, (sqlite3_int64) rowid, write, &b->blob) != SQLITE_OK) {
+	  if(b->blob)
+	       sqlite3_blob_close(b->blob);
+	  b->blob = NULL;
+	  blob_term = make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+	  enif_release_resource(b);
+	  return blob_term;
+     }
+
+     blob_term = enif_make_resource(env, b);
+     enif_release_resource(b);
+
+     return make_ok_tuple(env, blob_term);
+}
+
+/*
+ * Operations on an open blob:
+ *
+ *   size                     gives the size of the blob
+ *   {read, Offset, Size}     gives {ok, Bytes}, at most Size bytes, or eof
+ *   {write, Offset, Bytes}   gives ok, writes can not change the size
+ *   {reopen, Rowid}          moves the blob to the same column of another row
+ *   close                    gives ok
+ */
+static ERL_NIF_TERM
+do_blob(ErlNifEnv *env, sqlite3 *db, esqlite_blob *b, const ERL_NIF_TERM arg)
+{
+     const ERL_NIF_TERM *op;
+     ErlNifBinary bin;
+     ErlNifSInt64 rowid;
+     unsigned int offset, size, bytes;
+     int arity, rc;
+
+     if(!b->blob)
+	  return make_error_tuple(env, "closed");
+
+     if(enif_is_identical(arg, make_atom(env, "size")))
+	  return enif_make_int(env, sqlite3_blob_bytes(b->blob));
+
+     if(enif_is_identical(arg, make_atom(env, "close"))) {
+	  rc = sqlite3_blob_close(b->blob);
+	  b->blob = NULL;
+	  if(rc != SQLITE_OK)
+	       return make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+	  return make_atom(env, "ok");
+     }
+
+     if(!enif_get_tuple(env, arg, &arity, &op) || arity < 2)
+	  return make_error_tuple(env, "invalid_operation");
+
+     if(arity == 3 && enif_is_identical(op[0], make_atom(env, "read"))) {
+	  if(!enif_get_uint(env, op[1], &offset) || !enif_get_uint(env, op[2], &size))
+	       return make_error_tuple(env, "invalid_operation");
+
+	  bytes = sqlite3_blob_bytes(b->blob);
+	  if(offset >= bytes)
+	       return make_atom(env, "eof");
+	  if(size > bytes - offset)
+	       size = bytes - offset;
+
+	  if(!enif_alloc_binary(size, &bin))
+	       return make_error_tuple(env, "no_memory");
+	  if(sqlite3_blob_read(b->blob, bin.data, size, offset) != SQLITE_OK) {
+	       enif_release_binary(&bin);
+	       return make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+	  }
+	  return make_ok_tuple(env, enif_make_binary(env, &bin));
+     }
+
+     if(arity == 3 && enif_is_identical(op[0], make_atom(env, "write"))) {
+	  if(!enif_get_uint(env, op[1], &offset) || !enif_inspect_iolist_as_binary(env, op[2], &bin))
+	       return make_error_tuple(env, "invalid_operation");
+	  if(sqlite3_blob_write(b->blob, bin.data, bin.size, offset) != SQLITE_OK)
+	       return make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+	  return make_atom(env, "ok");
+     }
+
+     if(arity == 2 && enif_is_identical(op[0], make_atom(env, "reopen"))) {
+	  if(!enif_get_int64(env, op[1], &rowid))
+	       return make_error_tuple(env, "invalid_rowid");
+	  if(sqlite3_blob_reopen(b->blob, (sqlite3_int64) rowid) != SQLITE_OK)
+	       return make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+	  return make_atom(env, "ok");
+     }
+
+     return make_error_tuple(env, "invalid_operation");
+}
+
+static int
+backup_options(ErlNifEnv *env, esqlite_backup *backup, ERL_NIF_TERM opts)
+{
+     ERL_NIF_TERM head;
+     const ERL_NIF_TERM *option;
+     int arity;
+
+     while(enif_get_list_cell(env, opts, &head, &opts)) {
+	  if(enif_is_identical(head, make_atom(env, "restore"))) {
+	       backup->restore = 1;
+	       continue;
+	  }
+	  if(enif_is_identical(head, make_atom(env, "write_back"))) {
+	       backup->write_back = 1;
+	       continue;
+	  }
+
+	  if(!enif_get_tuple(env, head, &arity, &option) || arity != 2)
+	       return 0;
+
+	  if(enif_is_identical(option[0], make_atom(env, "pages"))) {
+	       if(!enif_get_int(env, option[1], &backup->pages) || backup->pages == 0)
+		    return 0;
+	       continue;
+	  }
+
+	  if(!enif_is_identical(option[0], make_atom(env, "progress")) ||
+	     !enif_get_local_pid(env, option[1], &backup->progress_pid))
+	       return 0;
+	  backup->progress = 1;
+     }
+
+     return enif_is_empty_list(env, opts) && (backup->restore || !backup->write_back);
+}
+
+/*
+ * Start a backup of the database to the file in arg, {File, Options}.
+ * With restore the file is copied into the database instead.
+ */
+static ERL_NIF_TERM
+backup_start(ErlNifEnv *env, esqlite_connection *conn, esqlite_command *cmd)
+{
+     esqlite_backup *backup;
+     const ERL_NIF_TERM *args;
+     char filename[MAX_PATHNAME];
+     int arity;
+
+     if(!enif_get_tuple(env, cmd->arg, &arity, &args) || arity != 2 ||
+	!get_name(env, args[0], filename, sizeof(filename)))
+	  return make_error_tuple(env, "invalid_filename");
+
+     backup = enif_alloc(sizeof(esqlite_backup));
+     if(!backup)
+	  return make_error_tuple(env, "no_memory");
+     backup->file = NULL;
+     backup->backup = NULL;
+     backup->pages = 100;
+     backup->restore = 0;
+     backup->write_back = 0;
+     backup->filename = NULL;
+     backup->progress = 0;
+     backup->busy = 0;
+     backup->busy_since = 0;
+     cmd->backup = backup;
+
+     if(!backup_options(env, backup, args[1]))
+	  return make_error_tuple(env, "invalid_option");
+
+     if(backup->write_back) {
+	  backup->filename = enif_alloc(strlen(filename) + 1);
+	  if(!backup->filename)
+	       return make_error_tuple(env, "no_memory");
+	  strcpy(backup->filename, filename);
+     }
+
+     /* a restore only reads the file, it must not create it */
+     if(sqlite3_open_v2(filename, &backup->file,
+			backup->restore ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+			NULL) != SQLITE_OK)
+	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(backup->file));
+
+     /* The database would be seen half restored in between steps, a
+      * restore is copied in one go.
+      */
+     if(backup->restore) {
+	  backup->pages = -1;
+	  backup->backup = sqlite3_backup_init(conn->db, "main", backup->file, "main");
+	  if(!backup->backup)
+	       return make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+	  return 0;
+     }
+
+     backup->backup = sqlite3_backup_init(backup->file, "main", conn->db, "main");
+     if(!backup->backup)
+	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(backup->file));
+
+     return 0;
+}
+
+static void
+backup_progress(esqlite_command *cmd)
+{
+     esqlite_backup *backup = cmd->backup;
+     ErlNifEnv *msg_env;
+     ERL_NIF_TERM msg;
+
+     msg_env = enif_alloc_env();
+     if(!msg_env)
+	  return;
+
+     msg = enif_make_tuple4(msg_env, make_atom(msg_env, "esqlite3_backup"),
+			    enif_make_copy(msg_env, cmd->ref),
+			    enif_make_int(msg_env, sqlite3_backup_remaining(backup->backup)),
+			    enif_make_int(msg_env, sqlite3_backup_pagecount(backup->backup)));
+     enif_send(NULL, &backup->progress_pid, msg_env, msg);
+     enif_free_env(msg_env);
+}
+
+/*
+ * Copy the next pages of a backup. When pages are left the command is
+ * queued again, so the commands queued in the mean time run in between.
+ */
+static ERL_NIF_TERM
+do_backup(ErlNifEnv *env, esqlite_connection *conn, esqlite_command *cmd)
+{
+     esqlite_backup *backup;
+     esqlite_kv_filter *filter;
+     ERL_NIF_TERM error;
+     int rc, step;
+
+     if(!cmd->backup && (error = backup_start(env, conn, cmd)))
+	  return error;
+     backup = cmd->backup;
+
+     rc = sqlite3_backup_step(backup->backup, backup->pages);
+     if(rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+	  /* the file is locked by someone else, try again after the
+	   * commands queued in the mean time and give up when it stays
+	   * locked. There is no sleep, it would hold up the connection. */
+	  if(backup->restore)
+	       return make_error_tuple(env, "busy");
+	  if(!backup->busy) {
+	       backup->busy = 1;
+	       backup->busy_since = enif_monotonic_time(ERL_NIF_MSEC);
+	  } else if(enif_monotonic_time(ERL_NIF_MSEC) - backup->busy_since > BACKUP_BUSY_TIMEOUT) {
+	       return make_error_tuple(env, "busy");
+	  }
+	  cmd->requeue = 1;
+	  return make_atom(env, "ok");
+     }
+     backup->busy = 0;
+
+     if(!backup->restore && rc == SQLITE_OK) {
+	  if(backup->progress)
+	       backup_progress(cmd);
+	  cmd->requeue = 1;
+	  return make_atom(env, "ok");
+     }
+
+     if(backup->progress && rc == SQLITE_DONE)
+	  backup_progress(cmd);
+
+     /* finish does not report every failed step */
+     step = rc;
+     rc = sqlite3_backup_finish(backup->backup);
+     backup->backup = NULL;
+     if(rc != SQLITE_OK)
+	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(backup->restore ? conn->db : backup->file));
+     if(step != SQLITE_DONE)
+	  return make_error_tuple(env, "backup_incomplete");
+
+     if(backup->restore) {
+	  /* the restore bypasses the update hook */
+	  if(conn->cache) {
+	       enif_mutex_lock(conn->cache_lock);
+	       cache_clear(conn->cache);
+	       enif_mutex_unlock(conn->cache_lock);
+	  }
+	  for(filter = conn->filters; filter; filter = filter->next) {
+	       enif_rwlock_rwlock(filter->lock);
+	       filter->valid = 0;
+	       enif_rwlock_rwunlock(filter->lock);
+	       filter->rebuild = 1;
+	  }
+	  changes_restored(conn);
+
+	  if(backup->write_back) {
+	       if(conn->write_back)
+		    enif_free(conn->write_back);
+	       conn->write_back = backup->filename;
+	       backup->filename = NULL;
+	  }
+     }
+
+     return make_atom(env, "ok");
+}
+
+/*
+ * Copy the database to the file it was restored from, before it is
+ * closed. The file is not created again when it was removed.
+ */
+static int
+write_back(esqlite_connection *conn, ErlNifEnv *env, ERL_NIF_TERM *error)
+{
+     sqlite3 *file;
+     sqlite3_backup *backup;
+     int rc, step = SQLITE_ERROR;
+
+     if(sqlite3_open_v2(conn->write_back, &file, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+	  if(env)
+	       *error = make_sqlite3_error_tuple(env, sqlite3_errmsg(file));
+	  sqlite3_close(file);
+	  return 0;
+     }
+
+     backup = sqlite3_backup_init(file, "main", conn->db, "main");
+     if(backup) {
+	  step = sqlite3_backup_step(backup, -1);
+	  rc = sqlite3_backup_finish(backup);
+     } else
+	  rc = SQLITE_ERROR;
+
+     if(env && rc != SQLITE_OK)
+	  *error = make_sqlite3_error_tuple(env, sqlite3_errmsg(file));
+     else if(env && step != SQLITE_DONE)
+	  *error = make_error_tuple(env, step == SQLITE_BUSY || step == SQLITE_LOCKED ? "busy" : "backup_incomplete");
+     sqlite3_close(file);
+
+     return rc == SQLITE_OK && step == SQLITE_DONE;
+}
+
+/*
+ * Pipelines run a list of operations in one command:
+ *
+ *   {exec, Sql}            runs sql without parameters, gives ok
+ *   {exec, Sql, Params}    runs a statement until done, gives ok
+ *   {query, Sql, Params}   runs a statement, gives the list of rows
+ *
+ * A parameter {'$ref', N} is the value of the N-th operation: the
+ * last insert rowid after an exec, or the first cell of a query.
+ * '$last_insert_rowid' is the last insert rowid of the connection.
+ */
+static int
+pipeline_params(ErlNifEnv *env, sqlite3 *db, ERL_NIF_TERM params,
+		const ERL_NIF_TERM *values, unsigned int done, ERL_NIF_TERM *resolved)
+{
+     ERL_NIF_TERM head, list;
+     const ERL_NIF_TERM *ref;
+     unsigned int n;
+     int arity;
+
+     if(!enif_is_list(env, params))
+	  return 0;
+
+     list = enif_make_list(env, 0);
+     while(enif_get_list_cell(env, params, &head, &params)) {
+	  if(enif_is_identical(head, make_atom(env, "$last_insert_rowid"))) {
+	       head = enif_make_int64(env, sqlite3_last_insert_rowid(db));
+	  } else if(enif_get_tuple(env, head, &arity, &ref) && arity == 2 &&
+		    enif_is_identical(ref[0], make_atom(env, "$ref"))) {
+	       if(!enif_get_uint(env, ref[1], &n) || n == 0 || n > done)
+		    return 0;
+	       head = values[n - 1];
+	  }
+	  list = enif_make_list_cell(env, head, list);
+     }
+
+     return enif_make_reverse_list(env, list, resolved);
+}
+
+/*
+ * Step a statement until it is done. The rows are collected for
+ * queries, value is the first cell of the first row, or the last insert
+ * rowid for other statements. Returns 0 with an error in result when it
+ * fails.
+ */
+static int
+step_rows(ErlNifEnv *env, esqlite_connection *conn, sqlite3_stmt *stmt, int query,
+	  ERL_NIF_TERM *result, ERL_NIF_TERM *value)
+{
+     sqlite3 *db = conn->db;
+     ERL_NIF_TERM rows, *cells;
+     int i, rc, columns;
+
+     columns = sqlite3_column_count(stmt);
+     cells = enif_alloc(sizeof(ERL_NIF_TERM) * (columns + 1));
+     if(!cells) {
+	  *result = make_error_tuple(env, "no_memory");
+	  return 0;
+     }
+
+     *value = make_atom(env, "undefined");
+     rows = enif_make_list(env, 0);
+     while((rc = connection_step(conn, stmt)) == SQLITE_ROW) {
+	  if(!query)
+	       continue;
+	  for(i = 0; i < columns; i++)
+	       cells[i] = decode_any(env, NULL, stmt, i, 0);
+	  if(enif_is_empty_list(env, rows) && columns)
+	       *value = cells[0];
+	  rows = enif_make_list_cell(env, enif_make_tuple_from_array(env, cells, columns), rows);
+     }
+     enif_free(cells);
+
+     if(rc != SQLITE_DONE) {
+	  *result = rc == SQLITE_BUSY ? make_error_tuple(env, "busy") :
+	       make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+	  return 0;
+     }
+
+     if(query) {
+	  enif_make_reverse_list(env, rows, result);
+     } else {
+	  *result = make_atom(env, "ok");
+	  *value = enif_make_int64(env, sqlite3_last_insert_rowid(db));
+     }
+
+     return 1;
+}
+
+/*
+ * Is there another statement after tail? White space and comments do
+ * not count.
+ */
+static int
+more_statements(sqlite3 *db, const char *tail, const char *end)
+{
+     sqlite3_stmt *stmt;
+
+     if(tail >= end)
+	  return 0;
+     if(sqlite3_prepare_v2(db, tail, end - tail, &stmt, NULL) != SQLITE_OK)
+	  return 1;
+     if(!stmt)
+	  return 0;
+
+     sqlite3_finalize(stmt);
+     return 1;
+}
+
+/*
+ * Run one statement of a pipeline until it is done. Rows are collected
+ * for queries. Returns 0 with an error in result when it fails, sql with
+ * more than one statement is an error as well.
+ */
+static int
+pipeline_statement(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM sql, const ERL_NIF_TERM params,
+		   int query, ERL_NIF_TERM *result, ERL_NIF_TERM *value)
+{
+     sqlite3 *db = conn->db;
+     ErlNifBinary bin;
+     sqlite3_stmt *stmt;
+     const char *tail;
+     ERL_NIF_TERM row;
+     int ok;
+
+     if(!enif_inspect_iolist_as_binary(env, sql, &bin)) {
+	  *result = make_error_tuple(env, "invalid_sql");
+	  return 0;
+     }
+
+     if(sqlite3_prepare_v2(db, (char *) bin.data, bin.size, &stmt, &tail) != SQLITE_OK) {
+	  *result = make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+	  return 0;
+     }
+     if(!stmt) {
+	  *result = make_error_tuple(env, "no_statement");
+	  return 0;
+     }
+     if(more_statements(db, tail, (const char *) bin.data + bin.size)) {
+	  sqlite3_finalize(stmt);
+	  *result = make_error_tuple(env, "multiple_statements");
+	  return 0;
+     }
+
+     row = do_bind(env, db, stmt, params);
+     if(!enif_is_identical(row, make_atom(env, "ok"))) {
+	  sqlite3_finalize(stmt);
+	  *result = row;
+	  return 0;
+     }
+
+     ok = step_rows(env, conn, stmt, query, result, value);
+     sqlite3_finalize(stmt);
+
+     return ok;
+}
+
+/*
+ * Run operation n of a pipeline, its value is stored for later
+ * references.
+ */
+static int
+pipeline_op(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM op,
+	    ERL_NIF_TERM *values, unsigned int n, ERL_NIF_TERM *result)
+{
+     const ERL_NIF_TERM *args;
+     ERL_NIF_TERM params;
+     int arity, query;
+
+     if(!enif_get_tuple(env, op, &arity, &args) || arity < 2 || arity > 3) {
+	  *result = make_error_tuple(env, "invalid_operation");
+	  return 0;
+     }
+
+     query = enif_is_identical(args[0], make_atom(env, "query"));
+     if(!query && !enif_is_identical(args[0], make_atom(env, "exec"))) {
+	  *result = make_error_tuple(env, "invalid_operation");
+	  return 0;
+     }
+
+     if(arity == 2 && !query) {
+	  *result = do_exec(env, conn, args[1]);
+	  values[n] = enif_make_int64(env, sqlite3_last_insert_rowid(conn->db));
+	  return enif_is_identical(*result, make_atom(env, "ok"));
+     }
+
+     params = enif_make_list(env, 0);
+     if(arity == 3 && !pipeline_params(env, conn->db, args[2], values, n, &params)) {
+	  *result = make_error_tuple(env, "invalid_reference");
+	  return 0;
+     }
+
+     return pipeline_statement(env, conn, args[1], params, query, result, values + n);
+}
+
+/*
+ * Run an operation of a transaction. An operation wrapped as
+ * {savepoint, Op} runs in a savepoint, when it fails only its own
+ * changes are rolled back and its result is the error.
+ */
+static int
+transaction_op(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM op,
+	       ERL_NIF_TERM *values, unsigned int n, ERL_NIF_TERM *result)
+{
+     const ERL_NIF_TERM *args;
+     unsigned int mark = conn->n_changes;
+     int arity;
+
+     if(!enif_get_tuple(env, op, &arity, &args) || arity != 2 ||
+	!enif_is_identical(args[0], make_atom(env, "savepoint")))
+	  return pipeline_op(env, conn, op, values, n, result);
+
+     if(sqlite3_exec(conn->db, "SAVEPOINT esqlite_op", NULL, NULL, NULL) != SQLITE_OK) {
+	  *result = make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+	  return 0;
+     }
+
+     if(!pipeline_op(env, conn, args[1], values, n, result)) {
+	  values[n] = make_atom(env, "undefined");
+	  if(sqlite3_exec(conn->db, "ROLLBACK TO esqlite_op", NULL, NULL, NULL) != SQLITE_OK)
+	       return 0;
+	  if(conn->subscribers)
+	       changes_truncate(conn, mark);
+     }
+
+     if(sqlite3_exec(conn->db, "RELEASE esqlite_op", NULL, NULL, NULL) != SQLITE_OK) {
+	  *result = make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+	  return 0;
+     }
+
+     return 1;
+}
+
+/*
+ * Run the operations of a pipeline, or of a transaction. The answer is
+ * {ok, Results}, or {error, N, Reason} for the first operation which
+ * failed. Nothing else runs on the connection in the mean time, but a
+ * pipeline is not atomic. A transaction is rolled back when an
+ * operation fails, and committed when all succeed.
+ */
+static ERL_NIF_TERM
+run_operations(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM arg, int transaction)
+{
+     ERL_NIF_TERM *values, list, op, result, results;
+     const ERL_NIF_TERM *error;
+     unsigned int n = 0, length;
+     int arity, ok;
+
+     if(!enif_get_list_length(env, arg, &length))
+	  return make_error_tuple(env, "invalid_pipeline");
+
+     values = enif_alloc(sizeof(ERL_NIF_TERM) * (length + 1));
+     if(!values)
+	  return make_error_tuple(env, "no_memory");
+
+     if(transaction && sqlite3_exec(conn->db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+	  enif_free(values);
+	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+     }
+
+     results = enif_make_list(env, 0);
+     list = arg;
+     while(enif_get_list_cell(env, list, &op, &list)) {
+	  if(transaction)
+	       ok = transaction_op(env, conn, op, values, n, &result);
+	  else
+	       ok = pipeline_op(env, conn, op, values, n, &result);
+
+	  if(!ok) {
+	       enif_free(values);
+	       if(transaction)
+		    sqlite3_exec(conn->db, "ROLLBACK", NULL, NULL, NULL);
+	       if(enif_get_tuple(env, result, &arity, &error) && arity == 2)
+		    result = error[1];
+	       return enif_make_tuple3(env, make_atom(env, "error"), enif_make_uint(env, n + 1),
+				       result);
+	  }
+	  results = enif_make_list_cell(env, result, results);
+	  n++;
+     }
+     enif_free(values);
+
+     if(transaction && sqlite3_exec(conn->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+	  result = make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+	  sqlite3_exec(conn->db, "ROLLBACK", NULL, NULL, NULL);
+	  return result;
+     }
+
+     enif_make_reverse_list(env, results, &list);
+     return make_ok_tuple(env, list);
+}
+
+/*
+ * Is the statement an insert, update, delete or replace? Leading white
+ * space and comments are skipped.
+ */
+static int
+dml_statement(const char *sql)
+{
+     static const char *verbs[] = {"insert", "update", "delete", "replace", NULL};
+     int i;
+
+     for(i = 0; verbs[i]; i++) {
+	  if(sql_keyword(&sql, verbs[i]))
+	       return 1;
+     }
+     return 0;
+}
+
+/*
+ * Prepare and run every statement of a script, one after the other.
+ * The answer is a list with a result per statement: a list of rows for
+ * statements which return columns, {changes, N} with the rows changed
+ * by inserts, updates and deletes themselves, and ok for others. The
+ * script stops at the first statement which fails, its result is the
+ * error.
+ */
+static ERL_NIF_TERM
+do_exec_script(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM arg)
+{
+     sqlite3 *db = conn->db;
+     ErlNifBinary bin;
+     sqlite3_stmt *stmt;
+     ERL_NIF_TERM result, value, results;
+     const char *sql, *end;
+     int query;
+
+     if(!enif_inspect_iolist_as_binary(env, arg, &bin))
+	  return make_error_tuple(env, "invalid_sql");
+
+     results = enif_make_list(env, 0);
+     sql = (const char *) bin.data;
+     end = sql + bin.size;
+     while(sql < end && *sql) {
+	  if(sqlite3_prepare_v2(db, sql, end - sql, &stmt, &sql) != SQLITE_OK) {
+	       results = enif_make_list_cell(env, make_sqlite3_error_tuple(env, sqlite3_errmsg(db)), results);
+	       break;
+	  }
+	  if(!stmt)
+	       continue; /* whitespace or a comment */
+
+	  query = sqlite3_column_count(stmt) > 0;
+	  if(!step_rows(env, conn, stmt, query, &result, &value)) {
+	       sqlite3_finalize(stmt);
+	       results = enif_make_list_cell(env, result, results);
+	       break;
+	  }
+
+	  /* rows changed by triggers and foreign key actions are not
+	   * counted */
+	  if(!query && dml_statement(sqlite3_sql(stmt)))
+	       result = enif_make_tuple2(env, make_atom(env, "changes"), enif_make_int(env, sqlite3_changes(db)));
+	  else if(!query)
+	       result = make_atom(env, "ok");
+	  sqlite3_finalize(stmt);
+	  results = enif_make_list_cell(env, result, results);
+     }
+
+     enif_make_reverse_list(env, results, &result);
+     return result;
+}
+
+/*
+ * Private databases can only be changed by this connection.
+ */
+static int
+private_tables(sqlite3 *db, esqlite_cache *cache)
+{
+     unsigned int i;
+
+     for(i = 0; i < cache->read_count; i++) {
+	  if(!in_memory(db, cache->read[i]->database))
+	       return 0;
+     }
+     return 1;
+}
+
+/*
+ * Run a read only query. With cache the rows are cached, the tables the
+ * query reads are collected by the authorizer while it is prepared.
+ * Results read inside a transaction are not cached, they may be rolled
+ * back, and neither are results which read no table. Queries of files
+ * other connections can write to are refused, unless the caller says
+ * it is the only writer.
+ */
+static ERL_NIF_TERM
+do_read_query(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM arg)
+{
+     esqlite_cache *cache = conn->cache;
+     const ERL_NIF_TERM *args;
+     ErlNifBinary key, bin;
+     sqlite3_stmt *stmt;
+     ERL_NIF_TERM result, value;
+     int arity, rc, ok = 1, caching, single_writer;
+
+     if(!enif_get_tuple(env, arg, &arity, &args) || arity != 4 ||
+	!enif_inspect_binary(env, args[0], &key) ||
+	!enif_inspect_iolist_as_binary(env, args[1], &bin))
+	  return make_error_tuple(env, "invalid_query");
+
+     single_writer = enif_is_identical(args[3], make_atom(env, "single_writer"));
+     caching = single_writer || enif_is_identical(args[3], make_atom(env, "cached"));
+     if(caching && !cache) {
+	  cache = enif_alloc(sizeof(esqlite_cache));
+	  if(!cache)
+	       return make_error_tuple(env, "no_memory");
+	  memset(cache, 0, sizeof(esqlite_cache));
+
+	  enif_mutex_lock(conn->cache_lock);
+	  conn->cache = cache;
+	  enif_mutex_unlock(conn->cache_lock);
+	  connection_hooks(conn);
+     }
+
+     /* the rows may have been cached while the query was queued */
+     if(caching && cache_lookup(env, conn, &key, &result))
+	  return result;
+
+     if(caching) {
+	  cache->collecting = 1;
+	  cache->read_count = 0;
+     }
+     rc = sqlite3_prepare_v2(conn->db, (char *) bin.data, bin.size, &stmt, NULL);
+     if(caching) {
+	  ok = cache->collecting == 1 && cache->read_count;
+	  cache->collecting = 0;
+     }
+     if(rc != SQLITE_OK)
+	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+     if(!stmt)
+	  return make_error_tuple(env, "no_statement");
+
+     if(caching && ok && !single_writer && !private_tables(conn->db, cache)) {
+	  sqlite3_finalize(stmt);
+	  return make_error_tuple(env, "cache_needs_single_writer");
+     }
+
+     /* begin and friends are read only too, but give no rows */
+     if(!sqlite3_stmt_readonly(stmt) || !sqlite3_column_count(stmt)) {
+	  sqlite3_finalize(stmt);
+	  return make_error_tuple(env, "not_a_read_only_query");
+     }
+
+     result = do_bind(env, conn->db, stmt, args[2]);
+     if(!enif_is_identical(result, make_atom(env, "ok"))) {
+	  sqlite3_finalize(stmt);
+	  return result;
+     }
+
+     ok = step_rows(env, conn, stmt, 1, &result, &value) && ok;
+     sqlite3_finalize(stmt);
+
+     if(caching && ok && sqlite3_get_autocommit(conn->db))
+	  cache_store(conn, &key, result);
+
+     return result;
+}
+
+/*
+ * Is the queued command the same read query as the one just run? Reads
+ * of other queries are passed over, the search stops at any other
+ * command so nobody gets rows from before their own writes.
+ */
+static int
+same_read_query(void *item, void *arg)
+{
+     esqlite_command *cmd = (esqlite_command *) item;
+     esqlite_command *first = (esqlite_command *) arg;
+     const ERL_NIF_TERM *args, *first_args;
+     ErlNifBinary key, other;
+     int arity;
+
+     if(cmd->type != cmd_read_query)
+	  return -1;
+     if(!enif_get_tuple(cmd->env, cmd->arg, &arity, &args) || arity != 4 ||
+	!enif_inspect_binary(cmd->env, args[0], &other))
+	  return 0;
+     if(!enif_get_tuple(first->env, first->arg, &arity, &first_args) || arity != 4 ||
+	!enif_inspect_binary(first->env, first_args[0], &key))
+	  return 0;
+
+     /* cached and shared queries can answer differently */
+     return other.size == key.size && memcmp(other.data, key.data, key.size) == 0 &&
+	  enif_is_identical(args[3], first_args[3]);
+}
+
+/*
+ * Send the answer of a read query to everybody who queued the same
+ * query in the mean time, the query runs once for all of them.
+ */
+static void
+answer_read_query(esqlite_connection *conn, esqlite_command *cmd, ERL_NIF_TERM answer)
+{
+     esqlite_command *other;
+
+     while((other = queue_take(conn->commands, same_read_query, cmd))) {
+	  enif_send(NULL, &other->pid, other->env, make_answer(other, enif_make_copy(other->env, answer)));
+	  command_destroy(other);
+     }
+}
+
+/*
+ * Step through at most count rows of a json statement, into one json
+ * array.
+ */
+static ERL_NIF_TERM
+fetch_json(ErlNifEnv *env, esqlite_statement *stmt, unsigned int count)
+{
+     esqlite_buffer buf;
+     unsigned int rows = 0;
+     const char *status = "rows";
+     int rc;
+
+     buffer_init(&buf);
+     if(!buffer_append(&buf, "[", 1))
+	  return make_error_tuple(env, "no_memory");
+
+     while(rows < count) {
+	  rc = connection_step(stmt->handle->connection, stmt->statement);
+
+	  if(rc == SQLITE_ROW) {
+	       if((rows && !buffer_append(&buf, ",", 1)) || !json_append_row(&buf, stmt)) {
+		    buffer_release(&buf);
+		    return make_error_tuple(env, "no_memory");
+	       }
+	       rows++;
+	       continue;
+	  }
+
+	  if(rc == SQLITE_DONE) {
+	       status = "$done";
+	  } else if(rc == SQLITE_BUSY) {
+	       status = "$busy";
+	  } else {
+	       buffer_release(&buf);
+	       return make_error_tuple(env, "unexpected_return_value");
+	  }
+	  break;
+     }
+
+     if(!buffer_append(&buf, "]", 1)) {
+	  buffer_release(&buf);
+	  return make_error_tuple(env, "no_memory");
+     }
+
+     return enif_make_tuple2(env, make_atom(env, status), buffer_make_binary(env, &buf));
+}
+
+/*
+ * Step through at most count rows. The answer tells if the statement
+ * has more rows, is done or is busy, together with the rows fetched.
+ * With {chunk, Count} statements with an encoding fetch all rows, the
+ * encoded rows of two fetches can not be joined.
+ */
+static ERL_NIF_TERM
+do_fetch(ErlNifEnv *env, esqlite_statement *stmt, const ERL_NIF_TERM arg)
+{
+     esqlite_chunk chunk;
+     unsigned int count;
+     const char *status = "rows";
+     const ERL_NIF_TERM *chunk_arg;
+     ERL_NIF_TERM rows;
+     int arity;
+     int rc;
+
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+     if(enif_get_tuple(env, arg, &arity, &chunk_arg)) {
+	  if(arity != 2 || !enif_is_identical(chunk_arg[0], make_atom(env, "chunk")) ||
+	     !enif_get_uint(env, chunk_arg[1], &count) || count == 0)
+	       return make_error_tuple(env, "invalid_count");
+	  if(stmt->encoding != encoding_term)
+	       count = UINT_MAX;
+     } else if(!enif_get_uint(env, arg, &count) || count == 0)
+	  return make_error_tuple(env, "invalid_count");
+     if(stmt->encoding == encoding_json)
+	  return fetch_json(env, stmt, count);
+
+     chunk_init(&chunk, sqlite3_column_count(stmt->statement));
+
+     while(chunk.rows < count) {
+	  rc = connection_step(stmt->handle->connection, stmt->statement);
+
+	  if(rc == SQLITE_ROW) {
+	       if((chunk.rows == 0 && !statement_plan(stmt)) || !chunk_add_row(env, &chunk, stmt)) {
+		    chunk_release(&chunk);
+		    return make_error_tuple(env, "no_memory");
+	       }
+	       continue;
+	  }
+
+	  if(rc == SQLITE_DONE) {
+	       status = "$done";
+	  } else if(rc == SQLITE_BUSY) {
+	       status = "$busy";
+	  } else {
+	       chunk_release(&chunk);
+	       return make_error_tuple(env, "unexpected_return_value");
+	  }
+	  break;
+     }
+
+     if(!chunk_make_rows(env, &chunk, stmt, &rows)) {
+	  chunk_release(&chunk);
+	  return make_error_tuple(env, "duplicate_column_names");
+     }
+     chunk_release(&chunk);
+
+     return enif_make_tuple2(env, make_atom(env, status), encode_rows(env, stmt, rows));
+}
+
+/*
+ * Copy the current row into the result set, growing its buffers as
+ * needed.
+ */
+static int
+result_set_add_row(esqlite_result_set *rs, sqlite3_stmt *stmt,
+		   size_t *max_values, size_t *data_size, size_t *max_data)
+{
+     unsigned int i;
+     size_t needed;
+     esqlite_value *value;
+     const void *bytes;
+     void *p;
+
+     needed = (size_t) (rs->rows + 1) * rs->columns;
+     if(needed > *max_values) {
+	  *max_values = needed * 2;
+	  p = enif_realloc(rs->values, sizeof(esqlite_value) * (*max_values));
+	  if(!p)
+	       return 0;
+	  rs->values = p;
+     }
+
+     value = rs->values + (size_t) rs->rows * rs->columns;
+     for(i = 0; i < rs->columns; i++, value++) {
+	  value->type = sqlite3_column_type(stmt, i);
+	  value->size = 0;
+
+	  switch(value->type) {
+	  case SQLITE_INTEGER:
+	       value->v.i = sqlite3_column_int64(stmt, i);
+	       break;
+	  case SQLITE_FLOAT:
+	       value->v.d = sqlite3_column_double(stmt, i);
+	       break;
+	  case SQLITE_TEXT:
+	  case SQLITE_BLOB:
+	       if(value->type == SQLITE_TEXT)
+		    bytes = sqlite3_column_text(stmt, i);
+	       else
+		    bytes = sqlite3_column_blob(stmt, i);
+	       value->size = sqlite3_column_bytes(stmt, i);
+
+	       if(*data_size + value->size > *max_data) {
+		    *max_data = (*data_size + value->size) * 2;
+		    p = enif_realloc(rs->data, *max_data);
+		    if(!p)
+			 return 0;
+		    rs->data = p;
+	       }
+
+	       value->v.offset = *data_size;
+	       if(value->size)
+		    memcpy(rs->data + *data_size, bytes, value->size);
+	       *data_size += value->size;
+	       break;
+	  default:
+	       value->type = SQLITE_NULL;
+	  }
+     }
+
+     rs->rows++;
+     return 1;
+}
+
+/*
+ * Step through all rows and keep them in native memory. Terms are only
+ * made when the rows are accessed.
+ */
+static ERL_NIF_TERM
+do_result_set(ErlNifEnv *env, esqlite_connection *conn, sqlite3_stmt *stmt)
+{
+     esqlite_result_set *rs;
+     ERL_NIF_TERM result;
+     size_t max_values = 0, data_size = 0, max_data = 0;
+     int rc;
+
+     if(!stmt)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     rs = enif_alloc_resource(esqlite_result_set_type, sizeof(esqlite_result_set));
+     if(!rs)
+	  return make_error_tuple(env, "no_memory");
+
+     rs->columns = sqlite3_column_count(stmt);
+     rs->rows = 0;
+     rs->values = NULL;
+     rs->data = NULL;
+
+     while((rc = connection_step(conn, stmt)) == SQLITE_ROW) {
+	  if(!result_set_add_row(rs, stmt, &max_values, &data_size, &max_data)) {
+	       enif_release_resource(rs);
+	       sqlite3_reset(stmt);
+	       return make_error_tuple(env, "no_memory");
+	  }
+     }
+
+     if(rc != SQLITE_DONE) {
+	  enif_release_resource(rs);
+
+	  /* Start from the first row when the caller tries again. */
+	  sqlite3_reset(stmt);
+	  if(rc == SQLITE_BUSY)
+	       return make_atom(env, "$busy");
+	  return make_error_tuple(env, "unexpected_return_value");
+     }
+
+     result = enif_make_resource(env, rs);
+     enif_release_resource(rs);
+
+     return make_ok_tuple(env, result);
+}
+
+static ERL_NIF_TERM
+make_value(ErlNifEnv *env, const esqlite_result_set *rs, const esqlite_value *value)
+{
+     switch(value->type) {
+     case SQLITE_INTEGER:
+	  return enif_make_int64(env, value->v.i);
+     case SQLITE_FLOAT:
+	  return enif_make_double(env, value->v.d);
+     case SQLITE_BLOB:
+	  return make_binary(env, rs->data + value->v.offset, value->size);
+     case SQLITE_TEXT:
+	  return enif_make_string_len(env, (char *) rs->data + value->v.offset,
+				      value->size, ERL_NIF_LATIN1);
+     default:
+	  return make_atom(env, "undefined");
+     }
+}
+
+static ERL_NIF_TERM
+make_result_set_row(ErlNifEnv *env, const esqlite_result_set *rs, unsigned int row)
+{
+     unsigned int i;
+     const esqlite_value *value;
+     ERL_NIF_TERM *array;
+     ERL_NIF_TERM result;
+
+     array = (ERL_NIF_TERM *) enif_alloc(sizeof(ERL_NIF_TERM) * (rs->columns + 1));
+     if(!array)
+	  return make_error_tuple(env, "no_memory");
+
+     value = rs->values + (size_t) row * rs->columns;
+     for(i = 0; i < rs->columns; i++)
+	  array[i] = make_value(env, rs, value + i);
+
+     result = enif_make_tuple_from_array(env, array, rs->columns);
+     enif_free(array);
+     return result;
+}
+
+/*
+ * One column of a columnar result under construction. The values and
+ * the offsets are only kept once a number or a text or blob is seen.
+ */
+typedef struct {
+     int types;             /* bit (1 << type) is set for each type seen */
+     esqlite_buffer types_of_rows; /* one type byte per row */
+     esqlite_buffer values; /* an int64 or double per row */
+     esqlite_buffer data;   /* text and blob bytes */
+     esqlite_buffer offsets; /* uint64 start of each row in data, plus the end */
+     esqlite_buffer nulls;  /* bit per row, set when the value is NULL */
+} esqlite_column_buffer;
+
+static void
+column_buffer_release(esqlite_column_buffer *col)
+{
+     buffer_release(&col->types_of_rows);
+     buffer_release(&col->values);
+     buffer_release(&col->data);
+     buffer_release(&col->offsets);
+     buffer_release(&col->nulls);
+}
+
+static int
+column_buffer_add(esqlite_column_buffer *col, sqlite3_stmt *stmt, unsigned int i, unsigned int row)
+{
+     unsigned char type = (unsigned char) sqlite3_column_type(stmt, i);
+     sqlite3_int64 the_int = 0;
+     double the_double;
+     sqlite3_uint64 offset;
+     unsigned char *nulls;
+     const void *bytes;
+     int size;
+
+     if(row % 8 == 0) {
+	  nulls = buffer_reserve(&col->nulls, 1);
+	  if(!nulls)
+	       return 0;
+	  *nulls = 0;
+	  col->nulls.size++;
+     }
+
+     col->types |= 1 << type;
+     if(!buffer_append(&col->types_of_rows, &type, 1))
+	  return 0;
+
+     switch(type) {
+     case SQLITE_INTEGER:
+     case SQLITE_FLOAT:
+	  /* the earlier rows had no number */
+	  if(!col->values.bin.data && !buffer_append_zeros(&col->values, (size_t) row * sizeof(the_int)))
+	       return 0;
+	  if(type == SQLITE_INTEGER) {
+	       the_int = sqlite3_column_int64(stmt, i);
+	       break;
+	  }
+	  the_double = sqlite3_column_double(stmt, i);
+	  memcpy(&the_int, &the_double, sizeof(the_double));
+	  break;
+     case SQLITE_TEXT:
+     case SQLITE_BLOB:
+	  /* the earlier rows had no bytes, their offsets are all 0 */
+	  if(!col->offsets.bin.data && !buffer_append_zeros(&col->offsets, (size_t) (row + 1) * sizeof(offset)))
+	       return 0;
+	  if(type == SQLITE_TEXT)
+	       bytes = sqlite3_column_text(stmt, i);
+	  else
+	       bytes = sqlite3_column_blob(stmt, i);
+	  size = sqlite3_column_bytes(stmt, i);
+	  if(!buffer_append(&col->data, bytes, size))
+	       return 0;
+	  break;
+     default:
+	  col->nulls.bin.data[row / 8] |= 1 << (row % 8);
+     }
+
+     if(col->values.bin.data && !buffer_append(&col->values, &the_int, sizeof(the_int)))
+	  return 0;
+
+     offset = col->data.size;
+     if(col->offsets.bin.data && !buffer_append(&col->offsets, &offset, sizeof(offset)))
+	  return 0;
+
+     return 1;
+}
+
+/*
+ * Make the term for a finished column. Numeric columns become packed
+ * native endian int64 or float64 values, integers are widened when
+ * floats are mixed in. Text or blob columns become the concatenated
+ * bytes plus the offsets. Columns which mix numbers with text or blobs,
+ * or text with blobs, fall back to a list of cells.
+ */
+static ERL_NIF_TERM
+make_column(ErlNifEnv *env, esqlite_column_buffer *col, unsigned int rows)
+{
+     const int numeric = (1 << SQLITE_INTEGER) | (1 << SQLITE_FLOAT);
+     const int bytes = (1 << SQLITE_TEXT) | (1 << SQLITE_BLOB);
+     int types = col->types & ~(1 << SQLITE_NULL);
+     sqlite3_uint64 *offsets;
+     sqlite3_int64 *ints;
+     double *doubles;
+     unsigned char *row_types;
+     ERL_NIF_TERM *cells, list;
+     unsigned int i;
+
+     if(types & bytes && !(types & numeric) && (types & bytes) != bytes) {
+	  ERL_NIF_TERM type = make_atom(env, types & (1 << SQLITE_BLOB) ? "blob" : "text");
+	  ERL_NIF_TERM data = buffer_make_binary(env, &col->data);
+	  ERL_NIF_TERM offsets = buffer_make_binary(env, &col->offsets);
+
+	  return enif_make_tuple4(env, type, data, offsets, buffer_make_binary(env, &col->nulls));
+     }
+
+     if(!(types & bytes)) {
+	  /* only nulls */
+	  if(!col->values.bin.data && !buffer_append_zeros(&col->values, (size_t) rows * sizeof(sqlite3_int64)))
+	       return make_error_tuple(env, "no_memory");
+
+	  if(types & (1 << SQLITE_FLOAT)) {
+	       row_types = col->types_of_rows.bin.data;
+	       ints = (sqlite3_int64 *) col->values.bin.data;
+	       doubles = (double *) col->values.bin.data;
+	       for(i = 0; i < rows; i++) {
+		    if(row_types[i] == SQLITE_INTEGER)
+			 doubles[i] = (double) ints[i];
+	       }
+
+	       return enif_make_tuple3(env, make_atom(env, "float"),
+				       buffer_make_binary(env, &col->values),
+				       buffer_make_binary(env, &col->nulls));
+	  }
+
+	  return enif_make_tuple3(env, make_atom(env, "integer"),
+				  buffer_make_binary(env, &col->values),
+				  buffer_make_binary(env, &col->nulls));
+     }
+
+     cells = (ERL_NIF_TERM *) enif_alloc(sizeof(ERL_NIF_TERM) * (rows + 1));
+     if(!cells)
+	  return make_error_tuple(env, "no_memory");
+
+     row_types = col->types_of_rows.bin.data;
+     ints = (sqlite3_int64 *) col->values.bin.data;
+     doubles = (double *) col->values.bin.data;
+     offsets = (sqlite3_uint64 *) col->offsets.bin.data;
+     for(i = 0; i < rows; i++) {
+	  switch(row_types[i]) {
+	  case SQLITE_INTEGER:
+	       cells[i] = enif_make_int64(env, ints[i]);
+	       break;
+	  case SQLITE_FLOAT:
+	       cells[i] = enif_make_double(env, doubles[i]);
+	       break;
+	  case SQLITE_TEXT:
+	       cells[i] = enif_make_string_len(env, (char *) col->data.bin.data + offsets[i],
+					       offsets[i + 1] - offsets[i], ERL_NIF_LATIN1);
+	       break;
+	  case SQLITE_BLOB:
+	       cells[i] = make_binary(env, col->data.bin.data + offsets[i], offsets[i + 1] - offsets[i]);
+	       break;
+	  default:
+	       cells[i] = make_atom(env, "undefined");
+	  }
+     }
+
+     list = enif_make_list_from_array(env, cells, rows);
+     enif_free(cells);
+     return enif_make_tuple2(env, make_atom(env, "mixed"), list);
+}
+
+/*
+ * Step through all rows and return the result column by column.
+ */
+static ERL_NIF_TERM
+do_columnar(ErlNifEnv *env, esqlite_connection *conn, sqlite3_stmt *stmt)
+{
+     esqlite_column_buffer *cols;
+     unsigned int i, size, rows = 0;
+     ERL_NIF_TERM *array, result;
+     int rc;
+
+     if(!stmt)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     size = sqlite3_column_count(stmt);
+     cols = (esqlite_column_buffer *) enif_alloc(sizeof(esqlite_column_buffer) * (size + 1));
+     if(!cols)
+	  return make_error_tuple(env, "no_memory");
+
+     for(i = 0; i < size; i++) {
+	  cols[i].types = 0;
+	  buffer_init(&cols[i].types_of_rows);
+	  buffer_init(&cols[i].values);
+	  buffer_init(&cols[i].data);
+	  buffer_init(&cols[i].offsets);
+	  buffer_init(&cols[i].nulls);
+     }
+
+     while((rc = connection_step(conn, stmt)) == SQLITE_ROW) {
+	  for(i = 0; i < size; i++) {
+	       if(!column_buffer_add(&cols[i], stmt, i, rows))
+		    break;
+	  }
+	  if(i < size) {
+	       rc = SQLITE_NOMEM;
+	       break;
+	  }
+	  rows++;
+     }
+
+     if(rc != SQLITE_DONE) {
+	  for(i = 0; i < size; i++)
+	       column_buffer_release(&cols[i]);
+	  enif_free(cols);
+
+	  /* Start from the first row when the caller tries again. */
+	  sqlite3_reset(stmt);
+	  if(rc == SQLITE_BUSY)
+	       return make_atom(env, "$busy");
+	  if(rc == SQLITE_NOMEM)
+	       return make_error_tuple(env, "no_memory");
+	  return make_error_tuple(env, "unexpected_return_value");
+     }
+
+     array = (ERL_NIF_TERM *) enif_alloc(sizeof(ERL_NIF_TERM) * (size + 1));
+     for(i = 0; i < size; i++) {
+	  if(array)
+	       array[i] = make_column(env, &cols[i], rows);
+	  column_buffer_release(&cols[i]);
+     }
+     enif_free(cols);
+
+     if(!array)
+	  return make_error_tuple(env, "no_memory");
+
+     result = enif_make_list_from_array(env, array, size);
+     enif_free(array);
+
+     return enif_make_tuple3(env, make_atom(env, "ok"), enif_make_uint(env, rows), result);
+}
+
+static ERL_NIF_TERM
+do_column_names(ErlNifEnv *env, sqlite3_stmt *stmt)
+{
+     int i, size;
+     const char *name;
+     ERL_NIF_TERM *array;
+     ERL_NIF_TERM column_names;
+
+     if(!stmt)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     size = sqlite3_column_count(stmt);
+     array = (ERL_NIF_TERM *) malloc(sizeof(ERL_NIF_TERM) * size);
+
+     if(!array)
+	  return make_error_tuple(env, "no_memory");
+
+     for(i = 0; i < size; i++) {
+	  name = sqlite3_column_name(stmt, i);
+	  array[i] = make_atom(env, name);
+     }
+
+     column_names = enif_make_tuple_from_array(env, array, size);
+     free(array);
+     return column_names;
+}
+
+static ERL_NIF_TERM
+do_finalize(ErlNifEnv *env, sqlite3 *db, esqlite_statement *stmt)
+{
+     int rc;
+
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     forget_read_ahead(stmt);
+
+     rc = sqlite3_finalize(stmt->statement);
+     stmt->statement = NULL;
+     if(rc != SQLITE_OK)
+	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(db));
+
+     return make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM
+do_close(ErlNifEnv *env, esqlite_connection *conn, const ERL_NIF_TERM arg)
+{
+     ERL_NIF_TERM error;
+     int rc;
+
+     /* the database stays open when it could not be written back */
+     if(conn->write_back && !write_back(conn, env, &error))
+	  return error;
+
+     rc = sqlite3_close(conn->db);
+     if(rc != SQLITE_OK)
+	  return make_sqlite3_error_tuple(env, sqlite3_errmsg(conn->db));
+
+     conn->db = NULL;
+     if(conn->write_back)
+	  enif_free(conn->write_back);
+     conn->write_back = NULL;
+
+     /* cache hits are answered by the nif, not after a close */
+     if(conn->cache) {
+	  enif_mutex_lock(conn->cache_lock);
+	  cache_clear(conn->cache);
+	  enif_mutex_unlock(conn->cache_lock);
+     }
+
+     return make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM
+evaluate_command(esqlite_command *cmd, esqlite_connection *conn)
+{
+     /* Only opening, closing and cleaning up orphans work without a
+      * database, sqlite does not check for a NULL connection.
+      */
+     if(!conn->db && cmd->type != cmd_open && cmd->type != cmd_close &&
+	cmd->type != cmd_kv_close && cmd->type != cmd_blob_close && !cmd->orphan)
+	  return make_error_tuple(cmd->env, "database_not_open");
+
+     switch(cmd->type) {
+     case cmd_open:
+	  return do_open(cmd->env, conn, cmd->arg);
+     case cmd_exec:
+	  return do_exec(cmd->env, conn, cmd->arg);
+     case cmd_prepare:
+	  return do_prepare(cmd->env, cmd->handle, cmd->arg);
+     case cmd_step:
+	  return do_step(cmd->env, cmd->stmt);
+     case cmd_bind:
+	  /* a read ahead queued before the bind may have buffered rows of
+	   * the old parameters */
+	  forget_read_ahead(cmd->stmt);
+	  return do_bind(cmd->env, conn->db, cmd->stmt->statement, cmd->arg);
+     case cmd_column_names:
+	  return do_column_names(cmd->env, cmd->stmt->statement);
+     case cmd_fetch:
+	  return do_fetch(cmd->env, cmd->stmt, cmd->arg);
+     case cmd_result_set:
+	  return do_result_set(cmd->env, conn, cmd->stmt->statement);
+     case cmd_columnar:
+	  return do_columnar(cmd->env, conn, cmd->stmt->statement);
+     case cmd_read_ahead:
+	  do_read_ahead(cmd->stmt);
+	  return make_atom(cmd->env, "ok");
+     case cmd_multi_get:
+	  return do_multi_get(cmd->env, conn->db, cmd->stmt, cmd->arg);
+     case cmd_kv_open:
+	  return do_kv_open(cmd->env, cmd->handle, cmd->arg);
+     case cmd_kv:
+	  return do_kv(cmd->env, conn->db, cmd->kv, cmd->arg);
+     case cmd_pipeline:
+	  return run_operations(cmd->env, conn, cmd->arg, 0);
+     case cmd_transaction:
+	  return run_operations(cmd->env, conn, cmd->arg, 1);
+     case cmd_exec_script:
+	  return do_exec_script(cmd->env, conn, cmd->arg);
+     case cmd_subscribe:
+	  return do_subscribe(cmd->env, conn, cmd->ref, cmd->pid);
+     case cmd_unsubscribe:
+	  return do_unsubscribe(cmd->env, conn, cmd->arg);
+     case cmd_read_query:
+	  return do_read_query(cmd->env, conn, cmd->arg);
+     case cmd_blob_open:
+	  return do_blob_open(cmd->env, cmd->handle, cmd->arg);
+     case cmd_blob:
+	  return do_blob(cmd->env, conn->db, cmd->blob, cmd->arg);
+     case cmd_blob_close:
+	  sqlite3_blob_close(cmd->orphan_blob);
+	  return make_atom(cmd->env, "ok");
+     case cmd_backup:
+	  return do_backup(cmd->env, conn, cmd);
+     case cmd_kv_close:
+	  kv_filter_close(conn, cmd->orphan_filter);
+	  return make_atom(cmd->env, "ok");
+     case cmd_finalize:
+	  if(cmd->orphan) {
+	       sqlite3_finalize(cmd->orphan);
+	       return make_atom(cmd->env, "ok");
+	  }
+	  return do_finalize(cmd->env, conn->db, cmd->stmt);
+     case cmd_close:
+	  return do_close(cmd->env, conn, cmd->arg);
+     default:
+	  return make_error_tuple(cmd->env, "invalid_command");
+     }
+}
+
+static void *
+esqlite_connection_run(void *arg)
+{
+     esqlite_connection *db = (esqlite_connection *) arg;
+     esqlite_command *cmd;
+     esqlite_subscriber *sub;
+     ERL_NIF_TERM answer;
+     int continue_running = 1;
+
+     db->alive = 1;
+
+     while(continue_running) {
+	  cmd = queue_pop(db->commands);
+
+	  if(cmd->type == cmd_stop) {
+	       continue_running = 0;
+	  } else if(!cmd->ref) {
+	       evaluate_command(cmd, db); /* nobody is waiting for an answer */
+	       if(db->committed)
+		    changes_flush(db);
+	  } else {
+	       answer = evaluate_command(cmd, db);
+
+	       /* subscribers get the changes before the writer gets its
+		* answer, so whatever the writer does next comes after them */
+	       if(db->committed)
+		    changes_flush(db);
+	       if(cmd->type == cmd_read_query)
+		    answer_read_query(db, cmd, answer);
+	       if(!cmd->requeue)
+		    enif_send(NULL, &cmd->pid, cmd->env, make_answer(cmd, answer));
+	  }
+
+	  /* a backup continues after the commands queued in the mean time */
+	  if(cmd->requeue) {
+	       cmd->requeue = 0;
+	       if(queue_push(db->commands, cmd))
+		    continue;
+	       enif_send(NULL, &cmd->pid, cmd->env, make_answer(cmd, make_error_tuple(cmd->env, "no_memory")));
+	  }
+
+	  command_destroy(cmd);
+     }
+
+     /* The handle is gone and nothing can be queued anymore. Close the
+      * database from here, so no scheduler has to wait for it.
+      */
+     if(db->db && db->write_back)
+	  write_back(db, NULL, NULL);
+     if(db->db)
+	  sqlite3_close(db->db);
+     db->db = NULL;
+
+     while(db->subscribers) {
+	  sub = db->subscribers;
+	  db->subscribers = sub->next;
+	  subscriber_destroy(sub);
+     }
+     if(db->changes_env)
+	  enif_free_env(db->changes_env);
+     db->changes_env = NULL;
+     savepoints_clear(db);
+
+     if(db->cache)
+	  cache_destroy(db->cache);
+     db->cache = NULL;
+
+     queue_destroy(db->commands);
+     db->commands = NULL;
+
+     db->alive = 0;
+     queue_push(reaper.finished, db);
+
+     return NULL;
+}
+
+static void
+connection_destroy(esqlite_connection *conn)
+{
+     if(conn->commands)
+	  queue_destroy(conn->commands);
+     if(conn->opts)
+	  enif_thread_opts_destroy(conn->opts);
+     if(conn->cache_lock)
+	  enif_mutex_destroy(conn->cache_lock);
+     if(conn->write_back)
+	  enif_free(conn->write_back);
+
+     enif_free(conn);
+}
+
+/*
+ * Join the threads of stopped connections and free them. Runs until
+ * the library is unloaded and every connection thread has been joined.
+ */
+static void *
+esqlite_reaper_run(void *arg)
+{
+     esqlite_connection *conn;
+     int continue_running = 1;
+
+     while(continue_running) {
+	  conn = queue_pop(reaper.finished);
+
+	  enif_mutex_lock(reaper.lock);
+	  if(conn)
+	       reaper.running--;
+	  else
+	       reaper.stopping = 1;
+	  continue_running = !(reaper.stopping && reaper.running == 0);
+	  enif_mutex_unlock(reaper.lock);
+
+	  if(conn) {
+	       enif_thread_join(conn->tid, NULL);
+	       connection_destroy(conn);
+	  }
+     }
+
+     return NULL;
+}
+
+/*
+ * Start the processing thread
+ */
+static ERL_NIF_TERM
+esqlite_start(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_connection *conn;
+     esqlite_handle *handle;
+     ERL_NIF_TERM db_conn;
+
+     /* Initialize the connection context, it is owned by the thread */
+     conn = enif_alloc(sizeof(esqlite_connection));
+     if(!conn)
+	  return make_error_tuple(env, "no_memory");
+
+     conn->db = NULL;
+     conn->filters = NULL;
+     conn->subscribers = NULL;
+     conn->changes_env = NULL;
+     conn->n_changes = 0;
+     conn->overflow = 0;
+     conn->committed = 0;
+     conn->savepoints = NULL;
+     conn->cache_lock = NULL;
+     conn->cache = NULL;
+     conn->authorizer = 0;
+     conn->dropping = 0;
+     conn->write_back = NULL;
+     conn->opts = NULL;
+     conn->alive = 0;
+
+     /* Create command queue */
+     conn->commands = queue_create();
+     if(!conn->commands) {
+	  connection_destroy(conn);
+	  return make_error_tuple(env, "command_queue_create_failed");
+     }
+
+     conn->cache_lock = enif_mutex_create("esqlite_cache_lock");
+     if(!conn->cache_lock) {
+	  connection_destroy(conn);
+	  return make_error_tuple(env, "no_memory");
+     }
+
+     /* Initialize the resource */
+     handle = enif_alloc_resource(esqlite_connection_type, sizeof(esqlite_handle));
+     if(!handle) {
+	  connection_destroy(conn);
+	  return make_error_tuple(env, "no_memory");
+     }
+     handle->connection = conn;
+
+     /* Start command processing thread */
+     conn->opts = enif_thread_opts_create("esqldb_thread_opts");
+     if(enif_thread_create("esqlite_connection", &conn->tid, esqlite_connection_run, conn, conn->opts) != 0) {
+	  handle->connection = NULL;
+	  enif_release_resource(handle);
+	  connection_destroy(conn);
+	  return make_error_tuple(env, "thread_create_failed");
+     }
+
+     enif_mutex_lock(reaper.lock);
+     reaper.running++;
+     enif_mutex_unlock(reaper.lock);
+
+     db_conn = enif_make_resource(env, handle);
+     enif_release_resource(handle);
+
+     return make_ok_tuple(env, db_conn);
+}
+
+/*
+ * Open the database
+ */
+static ERL_NIF_TERM
+esqlite_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     /* Note, no check is made for the type of the argument */
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     /* command */
+     cmd->type = cmd_open;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+     return push_command(env, handle->connection, cmd);
+}
+
+/*
+ * Execute the sql statement
+ */
+static ERL_NIF_TERM
+esqlite_exec(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     /* command */
+     cmd->type = cmd_exec;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+     return push_command(env, handle->connection, cmd);
+}
+
+
+/*
+ * Prepare the sql statement
+ */
+static ERL_NIF_TERM
+esqlite_prepare(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_prepare;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+     return push_command(env, handle->connection, cmd);
+}
+
+/*
+ * Bind a variable to a prepared statement
+ */
+static ERL_NIF_TERM
+esqlite_bind(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_statement *stmt;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_statement_type, (void **) &stmt))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     forget_read_ahead(stmt);
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_bind;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_statement(cmd, stmt);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+     return push_command(env, stmt->handle->connection, cmd);
+}
+
+/*
+ * Step to a prepared statement
+ */
+static ERL_NIF_TERM
+esqlite_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_statement *stmt;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+     ERL_NIF_TERM answer;
+
+     if(argc != 3)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_statement_type, (void **) &stmt))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     /* served without a queue hop */
+     if(stmt->read_ahead && take_read_ahead(env, stmt, &answer))
+	  return enif_make_tuple2(env, make_atom(env, "answer"), answer);
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_step;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_statement(cmd, stmt);
+
+     return push_command(env, stmt->handle->connection, cmd);
+}
+
+/*
+ * Step to a prepared statement
+ */
+static ERL_NIF_TERM
+esqlite_column_names(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_statement *stmt;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 3)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_statement_type, (void **) &stmt))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_column_names;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_statement(cmd, stmt);
+
+     return push_command(env, stmt->handle->connection, cmd);
+}
+
+/*
+ * Fetch a number of rows from a prepared statement
+ */
+static ERL_NIF_TERM
+esqlite_fetch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_statement *stmt;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_statement_type, (void **) &stmt))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     if(stmt->read_ahead)
+	  return make_error_tuple(env, "read_ahead_statement");
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_fetch;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+     command_keep_statement(cmd, stmt);
+
+     return push_command(env, stmt->handle->connection, cmd);
+}
+
+/*
+ * Run a prepared statement for many lists of parameters in one command
+ */
+static ERL_NIF_TERM
+esqlite_multi_get(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_statement *stmt;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_statement_type, (void **) &stmt))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     forget_read_ahead(stmt);
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_multi_get;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+     command_keep_statement(cmd, stmt);
+
+     return push_command(env, stmt->handle->connection, cmd);
+}
+
+/*
+ * Run a pipeline of operations in one command
+ */
+static ERL_NIF_TERM
+esqlite_pipeline(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_pipeline;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+     return push_command(env, handle->connection, cmd);
+}
+
+/*
+ * Run operations in a transaction in one command
+ */
+static ERL_NIF_TERM
+esqlite_transaction(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_transaction;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+     return push_command(env, handle->connection, cmd);
+}
+
+/*
+ * Run every statement of a script in one command
+ */
+static ERL_NIF_TERM
+esqlite_exec_script(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_exec_script;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+     return push_command(env, handle->connection, cmd);
+}
+
+/*
+ * Queue a read only query. Identical queries queued at the same time
+ * run once. With cache the rows are cached, cached rows are answered
+ * right away as {answer, Rows}.
+ */
+static ERL_NIF_TERM
+read_query(ErlNifEnv *env, const ERL_NIF_TERM argv[], const char *mode)
+{
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+     ErlNifBinary key;
+     ERL_NIF_TERM answer;
+     int cache = strcmp(mode, "shared") != 0;
+
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+     if(!enif_term_to_binary(env, enif_make_tuple2(env, argv[3], argv[4]), &key))
+	  return make_error_tuple(env, "no_memory");
+
+     if(cache && cache_lookup(env, handle->connection, &key, &answer)) {
+	  enif_release_binary(&key);
+	  return enif_make_tuple2(env, make_atom(env, "answer"), answer);
+     }
+
+     cmd = command_create();
+     if(!cmd) {
+	  enif_release_binary(&key);
+	  return make_error_tuple(env, "command_create_failed");
+     }
+
+     cmd->type = cmd_read_query;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
+     cmd->arg = enif_make_tuple4(cmd->env, enif_make_binary(cmd->env, &key),
+				 enif_make_copy(cmd->env, argv[3]),
+				 enif_make_copy(cmd->env, argv[4]),
+				 make_atom(cmd->env, mode));
+
+     return push_command(env, handle->connection, cmd);
+}
+
+/*
+ * Run a read only query through the cache of the connection
+ */
+static ERL_NIF_TERM
+esqlite_cached_query(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     ERL_NIF_TERM opts, head;
+     const char *mode = "cached";
+
+     if(argc != 6)
+	  return enif_make_badarg(env);
+
+     opts = argv[5];
+     while(enif_get_list_cell(env, opts, &head, &opts)) {
+	  if(!enif_is_identical(head, make_atom(env, "single_writer")))
+	       return make_error_tuple(env, "invalid_option");
+	  mode = "single_writer";
+     }
+
+     return read_query(env, argv, mode);
+}
+
+/*
+ * Run a read only query, once for all identical queries queued at the
+ * same time
+ */
+static ERL_NIF_TERM
+esqlite_shared_query(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     if(argc != 5)
+	  return enif_make_badarg(env);
+
+     return read_query(env, argv, "shared");
+}
+
+/*
+ * Open a blob for incremental io
+ */
+static ERL_NIF_TERM
+esqlite_blob_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
+
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
+
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_blob_open;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+     return push_command(env, handle->connection, cmd);
 }
 
+/*
+ * Read, write, reopen or close a blob
+ */
 static ERL_NIF_TERM
-evaluate_command(esqlite_command *cmd, esqlite_connection *conn)
+esqlite_blob_op(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-     if(!conn->db)
-	  make_error_tuple(cmd->env, "database_not_open");
+     esqlite_blob *b;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
 
-     switch(cmd->type) {
-     case cmd_open:
-	  return do_open(cmd->env, conn, cmd->arg);
-     case cmd_exec:
-	  return do_exec(cmd->env, conn, cmd->arg);
-     case cmd_prepare:
-	  return do_prepare(cmd->env, conn, cmd->arg);
-     case cmd_step:
-	  return do_step(cmd->env, cmd->stmt);
-     case cmd_bind:
-	  return do_bind(cmd->env, conn->db, cmd->stmt, cmd->arg);
-     case cmd_column_names:
-	  return do_column_names(cmd->env, cmd->stmt);
-     case cmd_close:
-	  return do_close(cmd->env, conn, cmd->arg);
-     default:
-	  return make_error_tuple(cmd->env, "invalid_command");
-     }
-}
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_blob_type, (void **) &b))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
 
-static ERL_NIF_TERM
-make_answer(esqlite_command *cmd, ERL_NIF_TERM answer)
-{
-     return enif_make_tuple2(cmd->env, cmd->ref, answer);
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
+
+     cmd->type = cmd_blob;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_blob(cmd, b);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+     return push_command(env, b->handle->connection, cmd);
 }
 
-static void *
-esqlite_connection_run(void *arg)
+/*
+ * Backup the database to a file, a number of pages at a time
+ */
+static ERL_NIF_TERM
+esqlite_backup_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-     esqlite_connection *db = (esqlite_connection *) arg;
-     esqlite_command *cmd;
-     int continue_running = 1;
-
-     db->alive = 1;
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
 
-     while(continue_running) {
-	  cmd = queue_pop(db->commands);
+     if(argc != 4)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
 
-	  if(cmd->type == cmd_stop)
-	       continue_running = 0;
-	  else
-	       enif_send(NULL, &cmd->pid, cmd->env, make_answer(cmd, evaluate_command(cmd, db)));
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
 
-	  command_destroy(cmd);
-     }
+     cmd->type = cmd_backup;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
+     cmd->arg = enif_make_copy(cmd->env, argv[3]);
 
-     db->alive = 0;
-     return NULL;
+     return push_command(env, handle->connection, cmd);
 }
 
 /*
- * Start the processing thread
+ * Subscribe Dest to the changes committed on the connection
  */
 static ERL_NIF_TERM
-esqlite_start(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+esqlite_subscribe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-     esqlite_connection *conn;
-     ERL_NIF_TERM db_conn;
-
-     /* Initialize the resource */
-     conn = enif_alloc_resource(esqlite_connection_type, sizeof(esqlite_connection));
-     if(!conn)
-	  return make_error_tuple(env, "no_memory");
-
-     conn->db = NULL;
+     esqlite_handle *handle;
+     esqlite_command *cmd = NULL;
+     ErlNifPid pid;
 
-     /* Create command queue */
-     conn->commands = queue_create();
-     if(!conn->commands) {
-	  enif_release_resource(conn);
-	  return make_error_tuple(env, "command_queue_create_failed");
-     }
+     if(argc != 3)
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
+	  return enif_make_badarg(env);
+     if(!enif_is_ref(env, argv[1]))
+	  return make_error_tuple(env, "invalid_ref");
+     if(!enif_get_local_pid(env, argv[2], &pid))
+	  return make_error_tuple(env, "invalid_pid");
 
-     /* Start command processing thread */
-     conn->opts = enif_thread_opts_create("esqldb_thread_opts");
-     if(enif_thread_create("esqlite_connection", &conn->tid, esqlite_connection_run, conn, conn->opts) != 0) {
-	  enif_release_resource(conn);
-	  return make_error_tuple(env, "thread_create_failed");
-     }
+     cmd = command_create();
+     if(!cmd)
+	  return make_error_tuple(env, "command_create_failed");
 
-     db_conn = enif_make_resource(env, conn);
-     enif_release_resource(conn);
+     cmd->type = cmd_subscribe;
+     cmd->ref = enif_make_copy(cmd->env, argv[1]);
+     cmd->pid = pid;
+     command_keep_handle(cmd, handle);
 
-     return make_ok_tuple(env, db_conn);
+     return push_command(env, handle->connection, cmd);
 }
 
 /*
- * Open the database
+ * Stop the changes of a subscription
  */
 static ERL_NIF_TERM
-esqlite_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+esqlite_unsubscribe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-     esqlite_connection *db;
+     esqlite_handle *handle;
      esqlite_command *cmd = NULL;
      ErlNifPid pid;
 
      if(argc != 4)
 	  return enif_make_badarg(env);
-
-     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &db))
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
 	  return enif_make_badarg(env);
-
      if(!enif_is_ref(env, argv[1]))
 	  return make_error_tuple(env, "invalid_ref");
-
      if(!enif_get_local_pid(env, argv[2], &pid))
 	  return make_error_tuple(env, "invalid_pid");
+     if(!enif_is_ref(env, argv[3]))
+	  return make_error_tuple(env, "invalid_ref");
 
-     /* Note, no check is made for the type of the argument */
      cmd = command_create();
      if(!cmd)
 	  return make_error_tuple(env, "command_create_failed");
 
-     /* command */
-     cmd->type = cmd_open;
+     cmd->type = cmd_unsubscribe;
      cmd->ref = enif_make_copy(cmd->env, argv[1]);
      cmd->pid = pid;
+     command_keep_handle(cmd, handle);
      cmd->arg = enif_make_copy(cmd->env, argv[3]);
 
-     if(!queue_push(db->commands, cmd))
-	  return make_error_tuple(env, "command_push_failed");
-
-     return make_atom(env, "ok");
+     return push_command(env, handle->connection, cmd);
 }
 
 /*
- * Execute the sql statement
+ * Open a key value store over a table
  */
 static ERL_NIF_TERM
-esqlite_exec(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+esqlite_kv_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-     esqlite_connection *db;
+     esqlite_handle *handle;
      esqlite_command *cmd = NULL;
      ErlNifPid pid;
 
      if(argc != 4)
 	  return enif_make_badarg(env);
-
-     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &db))
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
 	  return enif_make_badarg(env);
-
      if(!enif_is_ref(env, argv[1]))
 	  return make_error_tuple(env, "invalid_ref");
-
      if(!enif_get_local_pid(env, argv[2], &pid))
 	  return make_error_tuple(env, "invalid_pid");
 
@@ -589,64 +5753,66 @@ esqlite_exec(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
      if(!cmd)
 	  return make_error_tuple(env, "command_create_failed");
 
-     /* command */
-     cmd->type = cmd_exec;
+     cmd->type = cmd_kv_open;
      cmd->ref = enif_make_copy(cmd->env, argv[1]);
      cmd->pid = pid;
+     command_keep_handle(cmd, handle);
      cmd->arg = enif_make_copy(cmd->env, argv[3]);
 
-     if(!queue_push(db->commands, cmd))
-	  return make_error_tuple(env, "command_push_failed");
-
-     return make_atom(env, "ok");
+     return push_command(env, handle->connection, cmd);
 }
 
-
 /*
- * Prepare the sql statement
+ * Run an operation on a key value store
  */
 static ERL_NIF_TERM
-esqlite_prepare(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+esqlite_kv_op(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-     esqlite_connection *conn;
+     esqlite_kv *kv;
      esqlite_command *cmd = NULL;
      ErlNifPid pid;
+     const ERL_NIF_TERM *op;
+     int arity;
 
      if(argc != 4)
 	  return enif_make_badarg(env);
-     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &conn))
+     if(!enif_get_resource(env, argv[0], esqlite_kv_type, (void **) &kv))
 	  return enif_make_badarg(env);
      if(!enif_is_ref(env, argv[1]))
 	  return make_error_tuple(env, "invalid_ref");
      if(!enif_get_local_pid(env, argv[2], &pid))
 	  return make_error_tuple(env, "invalid_pid");
 
+     /* absent keys are answered without a queue hop */
+     if(kv->filter && enif_get_tuple(env, argv[3], &arity, &op) && arity == 2 &&
+	enif_is_identical(op[0], make_atom(env, "get")) &&
+	!kv_may_contain(env, kv->filter, op[1]))
+	  return enif_make_tuple2(env, make_atom(env, "answer"), make_atom(env, "not_found"));
+
      cmd = command_create();
      if(!cmd)
 	  return make_error_tuple(env, "command_create_failed");
 
-     cmd->type = cmd_prepare;
+     cmd->type = cmd_kv;
      cmd->ref = enif_make_copy(cmd->env, argv[1]);
      cmd->pid = pid;
+     command_keep_kv(cmd, kv);
      cmd->arg = enif_make_copy(cmd->env, argv[3]);
 
-     if(!queue_push(conn->commands, cmd))
-	  return make_error_tuple(env, "command_push_failed");
-
-     return make_atom(env, "ok");
+     return push_command(env, kv->handle->connection, cmd);
 }
 
 /*
- * Bind a variable to a prepared statement
+ * Materialize all rows of a prepared statement in a result set
  */
 static ERL_NIF_TERM
-esqlite_bind(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+esqlite_fetch_result_set(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
      esqlite_statement *stmt;
      esqlite_command *cmd = NULL;
      ErlNifPid pid;
 
-     if(argc != 4)
+     if(argc != 3)
 	  return enif_make_badarg(env);
      if(!enif_get_resource(env, argv[0], esqlite_statement_type, (void **) &stmt))
 	  return enif_make_badarg(env);
@@ -655,32 +5821,29 @@ esqlite_bind(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
      if(!enif_get_local_pid(env, argv[2], &pid))
 	  return make_error_tuple(env, "invalid_pid");
 
+     if(!stmt->statement)
+	  return make_error_tuple(env, "no_prepared_statement");
+
+     if(stmt->read_ahead)
+	  return make_error_tuple(env, "read_ahead_statement");
+
      cmd = command_create();
      if(!cmd)
 	  return make_error_tuple(env, "command_create_failed");
 
-     cmd->type = cmd_bind;
+     cmd->type = cmd_result_set;
      cmd->ref = enif_make_copy(cmd->env, argv[1]);
      cmd->pid = pid;
-     cmd->stmt = stmt->statement;
-     cmd->arg = enif_make_copy(cmd->env, argv[3]);
-
-     if(!stmt->connection)
-	  return make_error_tuple(env, "no_connection");
-     if(!stmt->connection->commands)
-	  return make_error_tuple(env, "no_command_queue");
-
-     if(!queue_push(stmt->connection->commands, cmd))
-	  return make_error_tuple(env, "command_push_failed");
+     command_keep_statement(cmd, stmt);
 
-     return make_atom(env, "ok");
+     return push_command(env, stmt->handle->connection, cmd);
 }
 
 /*
- * Step to a prepared statement
+ * Fetch all rows of a prepared statement column by column
  */
 static ERL_NIF_TERM
-esqlite_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+esqlite_columnar(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
      esqlite_statement *stmt;
      esqlite_command *cmd = NULL;
@@ -698,31 +5861,167 @@ esqlite_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
      if(!stmt->statement)
 	  return make_error_tuple(env, "no_prepared_statement");
 
+     if(stmt->read_ahead)
+	  return make_error_tuple(env, "read_ahead_statement");
+
      cmd = command_create();
      if(!cmd)
 	  return make_error_tuple(env, "command_create_failed");
 
-     cmd->type = cmd_step;
+     cmd->type = cmd_columnar;
      cmd->ref = enif_make_copy(cmd->env, argv[1]);
      cmd->pid = pid;
-     cmd->stmt = stmt->statement;
+     command_keep_statement(cmd, stmt);
 
-     if(!stmt->connection)
-	  return make_error_tuple(env, "no_connection");
-     if(!stmt->connection->commands)
-	  return make_error_tuple(env, "no_command_queue");
+     return push_command(env, stmt->handle->connection, cmd);
+}
 
-     if(!queue_push(stmt->connection->commands, cmd))
-	  return make_error_tuple(env, "command_push_failed");
+/*
+ * The result set accessors below run directly in the calling process,
+ * result sets are never changed after they are made. Lists of many
+ * rows yield to the scheduler while they are made.
+ */
 
-     return make_atom(env, "ok");
+/*
+ * The number of rows in a result set
+ */
+static ERL_NIF_TERM
+esqlite_count(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_result_set *rs;
+
+     if(!enif_get_resource(env, argv[0], esqlite_result_set_type, (void **) &rs))
+	  return enif_make_badarg(env);
+
+     return enif_make_uint(env, rs->rows);
 }
 
 /*
- * Step to a prepared statement
+ * The N-th row of a result set, counting from 1
  */
 static ERL_NIF_TERM
-esqlite_column_names(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+esqlite_nth(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_result_set *rs;
+     unsigned int n;
+
+     if(!enif_get_uint(env, argv[0], &n))
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[1], esqlite_result_set_type, (void **) &rs))
+	  return enif_make_badarg(env);
+     if(n < 1 || n > rs->rows)
+	  return enif_make_badarg(env);
+
+     return make_result_set_row(env, rs, n - 1);
+}
+
+static ERL_NIF_TERM esqlite_result_set_list(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+/*
+ * Prepend rows first to last - 1 of a result set to list, whole rows
+ * or the values of one column, counting from 1. Long lists are made in
+ * parts, the call yields when its timeslice is used up and the rest is
+ * made by a rescheduled call.
+ */
+static ERL_NIF_TERM
+result_set_list(ErlNifEnv *env, esqlite_result_set *rs, ERL_NIF_TERM rs_term,
+		unsigned int column, unsigned int first, unsigned int last, ERL_NIF_TERM list)
+{
+     ERL_NIF_TERM argv[5];
+     unsigned int i = last, cells = 0;
+
+     while(i > first) {
+	  i--;
+	  if(column)
+	       list = enif_make_list_cell(env,
+					  make_value(env, rs, rs->values + (size_t) i * rs->columns + column - 1),
+					  list);
+	  else
+	       list = enif_make_list_cell(env, make_result_set_row(env, rs, i), list);
+
+	  cells += column ? 1 : rs->columns;
+	  if(cells < YIELD_CELLS)
+	       continue;
+	  cells = 0;
+	  if(i > first && enif_consume_timeslice(env, 10)) {
+	       argv[0] = rs_term;
+	       argv[1] = enif_make_uint(env, column);
+	       argv[2] = enif_make_uint(env, first);
+	       argv[3] = enif_make_uint(env, i);
+	       argv[4] = list;
+	       return enif_schedule_nif(env, "result_set_list", 0, esqlite_result_set_list, 5, argv);
+	  }
+     }
+
+     return list;
+}
+
+/*
+ * The rest of a list of a result set, after a yield
+ */
+static ERL_NIF_TERM
+esqlite_result_set_list(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_result_set *rs;
+     unsigned int column, first, last;
+
+     if(!enif_get_resource(env, argv[0], esqlite_result_set_type, (void **) &rs) ||
+	!enif_get_uint(env, argv[1], &column) ||
+	!enif_get_uint(env, argv[2], &first) ||
+	!enif_get_uint(env, argv[3], &last))
+	  return enif_make_badarg(env);
+
+     return result_set_list(env, rs, argv[0], column, first, last, argv[4]);
+}
+
+/*
+ * At most Len rows of a result set, starting at row Start
+ */
+static ERL_NIF_TERM
+esqlite_slice(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_result_set *rs;
+     unsigned int start, len;
+
+     if(!enif_get_uint(env, argv[0], &start) || start < 1)
+	  return enif_make_badarg(env);
+     if(!enif_get_uint(env, argv[1], &len))
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[2], esqlite_result_set_type, (void **) &rs))
+	  return enif_make_badarg(env);
+
+     if(start > rs->rows)
+	  return enif_make_list(env, 0);
+     if(len > rs->rows - start + 1)
+	  len = rs->rows - start + 1;
+
+     return result_set_list(env, rs, argv[2], 0, start - 1, start - 1 + len, enif_make_list(env, 0));
+}
+
+/*
+ * All values of the N-th column of a result set, counting from 1
+ */
+static ERL_NIF_TERM
+esqlite_column(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+     esqlite_result_set *rs;
+     unsigned int n;
+
+     if(!enif_get_uint(env, argv[0], &n))
+	  return enif_make_badarg(env);
+     if(!enif_get_resource(env, argv[1], esqlite_result_set_type, (void **) &rs))
+	  return enif_make_badarg(env);
+     if(n < 1 || n > rs->columns)
+	  return enif_make_badarg(env);
+
+     return result_set_list(env, rs, argv[1], n, 0, rs->rows, enif_make_list(env, 0));
+}
+
+/*
+ * Finalize a prepared statement
+ */
+static ERL_NIF_TERM
+esqlite_finalize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
      esqlite_statement *stmt;
      esqlite_command *cmd = NULL;
@@ -740,24 +6039,21 @@ esqlite_column_names(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
      if(!stmt->statement)
 	  return make_error_tuple(env, "no_prepared_statement");
 
+     forget_read_ahead(stmt);
+
      cmd = command_create();
      if(!cmd)
 	  return make_error_tuple(env, "command_create_failed");
 
-     cmd->type = cmd_column_names;
+     /* Commands queued before this one still see the statement,
+      * everything after it finds it finalized.
+      */
+     cmd->type = cmd_finalize;
      cmd->ref = enif_make_copy(cmd->env, argv[1]);
      cmd->pid = pid;
-     cmd->stmt = stmt->statement;
+     command_keep_statement(cmd, stmt);
 
-     if(!stmt->connection)
-	  return make_error_tuple(env, "no_connection");
-     if(!stmt->connection->commands)
-	  return make_error_tuple(env, "no_command_queue");
-
-     if(!queue_push(stmt->connection->commands, cmd))
-	  return make_error_tuple(env, "command_push_failed");
-
-     return make_atom(env, "ok");
+     return push_command(env, stmt->handle->connection, cmd);
 }
 
 /*
@@ -766,11 +6062,11 @@ esqlite_column_names(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 static ERL_NIF_TERM
 esqlite_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-     esqlite_connection *conn;
+     esqlite_handle *handle;
      esqlite_command *cmd = NULL;
      ErlNifPid pid;
 
-     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &conn))
+     if(!enif_get_resource(env, argv[0], esqlite_connection_type, (void **) &handle))
 	  return enif_make_badarg(env);
 
      if(!enif_is_ref(env, argv[1]))
@@ -788,10 +6084,8 @@ esqlite_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
      cmd->type = cmd_close;
      cmd->ref = enif_make_copy(cmd->env, argv[1]);
      cmd->pid = pid;
-     if(!queue_push(conn->commands, cmd))
-	  return make_error_tuple(env, "command_push_failed");
-
-     return make_atom(env, "ok");
+     command_keep_handle(cmd, handle);
+     return push_command(env, handle->connection, cmd);
 }
 
 /*
@@ -814,19 +6108,82 @@ on_load(ErlNifEnv* env, void** priv, ERL_NIF_TERM info)
 	  return -1;
      esqlite_statement_type = rt;
 
+     rt =  enif_open_resource_type(env, "esqlite3_nif", "esqlite_result_set_type",
+				   destruct_esqlite_result_set, ERL_NIF_RT_CREATE, NULL);
+     if(!rt)
+	  return -1;
+     esqlite_result_set_type = rt;
+
+     rt =  enif_open_resource_type(env, "esqlite3_nif", "esqlite_kv_type",
+				   destruct_esqlite_kv, ERL_NIF_RT_CREATE, NULL);
+     if(!rt)
+	  return -1;
+     esqlite_kv_type = rt;
+
+     rt =  enif_open_resource_type(env, "esqlite3_nif", "esqlite_blob_type",
+				   destruct_esqlite_blob, ERL_NIF_RT_CREATE, NULL);
+     if(!rt)
+	  return -1;
+     esqlite_blob_type = rt;
+
+     reaper.running = 0;
+     reaper.stopping = 0;
+     reaper.lock = enif_mutex_create("esqlite_reaper_lock");
+     if(!reaper.lock)
+	  return -1;
+     reaper.finished = queue_create();
+     if(!reaper.finished)
+	  return -1;
+     if(enif_thread_create("esqlite_reaper", &reaper.tid, esqlite_reaper_run, NULL, NULL) != 0)
+	  return -1;
+
      return 0;
 }
 
+/*
+ * Unload the nif. Waits until all connection threads are gone.
+ */
+static void
+on_unload(ErlNifEnv* env, void* priv)
+{
+     queue_push(reaper.finished, NULL);
+     enif_thread_join(reaper.tid, NULL);
+
+     queue_destroy(reaper.finished);
+     enif_mutex_destroy(reaper.lock);
+}
+
 static ErlNifFunc nif_funcs[] = {
      {"start", 0, esqlite_start},
      {"open", 4, esqlite_open},
      {"exec", 4, esqlite_exec},
+     {"exec_script", 4, esqlite_exec_script},
      {"prepare", 4, esqlite_prepare},
      {"step", 3, esqlite_step},
      // {"esqlite_bind", 3, esqlite_bind_named},
      {"bind", 4, esqlite_bind},
      {"column_names", 3, esqlite_column_names},
+     {"fetch", 4, esqlite_fetch},
+     {"multi_get", 4, esqlite_multi_get},
+     {"kv_open", 4, esqlite_kv_open},
+     {"kv", 4, esqlite_kv_op},
+     {"pipeline", 4, esqlite_pipeline},
+     {"transaction", 4, esqlite_transaction},
+     {"subscribe", 3, esqlite_subscribe},
+     {"unsubscribe", 4, esqlite_unsubscribe},
+     {"cached_query", 6, esqlite_cached_query},
+     {"shared_query", 5, esqlite_shared_query},
+     {"blob_open", 4, esqlite_blob_open},
+     {"blob", 4, esqlite_blob_op},
+     {"backup", 4, esqlite_backup_nif},
+     {"result_set", 3, esqlite_fetch_result_set},
+     {"columnar", 3, esqlite_columnar},
+     {"count", 1, esqlite_count},
+     {"nth", 2, esqlite_nth},
+     {"slice", 3, esqlite_slice},
+     {"column", 2, esqlite_column},
+     {"finalize", 3, esqlite_finalize},
      {"close", 3, esqlite_close}
 };
 
-ERL_NIF_INIT(esqlite3_nif, nif_funcs, on_load, NULL, NULL, NULL);
+ERL_NIF_INIT(esqlite3_nif, nif_funcs, on_load, NULL, NULL, on_unload);
@@ -173,6 +173,47 @@ queue_pop(queue *queue)
     return item;
 }
 
+/* Remove the first item for which match returns 1, without waiting.
+ * Items for which it returns 0 are passed over, the search stops at an
+ * item for which it returns -1. Returns NULL when nothing was taken.
+ */
+void*
+queue_take(queue *queue, int (*match)(void *item, void *arg), void *arg)
+{
+    qitem *entry, *prev = NULL;
+    void* item = NULL;
+    int r;
+
+    enif_mutex_lock(queue->lock);
+
+    for(entry = queue->head; entry != NULL; prev = entry, entry = entry->next)
+    {
+        r = match(entry->data, arg);
+        if(r < 0)
+            break;
+        if(r == 0)
+            continue;
+
+        if(prev != NULL)
+            prev->next = entry->next;
+        else
+            queue->head = entry->next;
+        if(queue->tail == entry)
+            queue->tail = prev;
+        queue->length -= 1;
+
+        item = entry->data;
+        break;
+    }
+
+    enif_mutex_unlock(queue->lock);
+
+    if(item != NULL)
+        enif_free(entry);
+
+    return item;
+}
+
 int
 queue_send(queue *queue, void *item)
 {
@@ -17,6 +17,7 @@ int queue_has_item(queue *queue);
 
 int queue_push(queue *queue, void* item);
 void* queue_pop(queue *queue);
+void* queue_take(queue *queue, int (*match)(void *item, void *arg), void *arg);
 
 int queue_send(queue *queue, void* item);
 void* queue_receive(queue *);
@@ -22,18 +22,44 @@
 
 %% higher-level export
 -export([open/1, open/2,
-	 exec/2, exec/3,
-	 prepare/2, prepare/3,
+	 open_in_memory_copy/1, open_in_memory_copy/2, open_in_memory_copy/3,
+	 exec/2, exec/3, exec/4,
+	 exec_script/2, exec_script/3,
+	 prepare/2, prepare/3, prepare/4,
 	 step/1, step/2,
 	 bind/2, bind/3,
 	 fetchone/1,
-	 fetchall/1,
+	 fetch/2, fetch/3,
+	 multi_get/2, multi_get/3,
+	 kv_open/2, kv_open/3, kv_open/4,
+	 kv_get/2, kv_get/3,
+	 kv_put/3, kv_put/4,
+	 kv_delete/2, kv_delete/3,
+	 kv_multi_get/2, kv_multi_get/3,
+	 kv_range/4, kv_range/5,
+	 pipeline/2, pipeline/3,
+	 transaction/2, transaction/3,
+	 subscribe/1, subscribe/2,
+	 unsubscribe/2, unsubscribe/3,
+	 blob_open/4, blob_open/5, blob_open/6,
+	 blob_size/1, blob_size/2,
+	 blob_read/3, blob_read/4,
+	 blob_write/3, blob_write/4,
+	 blob_reopen/2, blob_reopen/3,
+	 blob_close/1, blob_close/2,
+	 backup/2, backup/3, backup/4,
+	 fetchall/1, fetchall/2,
+	 result_set/1, result_set/2,
+	 nth/2, slice/3, column/2, count/1,
+	 columnar/1, columnar/2,
 	 column_names/1, column_names/2,
+	 finalize/1, finalize/2,
 	 close/1, close/2]).
 
--export([q/2, q/3, map/3, foreach/3]).
+-export([q/2, q/3, cached_q/2, cached_q/3, cached_q/4, shared_q/2, shared_q/3, map/3, foreach/3]).
 
 -define(DEFAULT_TIMEOUT, infinity).
+-define(FETCH_CHUNK_SIZE, 1000).
 
 %% @doc Opens a sqlite3 database mentioned in Filename.
 %%
@@ -56,6 +82,39 @@ open(Filename, Timeout) ->
 	    {error, Other}
     end.
 
+%% @doc Open an in memory database with a copy of the database in Filename.
+%%
+%% @spec open_in_memory_copy(string()) -> {ok, connection()} | {error, error_message()}
+open_in_memory_copy(Filename) ->
+    open_in_memory_copy(Filename, [], ?DEFAULT_TIMEOUT).
+
+%% @doc Open an in memory copy with options, or with a timeout.
+%%
+%% The file is copied into memory in one go. With option write_back
+%% the database is copied back to the file when the connection is
+%% closed or garbage collected. To write back in between use
+%% backup(Filename, Connection), which does not block the connection.
+%%
+%% @spec open_in_memory_copy(string(), list() | timeout()) -> {ok, connection()} | {error, error_message()}
+open_in_memory_copy(Filename, Options) when is_list(Options) ->
+    open_in_memory_copy(Filename, Options, ?DEFAULT_TIMEOUT);
+open_in_memory_copy(Filename, Timeout) ->
+    open_in_memory_copy(Filename, [], Timeout).
+
+%% @doc Open an in memory copy of a database.
+%%
+%% @spec open_in_memory_copy(string(), list(), timeout()) -> {ok, connection()} | {error, error_message()}
+open_in_memory_copy(Filename, Options, Timeout) ->
+    {ok, Connection} = open(":memory:", Timeout),
+    WriteBack = [write_back || proplists:get_bool(write_back, Options)],
+    case backup(Filename, Connection, [restore | WriteBack], Timeout) of
+	ok ->
+	    {ok, Connection};
+	Error ->
+	    close(Connection, Timeout),
+	    Error
+    end.
+
 %% @doc Execute a sql statement, returns a list with tuples.
 q(Sql, Connection) ->
     q(Sql, [], Connection).
@@ -69,6 +128,57 @@ q(Sql, Args, Connection) ->
     ok = bind(Statement, Args),
     fetchall(Statement).
 
+%% @doc Execute a read only query through the query cache of the connection.
+cached_q(Sql, Connection) ->
+    cached_q(Sql, [], Connection).
+
+%% @doc Execute a read only query with args through the query cache.
+%%
+%% The rows are cached by Sql and Args until one of the tables read by
+%% the query changes on this connection. Cached rows are returned
+%% without waiting for the connection thread. Queries inside a
+%% transaction, queries which read no table and queries which call
+%% functions like random() or date('now') are run, but not cached.
+%%
+%% The cache only sees the writes made through this connection, so
+%% queries of databases in files are refused with
+%% cache_needs_single_writer. See cached_q/4.
+cached_q(Sql, Args, Connection) ->
+    cached_q(Sql, Args, Connection, []).
+
+%% @doc Execute a read only query with args through the query cache,
+%% with options.
+%%
+%% The option single_writer says that no other connection or process
+%% writes to the databases read by the query, which allows caching rows
+%% of databases in files.
+cached_q(Sql, Args, Connection, Options) ->
+    Ref = make_ref(),
+    read_answer(Ref, esqlite3_nif:cached_query(Connection, Ref, self(), Sql, Args, Options)).
+
+%% @doc Execute a read only query, once for all identical queries.
+shared_q(Sql, Connection) ->
+    shared_q(Sql, [], Connection).
+
+%% @doc Execute a read only query with args, once for all identical queries.
+%%
+%% When several processes queue the same query with the same args at
+%% the same time, the connection thread runs it once and sends the rows
+%% to all of them. Queries queued after other commands are not combined
+%% with earlier ones, so everybody sees their own writes.
+shared_q(Sql, Args, Connection) ->
+    Ref = make_ref(),
+    read_answer(Ref, esqlite3_nif:shared_query(Connection, Ref, self(), Sql, Args)).
+
+read_answer(Ref, ok) ->
+    read_answer(Ref, {answer, receive_answer(Ref, ?DEFAULT_TIMEOUT)});
+read_answer(_Ref, {answer, {error, _}=Error}) ->
+    throw(Error);
+read_answer(_Ref, {answer, Rows}) ->
+    Rows;
+read_answer(_Ref, Error) ->
+    throw(Error).
+
 %%
 map(F, Sql, Connection) ->
     {ok, Statement} = prepare(Sql, Connection),
@@ -83,7 +193,7 @@ foreach(F, Sql, Connection) ->
 foreach_s(F, Statement) when is_function(F, 1) ->
     case try_step(Statement, 0) of
 	'$done' -> ok;
-	Row when is_tuple(Row) ->
+	Row when is_tuple(Row); is_map(Row); is_binary(Row) ->
 	    F(Row),
 	    foreach_s(F, Statement)
     end;
@@ -91,7 +201,7 @@ foreach_s(F, Statement) when is_function(F, 2) ->
     ColumnNames = column_names(Statement),
     case try_step(Statement, 0) of
 	'$done' -> ok;
-	Row when is_tuple(Row) ->
+	Row when is_tuple(Row); is_map(Row); is_binary(Row) ->
 	    F(ColumnNames, Row),
 	    foreach_s(F, Statement)
     end.
@@ -100,14 +210,14 @@ foreach_s(F, Statement) when is_function(F, 2) ->
 map_s(F, Statement) when is_function(F, 1) ->
     case try_step(Statement, 0) of
 	'$done' -> [];
-	Row when is_tuple(Row) ->
+	Row when is_tuple(Row); is_map(Row); is_binary(Row) ->
 	    [F(Row) | map_s(F, Statement)]
     end;
 map_s(F, Statement) when is_function(F, 2) ->
     ColumnNames = column_names(Statement),
     case try_step(Statement, 0) of
 	'$done' -> [];
-	Row when is_tuple(Row) ->
+	Row when is_tuple(Row); is_map(Row); is_binary(Row) ->
 	    [F(ColumnNames, Row) | map_s(F, Statement)]
     end.
 
@@ -115,17 +225,131 @@ map_s(F, Statement) when is_function(F, 2) ->
 fetchone(Statement) ->
     case try_step(Statement, 0) of
 	'$done' -> ok;
-	Row when is_tuple(Row) ->
+	Row when is_tuple(Row); is_map(Row); is_binary(Row) ->
 	    Row
     end.
 
-%%
+%% Statements with an encoding are fetched in one chunk, their rows are
+%% one binary. Statements which read ahead are stepped through.
 fetchall(Statement) ->
+    fetchall(Statement, ?DEFAULT_TIMEOUT).
+
+%% Timeout is the time allowed for each chunk.
+fetchall(Statement, Timeout) ->
+    case try_fetch(Statement, ?FETCH_CHUNK_SIZE, Timeout, 0) of
+	{'$done', Rows} ->
+	    Rows;
+	{rows, Rows} when is_binary(Rows) ->
+	    throw({error, busy});
+	{rows, Rows} ->
+	    Rows ++ fetchall(Statement, Timeout);
+	read_ahead ->
+	    step_all(Statement)
+    end.
+
+step_all(Statement) ->
     case try_step(Statement, 0) of
-	'$done' ->
-	    [];
-	Row when is_tuple(Row) ->
-	    [Row | fetchall(Statement)]
+	'$done' -> [];
+	{done, _, _} -> [];
+	{error, _}=Error -> throw(Error);
+	Row -> [Row | step_all(Statement)]
+    end.
+
+%% Try the fetch, when the database is busy before any row was fetched
+try_fetch(_Statement, _N, _Timeout, Tries) when Tries > 5 ->
+    throw(too_many_tries);
+try_fetch(Statement, N, Timeout, Tries) ->
+    case fetch_chunk(Statement, N, Timeout) of
+	{'$busy', Rows} ->
+	    case no_rows(Rows) of
+		true ->
+		    timer:sleep(100 * Tries),
+		    try_fetch(Statement, N, Timeout, Tries + 1);
+		false ->
+		    {rows, Rows}
+	    end;
+	{error, read_ahead_statement} ->
+	    read_ahead;
+	{error, _}=Error ->
+	    throw(Error);
+	Something ->
+	    Something
+    end.
+
+%% The rows of an empty fetch, for every encoding
+no_rows([]) -> true;
+no_rows(<<131, 106>>) -> true; % term_to_binary([])
+no_rows(<<"[]">>) -> true;
+no_rows(_) -> false.
+
+%% @doc Fetch all rows of the statement into a result set. The rows
+%% are kept in native memory, terms are only made for the rows and
+%% columns which are accessed with nth/2, slice/3 and column/2.
+%%
+%% @spec result_set(prepared_statement()) -> {ok, result_set()} | '$busy' | {error, error_message()}
+result_set(Stmt) ->
+    result_set(Stmt, ?DEFAULT_TIMEOUT).
+
+%% @doc Fetch all rows of the statement into a result set.
+%%
+%% @spec result_set(prepared_statement(), timeout()) -> {ok, result_set()} | '$busy' | {error, error_message()}
+result_set(Stmt, Timeout) ->
+    Ref = make_ref(),
+    case esqlite3_nif:result_set(Stmt, Ref, self()) of
+	ok ->
+	    receive_answer(Ref, Timeout);
+	{error, _}=Error ->
+	    Error
+    end.
+
+%% @doc Return the N-th row of the result set.
+%%
+%% @spec nth(pos_integer(), result_set()) -> tuple()
+nth(N, ResultSet) ->
+    esqlite3_nif:nth(N, ResultSet).
+
+%% @doc Return at most Len rows of the result set, starting at row Start.
+%%
+%% @spec slice(pos_integer(), non_neg_integer(), result_set()) -> [tuple()]
+slice(Start, Len, ResultSet) ->
+    esqlite3_nif:slice(Start, Len, ResultSet).
+
+%% @doc Return the values of the N-th column of the result set.
+%%
+%% @spec column(pos_integer(), result_set()) -> list()
+column(N, ResultSet) ->
+    esqlite3_nif:column(N, ResultSet).
+
+%% @doc Return the number of rows in the result set.
+%%
+%% @spec count(result_set()) -> non_neg_integer()
+count(ResultSet) ->
+    esqlite3_nif:count(ResultSet).
+
+%% @doc Fetch all rows of the statement column by column.
+%%
+%% Integer and float columns are returned as {integer | float, Values, Nulls},
+%% where Values holds a native endian 64 bit value per row. Text and blob
+%% columns are returned as {text | blob, Data, Offsets, Nulls}, where Offsets
+%% holds a native endian unsigned 64 bit offset into Data for each row,
+%% plus the end offset. Bit N of Nulls (least significant bit first) is set
+%% when row N is NULL. Columns mixing numbers with text or blobs, or
+%% text with blobs, are returned as {mixed, [Value]}.
+%%
+%% @spec columnar(prepared_statement()) -> {ok, integer(), [column()]} | '$busy' | {error, error_message()}
+columnar(Stmt) ->
+    columnar(Stmt, ?DEFAULT_TIMEOUT).
+
+%% @doc Fetch all rows of the statement column by column.
+%%
+%% @spec columnar(prepared_statement(), timeout()) -> {ok, integer(), [column()]} | '$busy' | {error, error_message()}
+columnar(Stmt, Timeout) ->
+    Ref = make_ref(),
+    case esqlite3_nif:columnar(Stmt, Ref, self()) of
+	ok ->
+	    receive_answer(Ref, Timeout);
+	{error, _}=Error ->
+	    Error
     end.
 
 %% Try the step, when the database is busy,
@@ -146,12 +370,48 @@ try_step(Statement, Tries) ->
 exec(Sql, Connection) ->
     exec(Sql, Connection, ?DEFAULT_TIMEOUT).
 
-%% @doc Execute
+%% @doc Execute with options, or with a timeout.
+%%
+%% With option {done, info} the result is {done, Changes, LastRowid}
+%% instead of ok. Both are taken on the connection thread right after
+%% the statement, no other statement can get in between.
 %%
-%% @spec exec(iolist(), connection(), timeout()) -> integer() | {error, error_message()}
+%% @spec exec(iolist(), connection(), list() | timeout()) -> ok | {done, integer(), integer()} | {error, error_message()}
+exec(Sql, Connection, Options) when is_list(Options) ->
+    exec(Sql, Connection, Options, ?DEFAULT_TIMEOUT);
 exec(Sql, Connection, Timeout) ->
+    exec(Sql, Connection, [], Timeout).
+
+%% @doc
+%%
+%% @spec exec(iolist(), connection(), list(), timeout()) -> ok | {done, integer(), integer()} | {error, error_message()}
+exec(Sql, Connection, [], Timeout) ->
     Ref = make_ref(),
     ok = esqlite3_nif:exec(Connection, Ref, self(), add_eos(Sql)),
+    receive_answer(Ref, Timeout);
+exec(Sql, Connection, Options, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:exec(Connection, Ref, self(), {add_eos(Sql), Options}),
+    receive_answer(Ref, Timeout).
+
+%% @doc Execute every statement of a script, returns a result per statement.
+%%
+%% Queries give a list with tuples. Inserts, updates and deletes give
+%% {changes, N}, the rows they changed themselves, not counting the rows
+%% changed by triggers or foreign key actions. Other statements give ok.
+%% The script stops at the first statement which fails, its result is
+%% {error, error_message()}.
+%%
+%% @spec exec_script(iolist(), connection()) -> list()
+exec_script(Sql, Connection) ->
+    exec_script(Sql, Connection, ?DEFAULT_TIMEOUT).
+
+%% @doc Execute every statement of a script, returns a result per statement.
+%%
+%% @spec exec_script(iolist(), connection(), timeout()) -> list()
+exec_script(Sql, Connection, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:exec_script(Connection, Ref, self(), Sql),
     receive_answer(Ref, Timeout).
 
 %% @doc Prepare a statement
@@ -160,12 +420,45 @@ exec(Sql, Connection, Timeout) ->
 prepare(Sql, Connection) ->
     prepare(Sql, Connection, ?DEFAULT_TIMEOUT).
 
-%% @doc
+%% @doc Prepare a statement with options, or with a timeout.
 %%
-%% @spec(iolist(), connection(), timeout()) -> {ok, prepared_statement()} | {error, error_message()}
+%% Options are {row, tuple}, the default, {row, map} and
+%% {row, {map, Atoms}}. Map rows are keyed by the column names as
+%% binaries, columns named after one of Atoms get the atom as key.
+%% With {encoding, etf} step/1 and fetch/2 give the rows as a binary
+%% in external term format, which is cheap to pass on to other
+%% processes. Decode it with binary_to_term/1.
+%% With {encoding, json} the rows are written as json without making
+%% terms, objects for map rows and arrays for tuple rows. fetch/2 gives
+%% a json array of rows. Blobs become base64 strings.
+%% With {text, binary} text cells are binaries instead of strings. In
+%% the rows of one fetch/2 a repeated text is one copy of its bytes,
+%% which suits columns with few distinct values. The cells are sub
+%% binaries which keep the bytes of the whole fetch alive.
+%% With {read_ahead, K} the connection thread reads up to K rows ahead
+%% after a step, later steps take them without waiting for the thread.
+%% Binding drops the rows read ahead. fetch/2, result_set/1 and
+%% columnar/1 return {error, read_ahead_statement} for such statements,
+%% fetchall/1 and q/2 step through them.
+%% With {done, info} step/1 gives {done, Changes, LastRowid} instead of
+%% '$done' when the statement is done.
+%%
+%% @spec prepare(iolist(), connection(), list() | timeout()) -> {ok, prepared_statement()} | {error, error_message()}
+prepare(Sql, Connection, Options) when is_list(Options) ->
+    prepare(Sql, Connection, Options, ?DEFAULT_TIMEOUT);
 prepare(Sql, Connection, Timeout) ->
+    prepare(Sql, Connection, [], Timeout).
+
+%% @doc
+%%
+%% @spec prepare(iolist(), connection(), list(), timeout()) -> {ok, prepared_statement()} | {error, error_message()}
+prepare(Sql, Connection, [], Timeout) ->
     Ref = make_ref(),
     ok = esqlite3_nif:prepare(Connection, Ref, self(), add_eos(Sql)),
+    receive_answer(Ref, Timeout);
+prepare(Sql, Connection, Options, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:prepare(Connection, Ref, self(), {add_eos(Sql), Options}),
     receive_answer(Ref, Timeout).
 
 %% @doc Step
@@ -179,9 +472,418 @@ step(Stmt) ->
 %% @spec step(prepared_statement(), timeout()) -> tuple()
 step(Stmt, Timeout) ->
     Ref = make_ref(),
-    ok = esqlite3_nif:step(Stmt, Ref, self()),
+    case esqlite3_nif:step(Stmt, Ref, self()) of
+	ok ->
+	    receive_answer(Ref, Timeout);
+	{answer, Answer} ->
+	    Answer
+    end.
+
+%% @doc Fetch at most N rows in one go.
+%%
+%% Returns {rows, Rows} when the statement may have more rows,
+%% {'$done', Rows} when the statement is done and {'$busy', Rows}
+%% when the database was busy after fetching Rows.
+%%
+%% @spec fetch(prepared_statement(), pos_integer()) -> {rows | '$done' | '$busy', [tuple()]} | {error, error_message()}
+fetch(Stmt, N) ->
+    fetch(Stmt, N, ?DEFAULT_TIMEOUT).
+
+%% @doc Fetch at most N rows in one go.
+%%
+%% @spec fetch(prepared_statement(), pos_integer(), timeout()) -> {rows | '$done' | '$busy', [tuple()]} | {error, error_message()}
+fetch(Stmt, N, Timeout) ->
+    Ref = make_ref(),
+    case esqlite3_nif:fetch(Stmt, Ref, self(), N) of
+	ok ->
+	    receive_answer(Ref, Timeout);
+	{error, _}=Error ->
+	    Error
+    end.
+
+fetch_chunk(Stmt, N, Timeout) ->
+    Ref = make_ref(),
+    case esqlite3_nif:fetch(Stmt, Ref, self(), {chunk, N}) of
+	ok ->
+	    receive_answer(Ref, Timeout);
+	{error, _}=Error ->
+	    Error
+    end.
+
+%% @doc Run a lookup for many parameter lists in one go.
+%%
+%% For every list of parameters the statement is bound, stepped until
+%% done and reset on the connection thread. Returns the rows of every
+%% lookup, in the order of ParamsList.
+%%
+%% @spec multi_get(prepared_statement(), [value_list()]) -> [[tuple()]] | '$busy' | {error, error_message()}
+multi_get(Stmt, ParamsList) ->
+    multi_get(Stmt, ParamsList, ?DEFAULT_TIMEOUT).
+
+%% @doc Run a lookup for many parameter lists in one go.
+%%
+%% @spec multi_get(prepared_statement(), [value_list()], timeout()) -> [[tuple()]] | '$busy' | {error, error_message()}
+multi_get(Stmt, ParamsList, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:multi_get(Stmt, Ref, self(), ParamsList),
+    receive_answer(Ref, Timeout).
+
+%% @doc Open a key value store over Table.
+%%
+%% The table is created when it does not exist, with a blob key as
+%% primary key and a blob value. The statements of the store stay
+%% prepared on the connection, binary keys and values are bound without
+%% copying.
+%%
+%% @spec kv_open(iolist(), connection()) -> {ok, kv()} | {error, error_message()}
+kv_open(Table, Connection) ->
+    kv_open(Table, Connection, ?DEFAULT_TIMEOUT).
+
+%% @doc Open a key value store over Table, with options or a timeout.
+%%
+%% With the option {bloom, ExpectedKeys} the store keeps a bloom filter
+%% of its binary keys, built when the store is opened. Lookups of absent
+%% keys are answered from the filter, without a query and mostly
+%% without a trip to the connection thread. Writes to the table on the
+%% connection which do not go through the store are added to the filter
+%% by the next operation on the store.
+%%
+%% The filter only sees the writes made through this connection. A row
+%% written by another connection or process would be reported as
+%% not_found, so the filter is refused for databases in files, unless
+%% the option single_writer is given as well to say that no other
+%% connection writes to the table.
+%%
+%% @spec kv_open(iolist(), connection(), list() | timeout()) -> {ok, kv()} | {error, error_message()}
+kv_open(Table, Connection, Options) when is_list(Options) ->
+    kv_open(Table, Connection, Options, ?DEFAULT_TIMEOUT);
+kv_open(Table, Connection, Timeout) ->
+    kv_open(Table, Connection, [], Timeout).
+
+%% @doc Open a key value store over Table.
+%%
+%% @spec kv_open(iolist(), connection(), list(), timeout()) -> {ok, kv()} | {error, error_message()}
+kv_open(Table, Connection, [], Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:kv_open(Connection, Ref, self(), Table),
+    receive_answer(Ref, Timeout);
+kv_open(Table, Connection, Options, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:kv_open(Connection, Ref, self(), {Table, Options}),
     receive_answer(Ref, Timeout).
 
+%% @doc Get the value of Key.
+%%
+%% @spec kv_get(kv(), term()) -> {ok, term()} | not_found | {error, error_message()}
+kv_get(Kv, Key) ->
+    kv_get(Kv, Key, ?DEFAULT_TIMEOUT).
+
+%% @doc Get the value of Key.
+%%
+%% @spec kv_get(kv(), term(), timeout()) -> {ok, term()} | not_found | {error, error_message()}
+kv_get(Kv, Key, Timeout) ->
+    kv(Kv, {get, Key}, Timeout).
+
+%% @doc Insert or replace the value of Key.
+%%
+%% @spec kv_put(kv(), term(), term()) -> ok | {error, error_message()}
+kv_put(Kv, Key, Value) ->
+    kv_put(Kv, Key, Value, ?DEFAULT_TIMEOUT).
+
+%% @doc Insert or replace the value of Key.
+%%
+%% @spec kv_put(kv(), term(), term(), timeout()) -> ok | {error, error_message()}
+kv_put(Kv, Key, Value, Timeout) ->
+    kv(Kv, {put, Key, Value}, Timeout).
+
+%% @doc Delete Key.
+%%
+%% @spec kv_delete(kv(), term()) -> ok | {error, error_message()}
+kv_delete(Kv, Key) ->
+    kv_delete(Kv, Key, ?DEFAULT_TIMEOUT).
+
+%% @doc Delete Key.
+%%
+%% @spec kv_delete(kv(), term(), timeout()) -> ok | {error, error_message()}
+kv_delete(Kv, Key, Timeout) ->
+    kv(Kv, {delete, Key}, Timeout).
+
+%% @doc Get the values of Keys in one go, in order.
+%%
+%% @spec kv_multi_get(kv(), [term()]) -> [{ok, term()} | not_found | {error, error_message()}]
+kv_multi_get(Kv, Keys) ->
+    kv_multi_get(Kv, Keys, ?DEFAULT_TIMEOUT).
+
+%% @doc Get the values of Keys in one go, in order.
+%%
+%% @spec kv_multi_get(kv(), [term()], timeout()) -> [{ok, term()} | not_found | {error, error_message()}]
+kv_multi_get(Kv, Keys, Timeout) ->
+    kv(Kv, {multi_get, Keys}, Timeout).
+
+%% @doc Get at most Limit key value pairs with From =< Key < To, ordered by key.
+%%
+%% @spec kv_range(kv(), term(), term(), integer()) -> [{term(), term()}] | {error, error_message()}
+kv_range(Kv, From, To, Limit) ->
+    kv_range(Kv, From, To, Limit, ?DEFAULT_TIMEOUT).
+
+%% @doc Get at most Limit key value pairs with From =< Key < To, ordered by key.
+%%
+%% @spec kv_range(kv(), term(), term(), integer(), timeout()) -> [{term(), term()}] | {error, error_message()}
+kv_range(Kv, From, To, Limit, Timeout) ->
+    kv(Kv, {range, From, To, Limit}, Timeout).
+
+kv(Kv, Operation, Timeout) ->
+    Ref = make_ref(),
+    case esqlite3_nif:kv(Kv, Ref, self(), Operation) of
+	ok ->
+	    receive_answer(Ref, Timeout);
+	{answer, Answer} ->
+	    Answer
+    end.
+
+%% @doc Run a list of operations in one go.
+%%
+%% The operations run one after the other on the connection thread,
+%% without other commands in between:
+%%
+%%   {exec, Sql}            gives ok
+%%   {exec, Sql, Params}    gives ok
+%%   {query, Sql, Params}   gives the rows
+%%
+%% A parameter {'$ref', N} is the value of the N-th operation, the last
+%% insert rowid after an exec and the first cell of a query. The
+%% parameter '$last_insert_rowid' is the last insert rowid of the
+%% connection. Stops at the first failing operation.
+%%
+%% Sql of {exec, Sql, Params} and {query, Sql, Params} must be a single
+%% statement, more gives {error, N, multiple_statements}. {exec, Sql}
+%% runs all statements of Sql.
+%%
+%% A pipeline is not a transaction. The operations are not interrupted
+%% by other commands, but the changes of the operations before a failing
+%% one are not undone. Use transaction/2 to run the operations
+%% atomically.
+%%
+%% @spec pipeline([tuple()], connection()) -> {ok, list()} | {error, pos_integer(), term()}
+pipeline(Operations, Connection) ->
+    pipeline(Operations, Connection, ?DEFAULT_TIMEOUT).
+
+%% @doc Run a list of operations in one go.
+%%
+%% @spec pipeline([tuple()], connection(), timeout()) -> {ok, list()} | {error, pos_integer(), term()}
+pipeline(Operations, Connection, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:pipeline(Connection, Ref, self(), [add_op_eos(Op) || Op <- Operations]),
+    receive_answer(Ref, Timeout).
+
+%% @doc Run a list of operations in a transaction, in one go.
+%%
+%% Runs begin, the operations of pipeline/2 and commit on the connection
+%% thread, no other command can get in between. When an operation fails
+%% the transaction is rolled back. An operation wrapped as
+%% {savepoint, Op} runs in a savepoint, when it fails only its own
+%% changes are undone, its result is {error, Reason} and the
+%% transaction goes on.
+%%
+%% @spec transaction([tuple()], connection()) -> {ok, list()} | {error, pos_integer(), term()} | {error, error_message()}
+transaction(Operations, Connection) ->
+    transaction(Operations, Connection, ?DEFAULT_TIMEOUT).
+
+%% @doc Run a list of operations in a transaction, in one go.
+%%
+%% @spec transaction([tuple()], connection(), timeout()) -> {ok, list()} | {error, pos_integer(), term()} | {error, error_message()}
+transaction(Operations, Connection, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:transaction(Connection, Ref, self(), [add_op_eos(Op) || Op <- Operations]),
+    receive_answer(Ref, Timeout).
+
+%% @doc Subscribe to the changes committed on the connection.
+%%
+%% After every commit with changes the calling process receives a
+%% message {esqlite3_changes, Subscription, Changes}. Changes is a list
+%% of {insert | update | delete, Database, Table, Rowid} in the order the
+%% rows were changed, Database is main, temp or the name of an attached
+%% database. The message is sent before the answer of the command which
+%% committed the changes. After a restore with backup/3 the message is
+%% {esqlite3_restored, Subscription}, the changes of a restore are not
+%% known. A transaction with more than 65536 changes gives
+%% {esqlite3_overflow, Subscription} instead of the changes.
+%%
+%% Only changes which are committed are reported. Changes are dropped
+%% when the transaction is rolled back, when a statement fails inside
+%% a transaction and its changes are undone, when a {savepoint, Op} of
+%% transaction/2 fails, and on a rollback to a savepoint. Savepoints are
+%% followed from the statements run through the connection, a rollback
+%% to a savepoint opened before the subscription does not drop the
+%% changes. A statement which fails with the fail conflict resolution
+%% keeps its changes made before the failure, they are not reported.
+%%
+%% @spec subscribe(connection()) -> {ok, reference()} | {error, error_message()}
+subscribe(Connection) ->
+    subscribe(Connection, ?DEFAULT_TIMEOUT).
+
+%% @doc Subscribe to the changes committed on the connection.
+%%
+%% @spec subscribe(connection(), timeout()) -> {ok, reference()} | {error, error_message()}
+subscribe(Connection, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:subscribe(Connection, Ref, self()),
+    case receive_answer(Ref, Timeout) of
+	ok -> {ok, Ref};
+	Error -> Error
+    end.
+
+%% @doc Stop a subscription.
+%%
+%% @spec unsubscribe(reference(), connection()) -> ok | {error, error_message()}
+unsubscribe(Subscription, Connection) ->
+    unsubscribe(Subscription, Connection, ?DEFAULT_TIMEOUT).
+
+%% @doc Stop a subscription.
+%%
+%% @spec unsubscribe(reference(), connection(), timeout()) -> ok | {error, error_message()}
+unsubscribe(Subscription, Connection, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:unsubscribe(Connection, Ref, self(), Subscription),
+    receive_answer(Ref, Timeout).
+
+%% @doc Open the blob in Column of row Rowid of Table, for reading.
+%%
+%% Large blobs can be read and written in chunks, without having the
+%% whole value in memory at once.
+%%
+%% @spec blob_open(iolist(), iolist(), integer(), connection()) -> {ok, blob()} | {error, error_message()}
+blob_open(Table, Column, Rowid, Connection) ->
+    blob_open(Table, Column, Rowid, Connection, ?DEFAULT_TIMEOUT).
+
+%% @doc Open a blob with options, or with a timeout.
+%%
+%% With option {mode, write} the blob can be written as well. Writes
+%% can not change the size of a blob, make room first with zeroblob(N).
+%%
+%% @spec blob_open(iolist(), iolist(), integer(), connection(), list() | timeout()) -> {ok, blob()} | {error, error_message()}
+blob_open(Table, Column, Rowid, Connection, Options) when is_list(Options) ->
+    blob_open(Table, Column, Rowid, Connection, Options, ?DEFAULT_TIMEOUT);
+blob_open(Table, Column, Rowid, Connection, Timeout) ->
+    blob_open(Table, Column, Rowid, Connection, [], Timeout).
+
+%% @doc Open a blob.
+%%
+%% @spec blob_open(iolist(), iolist(), integer(), connection(), list(), timeout()) -> {ok, blob()} | {error, error_message()}
+blob_open(Table, Column, Rowid, Connection, Options, Timeout) ->
+    Mode = proplists:get_value(mode, Options, read),
+    Ref = make_ref(),
+    ok = esqlite3_nif:blob_open(Connection, Ref, self(), {Table, Column, Rowid, Mode}),
+    receive_answer(Ref, Timeout).
+
+%% @doc The size of a blob in bytes.
+%%
+%% @spec blob_size(blob()) -> integer() | {error, error_message()}
+blob_size(Blob) ->
+    blob_size(Blob, ?DEFAULT_TIMEOUT).
+
+%% @doc The size of a blob in bytes.
+%%
+%% @spec blob_size(blob(), timeout()) -> integer() | {error, error_message()}
+blob_size(Blob, Timeout) ->
+    blob(Blob, size, Timeout).
+
+%% @doc Read at most Size bytes from Offset, eof when Offset is at the end.
+%%
+%% @spec blob_read(blob(), integer(), integer()) -> {ok, binary()} | eof | {error, error_message()}
+blob_read(Blob, Offset, Size) ->
+    blob_read(Blob, Offset, Size, ?DEFAULT_TIMEOUT).
+
+%% @doc Read at most Size bytes from Offset.
+%%
+%% @spec blob_read(blob(), integer(), integer(), timeout()) -> {ok, binary()} | eof | {error, error_message()}
+blob_read(Blob, Offset, Size, Timeout) ->
+    blob(Blob, {read, Offset, Size}, Timeout).
+
+%% @doc Write Data at Offset.
+%%
+%% @spec blob_write(blob(), integer(), iolist()) -> ok | {error, error_message()}
+blob_write(Blob, Offset, Data) ->
+    blob_write(Blob, Offset, Data, ?DEFAULT_TIMEOUT).
+
+%% @doc Write Data at Offset.
+%%
+%% @spec blob_write(blob(), integer(), iolist(), timeout()) -> ok | {error, error_message()}
+blob_write(Blob, Offset, Data, Timeout) ->
+    blob(Blob, {write, Offset, Data}, Timeout).
+
+%% @doc Move the blob to the same column of row Rowid.
+%%
+%% @spec blob_reopen(blob(), integer()) -> ok | {error, error_message()}
+blob_reopen(Blob, Rowid) ->
+    blob_reopen(Blob, Rowid, ?DEFAULT_TIMEOUT).
+
+%% @doc Move the blob to the same column of row Rowid.
+%%
+%% @spec blob_reopen(blob(), integer(), timeout()) -> ok | {error, error_message()}
+blob_reopen(Blob, Rowid, Timeout) ->
+    blob(Blob, {reopen, Rowid}, Timeout).
+
+%% @doc Close the blob. It is closed as well when it is garbage collected.
+%%
+%% @spec blob_close(blob()) -> ok | {error, error_message()}
+blob_close(Blob) ->
+    blob_close(Blob, ?DEFAULT_TIMEOUT).
+
+%% @doc Close the blob.
+%%
+%% @spec blob_close(blob(), timeout()) -> ok | {error, error_message()}
+blob_close(Blob, Timeout) ->
+    blob(Blob, close, Timeout).
+
+blob(Blob, Operation, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:blob(Blob, Ref, self(), Operation),
+    receive_answer(Ref, Timeout).
+
+%% @doc Backup the database to the file DestFile.
+%%
+%% @spec backup(string(), connection()) -> ok | {error, error_message()}
+backup(DestFile, Connection) ->
+    backup(DestFile, Connection, [], ?DEFAULT_TIMEOUT).
+
+%% @doc Backup the database with options, or with a timeout.
+%%
+%% The database is copied {pages, N} pages at a time, 100 by default,
+%% or all at once when N is -1. Commands queued on the connection run
+%% in between, changes made through the connection are copied as well.
+%% When the file is locked a step is tried again after the queued
+%% commands, the backup gives up with {error, busy} when the file stays
+%% locked for half a second.
+%% With {progress, Pid} the process Pid receives a message
+%% {esqlite3_backup, reference(), Remaining, PageCount} after every step.
+%% With restore the file is copied into the database instead, in one
+%% step, and with write_back as well it is copied back on close. The
+%% cached queries and kv filters of the connection start over after a
+%% restore, and subscribers receive {esqlite3_restored, Subscription}
+%% instead of the changes.
+%%
+%% @spec backup(string(), connection(), list() | timeout()) -> ok | {error, error_message()}
+backup(DestFile, Connection, Options) when is_list(Options) ->
+    backup(DestFile, Connection, Options, ?DEFAULT_TIMEOUT);
+backup(DestFile, Connection, Timeout) ->
+    backup(DestFile, Connection, [], Timeout).
+
+%% @doc Backup the database.
+%%
+%% @spec backup(string(), connection(), list(), timeout()) -> ok | {error, error_message()}
+backup(DestFile, Connection, Options, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:backup(Connection, Ref, self(), {DestFile, Options}),
+    receive_answer(Ref, Timeout).
+
+add_op_eos({savepoint, Op}) ->
+    {savepoint, add_op_eos(Op)};
+add_op_eos(Op) when is_tuple(Op), tuple_size(Op) >= 2 ->
+    setelement(2, Op, add_eos(element(2, Op)));
+add_op_eos(Op) ->
+    Op.
+
 %% @doc Bind values to prepared statements
 %%
 %% @spec bind(prepared_statement(), value_list()) -> ok | {error, error_message()}
@@ -206,6 +908,20 @@ column_names(Stmt, Timeout) ->
     ok = esqlite3_nif:column_names(Stmt, Ref, self()),
     receive_answer(Ref, Timeout).
 
+%% @doc Finalize the prepared statement, releasing its resources.
+%%
+%% @spec finalize(prepared_statement()) -> ok | {error, error_message()}
+finalize(Stmt) ->
+    finalize(Stmt, ?DEFAULT_TIMEOUT).
+
+%% @doc Finalize the prepared statement, releasing its resources.
+%%
+%% @spec finalize(prepared_statement(), timeout()) -> ok | {error, error_message()}
+finalize(Stmt, Timeout) ->
+    Ref = make_ref(),
+    ok = esqlite3_nif:finalize(Stmt, Ref, self()),
+    receive_answer(Ref, Timeout).
+
 %% @doc Close the database
 %%
 %% @spec close(connection()) -> ok | {error, error_message()}
@@ -227,9 +943,7 @@ add_eos(IoList) ->
 receive_answer(Ref, Timeout) ->
     receive
 	{Ref, Resp} ->
-	    Resp;
-	Other ->
-	    throw(Other)
+	    Resp
     after Timeout ->
 	    throw({error, timeout, Ref})
     end.
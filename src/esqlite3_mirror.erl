@@ -0,0 +1,235 @@
+%% @author Maas-Maarten Zeeman <mmzeeman@xs4all.nl>
+%% @copyright 2011 Maas-Maarten Zeeman
+
+%% @doc Mirror of a sqlite3 table in ets, kept in sync with the
+%% changes committed on the connection.
+%%
+%% The rows of the table are loaded into an ets table when the mirror
+%% starts. After that every commit which changes the table is applied to
+%% the ets table. Reads are plain ets lookups, they do not go through
+%% the connection thread. The sqlite3 table stays the source of truth,
+%% writes go through the connection as usual.
+%%
+%% Only changes made through the connection are seen, and rows are
+%% updated after the commit, so a reader can see a row a moment before
+%% the mirror catches up. Use sync/1 to wait for the commits made so
+%% far.
+
+%% Copyright 2011 Maas-Maarten Zeeman
+%%
+%% Licensed under the Apache License, Version 2.0 (the "License");
+%% you may not use this file except in compliance with the License.
+%% You may obtain a copy of the License at
+%%
+%%     http://www.apache.org/licenses/LICENSE-2.0
+%%
+%% Unless required by applicable law or agreed to in writing, software
+%% distributed under the License is distributed on an "AS IS" BASIS,
+%% WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+%% See the License for the specific language governing permissions and
+%% limitations under the License.
+
+-module(esqlite3_mirror).
+-author("Maas-Maarten Zeeman <mmzeeman@xs4all.nl>").
+
+-behaviour(gen_server).
+
+-export([start_link/2, start_link/3,
+	 table/1,
+	 lookup/2,
+	 sync/1,
+	 stop/1]).
+
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2,
+	 terminate/2, code_change/3]).
+
+-record(state, {connection, table, ets, subscription, select, keys}).
+
+%% @doc Start a mirror of Table.
+%%
+%% Table is looked up the way sqlite3 does, the case of the name does
+%% not matter and it can be qualified with a database, as in main.t.
+%%
+%% @spec start_link(iodata(), connection()) -> {ok, pid()} | {error, term()}
+start_link(Table, Connection) ->
+    start_link(Table, [], Connection).
+
+%% @doc Start a mirror of Table with options.
+%%
+%% The rows are stored in ets as tuples of the columns of the table.
+%% Options are {key, N}, the column which is the key in ets, the first
+%% by default, and {name, Name} for a named ets table. The ets table is
+%% protected and owned by the mirror.
+%%
+%% @spec start_link(iodata(), list(), connection()) -> {ok, pid()} | {error, term()}
+start_link(Table, Options, Connection) ->
+    case resolve(iolist_to_binary(Table), Connection) of
+	{ok, Resolved} ->
+	    gen_server:start_link(?MODULE, {Resolved, Options, Connection}, []);
+	{error, _}=Error ->
+	    Error
+    end.
+
+%% @doc The ets table of the mirror.
+%%
+%% @spec table(pid()) -> ets:tid() | atom()
+table(Mirror) ->
+    gen_server:call(Mirror, table).
+
+%% @doc Lookup the rows with Key in the ets table of a mirror.
+%%
+%% @spec lookup(term(), ets:tid() | atom()) -> [tuple()]
+lookup(Key, Ets) ->
+    ets:lookup(Ets, Key).
+
+%% @doc Wait until the mirror has applied the commits which were done
+%% on the connection before the call.
+%%
+%% @spec sync(pid()) -> ok
+sync(Mirror) ->
+    gen_server:call(Mirror, sync).
+
+%% @doc Stop the mirror, the ets table is deleted.
+%%
+%% @spec stop(pid()) -> ok
+stop(Mirror) ->
+    gen_server:call(Mirror, stop).
+
+%%
+%% gen_server callbacks
+%%
+
+init({{Database, Name}=Table, Options, Connection}) ->
+    KeyPos = proplists:get_value(key, Options, 1),
+    EtsOptions = case proplists:get_value(name, Options) of
+		     undefined -> [];
+		     _Name -> [named_table]
+		 end,
+    Ets = ets:new(proplists:get_value(name, Options, ?MODULE),
+		  [set, protected, {keypos, KeyPos}, {read_concurrency, true} | EtsOptions]),
+
+    %% subscribe before loading, changes committed in between are
+    %% applied again after the load
+    {ok, Subscription} = esqlite3:subscribe(Connection),
+    Quoted = [quote(Database), $., quote(Name)],
+    {ok, Select} = esqlite3:prepare(["select rowid, * from ", Quoted, " where rowid = ?"], Connection),
+    State = #state{connection=Connection, table=Table, ets=Ets,
+		   subscription=Subscription, select=Select, keys=#{}},
+    {ok, load(State)}.
+
+handle_call(table, _From, #state{ets=Ets}=State) ->
+    {reply, Ets, State};
+handle_call(sync, _From, State) ->
+    {reply, ok, State};
+handle_call(stop, _From, State) ->
+    {stop, normal, ok, State}.
+
+handle_cast(_Msg, State) ->
+    {noreply, State}.
+
+handle_info({esqlite3_changes, Subscription, Changes}, #state{subscription=Subscription}=State) ->
+    {noreply, apply_changes(Changes, State)};
+handle_info({esqlite3_restored, Subscription}, #state{subscription=Subscription}=State) ->
+    {noreply, load(State)};
+handle_info({esqlite3_overflow, Subscription}, #state{subscription=Subscription}=State) ->
+    {noreply, load(State)};
+handle_info(_Info, State) ->
+    {noreply, State}.
+
+terminate(_Reason, #state{connection=Connection, subscription=Subscription}) ->
+    catch esqlite3:unsubscribe(Subscription, Connection),
+    ok.
+
+code_change(_OldVsn, State, _Extra) ->
+    {ok, State}.
+
+%%
+%% Helpers
+%%
+
+%% (Re)load all rows of the table.
+load(#state{connection=Connection, table={Database, Name}, ets=Ets}=State) ->
+    ets:delete_all_objects(Ets),
+    Rows = esqlite3:q(["select rowid, * from ", quote(Database), $., quote(Name)], Connection),
+    store(Rows, State#state{keys=#{}}).
+
+%% Apply the changes of a commit. The rows which were inserted or
+%% updated are read again in one go, the last change of a row counts.
+apply_changes(Changes, #state{table={Database, Name}}=State) ->
+    Last = lists:foldl(fun({Op, D, T, Rowid}, Acc) when D =:= Database, T =:= Name ->
+			       maps:put(Rowid, Op, Acc);
+			  (_, Acc) -> Acc
+		       end, #{}, Changes),
+    {Deleted, Changed} = lists:partition(fun({_Rowid, Op}) -> Op =:= delete end, maps:to_list(Last)),
+    State1 = lists:foldl(fun({Rowid, delete}, S) -> remove(Rowid, S) end, State, Deleted),
+    case Changed of
+	[] ->
+	    State1;
+	_ ->
+	    Results = esqlite3:multi_get(State1#state.select, [[Rowid] || {Rowid, _} <- Changed]),
+	    lists:foldl(fun({{Rowid, _}, []}, S) -> remove(Rowid, S);
+			   ({_, Rows}, S) -> store(Rows, S)
+			end, State1, lists:zip(Changed, Results))
+    end.
+
+store(Rows, #state{ets=Ets, keys=Keys}=State) ->
+    KeyPos = ets:info(Ets, keypos),
+    Keys1 = lists:foldl(fun(Row, Acc) ->
+				Rowid = element(1, Row),
+				Object = erlang:delete_element(1, Row),
+				Key = element(KeyPos, Object),
+				case maps:find(Rowid, Acc) of
+				    {ok, Key} -> ok;
+				    {ok, OldKey} -> ets:delete(Ets, OldKey);
+				    error -> ok
+				end,
+				ets:insert(Ets, Object),
+				maps:put(Rowid, Key, Acc)
+			end, Keys, Rows),
+    State#state{keys=Keys1}.
+
+remove(Rowid, #state{ets=Ets, keys=Keys}=State) ->
+    case maps:find(Rowid, Keys) of
+	{ok, Key} ->
+	    ets:delete(Ets, Key),
+	    State#state{keys=maps:remove(Rowid, Keys)};
+	error ->
+	    State
+    end.
+
+%% Find the database and the name of the table as sqlite3 has them, which
+%% is how the changes name it. An unqualified name is looked up in temp,
+%% main and then the attached databases.
+resolve(Table, Connection) ->
+    Databases = [list_to_binary(D) || {_Seq, D, _File} <- esqlite3:q("pragma database_list", Connection)],
+    case binary:split(Table, <<".">>) of
+	[Database, Name] ->
+	    case [D || D <- Databases, lower(D) =:= lower(Database)] of
+		[D | _] -> find_table([D], Name, Connection);
+		[] -> {error, no_such_table}
+	    end;
+	[Name] ->
+	    {Temp, Other} = lists:partition(fun(D) -> D =:= <<"temp">> end, Databases),
+	    find_table(Temp ++ Other, Name, Connection)
+    end.
+
+find_table([], _Name, _Connection) ->
+    {error, no_such_table};
+find_table([Database | Rest], Name, Connection) ->
+    Master = case Database of
+		 <<"temp">> -> "sqlite_temp_master";
+		 _ -> "sqlite_master"
+	     end,
+    Sql = ["select name from ", quote(Database), $., Master,
+	   " where type = 'table' and name = ? collate nocase"],
+    %% lists are bound as text, binaries as blobs
+    case esqlite3:q(Sql, [binary_to_list(Name)], Connection) of
+	[{Found} | _] -> {ok, {Database, list_to_binary(Found)}};
+	[] -> find_table(Rest, Name, Connection)
+    end.
+
+lower(Name) ->
+    list_to_binary(string:to_lower(binary_to_list(Name))).
+
+quote(Name) ->
+    [$", binary:replace(iolist_to_binary(Name), <<"\"">>, <<"\"\"">>, [global]), $"].
@@ -24,8 +24,28 @@
 -export([start/0,
 	 open/4,
 	 exec/4,
+	 exec_script/4,
 	 prepare/4,
 	 step/3,
+	 fetch/4,
+	 multi_get/4,
+	 kv_open/4,
+	 kv/4,
+	 pipeline/4,
+	 transaction/4,
+	 cached_query/6,
+	 shared_query/5,
+	 blob_open/4,
+	 blob/4,
+	 backup/4,
+	 subscribe/3,
+	 unsubscribe/4,
+	 result_set/3,
+	 columnar/3,
+	 nth/2,
+	 slice/3,
+	 column/2,
+	 count/1,
 	 finalize/3,
 	 bind/4,
 	 column_names/3,
@@ -58,27 +78,207 @@ open(_Db, _Ref, _Dest, _Filename) ->
 %% ok immediately.
 %%
 %% When the statement is executed Dest will receive message {Ref, answer()}
-%% with answer() integer | {error, reason()}
+%% with answer() integer | {error, reason()}. Sql may come with a list
+%% of options as {Sql, Options}, with {done, info} the answer is
+%% {done, Changes, LastRowid}.
 %%
-%%  @spec exec(connection(), Ref::reference(), Dest::pid(), string()) -> ok | {error, message()}
+%%  @spec exec(connection(), Ref::reference(), Dest::pid(), string() | {string(), list()}) -> ok | {error, message()}
 exec(_Db, _Ref, _Dest, _Sql) ->
     exit(nif_library_not_loaded).
 
-%% @doc
+%% @doc Exec all statements of a script.
 %%
-%% @spec prepare(connection(), reference(), pid(), string()) -> ok | {error, message()}
+%% Sends an asynchronous exec_script command over the connection and
+%% returns ok immediately.
+%%
+%% When the script is executed Dest will receive message {Ref, Results}
+%% with a result per statement, rows for queries and {changes, N} for
+%% other statements. The script stops at the first statement which
+%% fails, its result is {error, reason()}.
+%%
+%%  @spec exec_script(connection(), Ref::reference(), Dest::pid(), iolist()) -> ok | {error, message()}
+exec_script(_Db, _Ref, _Dest, _Sql) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Prepare a statement, Sql may come with a list of options as {Sql, Options}.
+%%
+%% @spec prepare(connection(), reference(), pid(), string() | {string(), list()}) -> ok | {error, message()}
 prepare(_Db, _Ref, _Dest, _Sql) ->
     exit(nif_library_not_loaded).
 
-%% @doc
+%% @doc Step the statement. When the connection thread has read the
+%% answer ahead it is returned right away as {answer, Answer}.
 %%
-%% @spec step(statement(), reference(), pid()) -> ok | {error, message()}
+%% @spec step(statement(), reference(), pid()) -> ok | {answer, term()} | {error, message()}
 step(_Stmt, _Ref, _Dest) ->
     exit(nif_library_not_loaded).
 
-%% @doc
+%% @doc Fetch at most N rows in one command.
+%%
+%% Dest will receive message {Ref, {Status, Rows}}, Status is rows when
+%% the statement may have more rows, '$done' or '$busy'. The bytes of blobs
+%% larger than a heap binary share one binary per fetch. With N as
+%% {chunk, Count} statements with an encoding fetch all their rows.
+%%
+%% @spec fetch(statement(), reference(), pid(), pos_integer()) -> ok | {error, message()}
+fetch(_Stmt, _Ref, _Dest, _N) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Run the statement once for every list of parameters.
+%%
+%% Dest will receive message {Ref, [Rows]}, with the rows of every run
+%% in order.
+%%
+%% @spec multi_get(statement(), reference(), pid(), [list()]) -> ok | {error, message()}
+multi_get(_Stmt, _Ref, _Dest, _ParamsList) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Open a key value store over a table, which is created when needed.
+%% Table may come with a list of options as {Table, Options}.
+%%
+%% @spec kv_open(connection(), reference(), pid(), iolist() | {iolist(), list()}) -> ok | {error, message()}
+kv_open(_Db, _Ref, _Dest, _Table) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Run an operation on a key value store.
+%%
+%% Operation is {get, Key}, {put, Key, Value}, {delete, Key},
+%% {multi_get, Keys} or {range, From, To, Limit}. A get which the bloom
+%% filter of the store answers returns {answer, not_found} right away.
+%%
+%% @spec kv(kv(), reference(), pid(), tuple()) -> ok | {answer, not_found} | {error, message()}
+kv(_Kv, _Ref, _Dest, _Operation) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Run a pipeline of operations on the connection in one command.
+%%
+%% Dest will receive message {Ref, {ok, Results}} or
+%% {Ref, {error, N, Reason}} when operation N failed.
+%%
+%% @spec pipeline(connection(), reference(), pid(), [tuple()]) -> ok | {error, message()}
+pipeline(_Db, _Ref, _Dest, _Operations) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Run pipeline operations in a transaction in one command.
+%%
+%% Dest will receive message {Ref, {ok, Results}} after the commit, or
+%% {Ref, {error, N, Reason}} after the rollback when operation N failed.
+%%
+%% @spec transaction(connection(), reference(), pid(), [tuple()]) -> ok | {error, message()}
+transaction(_Db, _Ref, _Dest, _Operations) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Run a read only query through the query cache of the connection.
+%%
+%% Returns {answer, Rows} right away when the rows are cached. Otherwise
+%% Dest will receive message {Ref, Rows} or {Ref, {error, reason()}}.
+%% Options can be single_writer.
+%%
+%% @spec cached_query(connection(), reference(), pid(), iolist(), list(), list()) -> ok | {answer, list()} | {error, message()}
+cached_query(_Db, _Ref, _Dest, _Sql, _Args, _Options) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Run a read only query, once for all identical queries queued at
+%% the same time.
+%%
+%% Dest will receive message {Ref, Rows} or {Ref, {error, reason()}}.
+%%
+%% @spec shared_query(connection(), reference(), pid(), iolist(), list()) -> ok | {error, message()}
+shared_query(_Db, _Ref, _Dest, _Sql, _Args) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Open the blob in a cell for incremental io, Blob is
+%% {Table, Column, Rowid, read | write}.
+%%
+%% Dest will receive message {Ref, {ok, blob()}} or {Ref, {error, reason()}}.
+%%
+%% @spec blob_open(connection(), reference(), pid(), tuple()) -> ok | {error, message()}
+blob_open(_Db, _Ref, _Dest, _Blob) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Run an operation on an open blob: size, {read, Offset, Size},
+%% {write, Offset, Bytes}, {reopen, Rowid} or close.
+%%
+%% @spec blob(blob(), reference(), pid(), term()) -> ok | {error, message()}
+blob(_Blob, _Ref, _Dest, _Operation) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Backup the database to a file, Backup is {DestFile, Options}.
+%%
+%% The pages are copied a number at a time, after each step the
+%% commands queued on the connection run first. When done Dest will
+%% receive message {Ref, ok} or {Ref, {error, reason()}}.
+%%
+%% @spec backup(connection(), reference(), pid(), tuple()) -> ok | {error, message()}
+backup(_Db, _Ref, _Dest, _Backup) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Subscribe Dest to the changes committed on the connection.
+%%
+%% Dest will receive message {Ref, ok}, after that a message
+%% {esqlite3_changes, Ref, Changes} for every commit with changes.
+%%
+%% @spec subscribe(connection(), reference(), pid()) -> ok | {error, message()}
+subscribe(_Db, _Ref, _Dest) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Stop the subscription made with reference Subscription.
+%%
+%% @spec unsubscribe(connection(), reference(), pid(), reference()) -> ok | {error, message()}
+unsubscribe(_Db, _Ref, _Dest, _Subscription) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Fetch all rows of the statement into a result set.
+%%
+%% When all rows are stepped through Dest will receive message
+%% {Ref, {ok, result_set()}}. When the database is busy the statement
+%% is reset and the answer is '$busy'.
+%%
+%% @spec result_set(statement(), reference(), pid()) -> ok | {error, message()}
+result_set(_Stmt, _Ref, _Dest) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Fetch all rows of the statement column by column.
+%%
+%% When all rows are stepped through Dest will receive message
+%% {Ref, {ok, RowCount, [column()]}}. When the database is busy the
+%% statement is reset and the answer is '$busy'.
+%%
+%% @spec columnar(statement(), reference(), pid()) -> ok | {error, message()}
+columnar(_Stmt, _Ref, _Dest) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Return the N-th row of the result set.
+%%
+%% @spec nth(pos_integer(), result_set()) -> tuple()
+nth(_N, _ResultSet) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Return at most Len rows of the result set, starting at row Start.
+%%
+%% @spec slice(pos_integer(), non_neg_integer(), result_set()) -> [tuple()]
+slice(_Start, _Len, _ResultSet) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Return the values of the N-th column of the result set.
+%%
+%% @spec column(pos_integer(), result_set()) -> list()
+column(_N, _ResultSet) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Return the number of rows in the result set.
+%%
+%% @spec count(result_set()) -> non_neg_integer()
+count(_ResultSet) ->
+    exit(nif_library_not_loaded).
+
+%% @doc Finalize the prepared statement.
 %%
+%% The statement is finalized by the connection thread after all
+%% commands which were sent before. Afterwards the statement can no
+%% longer be used.
 %%
+%% @spec finalize(statement(), reference(), pid()) -> ok | {error, message()}
 finalize(_Stmt, _Ref, _Dest) ->
     exit(nif_library_not_loaded).
 
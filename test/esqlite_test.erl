@@ -87,6 +87,794 @@ column_names_test() ->
 
     ok.
 
+finalize_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one varchar(10), two int);", Db),
+    {ok, Stmt} = esqlite3:prepare("select * from test_table", Db),
+    ok = esqlite3:finalize(Stmt),
+
+    {error, no_prepared_statement} = esqlite3_nif:step(Stmt, make_ref(), self()),
+    {error, no_prepared_statement} = esqlite3_nif:finalize(Stmt, make_ref(), self()),
+
+    ok = esqlite3:close(Db),
+    ok.
+
+garbage_collect_connection_test() ->
+    Self = self(),
+    Pid = spawn(fun() ->
+			{ok, Db} = esqlite3:open(":memory:"),
+			ok = esqlite3:exec("create table test_table(one varchar(10), two int);", Db),
+			{ok, _Stmt} = esqlite3:prepare("select * from test_table", Db),
+			Self ! {self(), done}
+		end),
+    receive {Pid, done} -> ok end,
+    true = erlang:garbage_collect(),
+    {ok, Db2} = esqlite3:open(":memory:"),
+    ok = esqlite3:close(Db2),
+
+    %% many connections dropped at once are torn down by their own
+    %% threads, even the one which is in the middle of a slow query
+    Slow = fun(Db) ->
+		   ok = esqlite3:exec("insert into test_table values(1);", Db),
+		   [ok = esqlite3:exec("insert into test_table select one from test_table;", Db) || _ <- lists:seq(1, 9)],
+		   ok = esqlite3_nif:exec(Db, make_ref(), self(),
+					  ["select count(*) from test_table a, test_table b, test_table c", 0])
+	   end,
+    {Time, ok} = timer:tc(fun() ->
+				  Drops = [spawn_monitor(fun() ->
+								 {ok, Db} = esqlite3:open(":memory:"),
+								 ok = esqlite3:exec("create table test_table(one int);", Db),
+								 {ok, _Stmt} = esqlite3:prepare("select * from test_table", Db),
+								 N =:= 1 andalso Slow(Db)
+							 end) || N <- lists:seq(1, 100)],
+				  [receive {'DOWN', Ref, process, _, normal} -> ok end || {_, Ref} <- Drops],
+				  true = erlang:garbage_collect(),
+				  {ok, Db3} = esqlite3:open(":memory:"),
+				  [{1}] = esqlite3:q("select 1", Db3),
+				  esqlite3:close(Db3)
+			  end),
+    %% the slow query counts 512^3 rows, which takes a lot longer
+    true = Time < 2000000,
+    ok.
+
+mixed_types_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one, two int);", Db),
+    ok = esqlite3:exec("insert into test_table values(1, 2);", Db),
+    ok = esqlite3:exec("insert into test_table values('three', null);", Db),
+    ok = esqlite3:exec("insert into test_table values(x'04', 5.5);", Db),
+
+    %% The first row predicts integers, the others differ
+    [{1, 2}, {"three", undefined}, {<<4>>, 5.5}] =
+	esqlite3:q("select * from test_table order by rowid", Db),
+
+    {ok, Stmt} = esqlite3:prepare("select * from test_table order by rowid", Db),
+    {1, 2} = esqlite3:step(Stmt),
+    {"three", undefined} = esqlite3:step(Stmt),
+    {<<4>>, 5.5} = esqlite3:step(Stmt),
+    '$done' = esqlite3:step(Stmt),
+
+    ok.
+
+fetch_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one blob, two int);", Db),
+    Big = binary:copy(<<"x">>, 100),
+    {ok, Insert} = esqlite3:prepare("insert into test_table values(?1, ?2)", Db),
+    [begin
+	 ok = esqlite3:bind(Insert, [Blob, N]),
+	 '$done' = esqlite3:step(Insert)
+     end || {Blob, N} <- [{<<"small">>, 1}, {Big, 2}, {Big, 3}]],
+
+    {ok, Stmt} = esqlite3:prepare("select * from test_table order by two", Db),
+    {rows, [{<<"small">>, 1}, {Big, 2}]} = esqlite3:fetch(Stmt, 2),
+    {'$done', [{Big, 3}]} = esqlite3:fetch(Stmt, 2),
+
+    %% repeated large blobs within a chunk share the arena bytes
+    {ok, Stmt2} = esqlite3:prepare("select one, 'same', x'0102' from test_table order by two", Db),
+    {'$done', [{<<"small">>, "same", <<1,2>>}, {Big, "same", <<1,2>>}, {Big, "same", <<1,2>>}]} =
+	esqlite3:fetch(Stmt2, 10),
+    {ok, Stmt3} = esqlite3:prepare("select one from test_table where two > 1", Db),
+    {'$done', [{Big}, {Big}]=Bigs} = esqlite3:fetch(Stmt3, 10),
+    [100 = binary:referenced_byte_size(B) || {B} <- Bigs],
+
+    %% and so does text given as binaries
+    ok = esqlite3:exec("create table status(code varchar(10));", Db),
+    [ok = esqlite3:exec(["insert into status values('", Code, "');"], Db) || Code <- ["ok", "ok", "failed", "ok"]],
+    {ok, Stmt4} = esqlite3:prepare("select code from status order by rowid", Db, [{text, binary}]),
+    {'$done', [{<<"ok">>}, {<<"ok">>}, {<<"failed">>}, {<<"ok">>}]=Codes} = esqlite3:fetch(Stmt4, 10),
+    [8 = binary:referenced_byte_size(C) || {C} <- Codes],
+    {ok, Stmt5} = esqlite3:prepare("select code from status order by rowid", Db, [{text, binary}]),
+    {<<"ok">>} = esqlite3:step(Stmt5),
+    {error, invalid_option} = esqlite3:prepare("select 1", Db, [{text, atom}]),
+
+    ok.
+
+map_rows_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one varchar(10), two int);", Db),
+    ok = esqlite3:exec("insert into test_table values(\"hello1\", 10);", Db),
+    ok = esqlite3:exec("insert into test_table values(\"hello2\", 11);", Db),
+
+    {ok, Stmt} = esqlite3:prepare("select * from test_table order by two", Db, [{row, map}]),
+    #{<<"one">> := "hello1", <<"two">> := 10} = esqlite3:step(Stmt),
+    {'$done', [#{<<"one">> := "hello2", <<"two">> := 11}]} = esqlite3:fetch(Stmt, 10),
+
+    {ok, Stmt2} = esqlite3:prepare("select * from test_table order by two", Db, [{row, {map, [two]}}]),
+    [#{<<"one">> := "hello1", two := 10}, #{<<"one">> := "hello2", two := 11}] = esqlite3:fetchall(Stmt2),
+
+    {ok, Stmt3} = esqlite3:prepare("select one, one from test_table", Db, [{row, map}]),
+    {error, duplicate_column_names} = esqlite3:step(Stmt3),
+
+    {error, invalid_option} = esqlite3:prepare("select * from test_table", Db, [{row, list}]),
+
+    ok.
+
+etf_encoding_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one varchar(10), two int);", Db),
+    ok = esqlite3:exec("insert into test_table values(\"hello1\", 10);", Db),
+    ok = esqlite3:exec("insert into test_table values(\"hello2\", 11);", Db),
+
+    {ok, Stmt} = esqlite3:prepare("select * from test_table order by two", Db, [{encoding, etf}]),
+    Row = esqlite3:step(Stmt),
+    {"hello1", 10} = binary_to_term(Row),
+    {'$done', Rows} = esqlite3:fetch(Stmt, 10),
+    [{"hello2", 11}] = binary_to_term(Rows),
+
+    %% more rows than fit in one chunk of fetchall
+    ok = esqlite3:exec("create table numbers(n int);", Db),
+    ok = esqlite3:exec("insert into numbers values(1);", Db),
+    lists:foreach(fun(_) -> ok = esqlite3:exec("insert into numbers select * from numbers;", Db) end,
+		  lists:seq(1, 11)),
+    {ok, All} = esqlite3:prepare("select n from numbers", Db, [{encoding, etf}]),
+    2048 = length(binary_to_term(esqlite3:fetchall(All))),
+
+    ok.
+
+json_encoding_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one varchar(10), two int, three blob);", Db),
+    ok = esqlite3:exec("insert into test_table values('say \"hi\"', 10, x'010203');", Db),
+    ok = esqlite3:exec("insert into test_table values('bye', 1.5, null);", Db),
+
+    {ok, Stmt} = esqlite3:prepare("select * from test_table order by two desc", Db, [{encoding, json}]),
+    <<"[\"say \\\"hi\\\"\",10,\"AQID\"]">> = esqlite3:step(Stmt),
+    {'$done', <<"[[\"bye\",1.5,null]]">>} = esqlite3:fetch(Stmt, 10),
+
+    {ok, Stmt2} = esqlite3:prepare("select one, two from test_table order by two", Db,
+				   [{encoding, json}, {row, map}]),
+    {'$done', <<"[{\"one\":\"bye\",\"two\":1.5},{\"one\":\"say \\\"hi\\\"\",\"two\":10}]">>} =
+	esqlite3:fetch(Stmt2, 10),
+
+    %% shortest doubles which read back the same, invalid utf-8 is replaced
+    {ok, Stmt3} = esqlite3:prepare("select 0.1, 1.0 / 3, cast(x'41ff42' as text), 'caf' || x'c3a9'", Db,
+				   [{encoding, json}]),
+    <<"[0.1,0.3333333333333333,\"A", 16#ef, 16#bf, 16#bd, "B\",\"caf", 16#c3, 16#a9, "\"]">> = esqlite3:step(Stmt3),
+
+    ok.
+
+read_ahead_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one int);", Db),
+    [ok = esqlite3:exec(["insert into test_table values(", integer_to_list(N), ");"], Db)
+     || N <- lists:seq(1, 5)],
+
+    {ok, Stmt} = esqlite3:prepare("select one from test_table where one >= ? order by one", Db,
+				  [{read_ahead, 2}]),
+    ok = esqlite3:bind(Stmt, [1]),
+    {1} = esqlite3:step(Stmt),
+    {2} = esqlite3:step(Stmt),
+    ok = esqlite3:bind(Stmt, [4]),
+    {4} = esqlite3:step(Stmt),
+    {5} = esqlite3:step(Stmt),
+    '$done' = esqlite3:step(Stmt),
+
+    ok = esqlite3:bind(Stmt, [1]),
+    [{1}, {2}, {3}, {4}, {5}, '$done'] = [esqlite3:step(Stmt) || _ <- lists:seq(1, 6)],
+    {error, read_ahead_statement} = esqlite3:fetch(Stmt, 10),
+    {error, read_ahead_statement} = esqlite3:result_set(Stmt),
+    {error, read_ahead_statement} = esqlite3:columnar(Stmt),
+    ok = esqlite3:bind(Stmt, [3]),
+    [{3}, {4}, {5}] = esqlite3:fetchall(Stmt),
+
+    ok.
+
+read_ahead_rebind_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one int);", Db),
+    [ok = esqlite3:exec(["insert into test_table values(", integer_to_list(N), ");"], Db)
+     || N <- lists:seq(1, 5)],
+    ok = esqlite3:exec("create table numbers(n int);", Db),
+    ok = esqlite3:exec("insert into numbers values(1);", Db),
+    lists:foreach(fun(_) -> ok = esqlite3:exec("insert into numbers select * from numbers;", Db) end,
+		  lists:seq(1, 10)),
+
+    {ok, Stmt} = esqlite3:prepare("select one from test_table where one >= ? order by one", Db,
+				  [{read_ahead, 2}]),
+    ok = esqlite3:bind(Stmt, [1]),
+
+    %% the step queues a read ahead behind the slow query, the bind is
+    %% made before the read ahead runs and queued after it
+    Step = make_ref(),
+    ok = esqlite3_nif:step(Stmt, Step, self()),
+    Slow = make_ref(),
+    ok = esqlite3_nif:exec(Db, Slow, self(), ["select count(*) from numbers a, numbers b;", 0]),
+    receive {Step, {1}} -> ok end,
+    ok = esqlite3:bind(Stmt, [4]),
+    receive {Slow, ok} -> ok end,
+
+    {4} = esqlite3:step(Stmt),
+    {5} = esqlite3:step(Stmt),
+    '$done' = esqlite3:step(Stmt),
+    ok.
+
+multi_get_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(key int, value varchar(10));", Db),
+    ok = esqlite3:exec("insert into test_table values(1, 'one');", Db),
+    ok = esqlite3:exec("insert into test_table values(2, 'two');", Db),
+    ok = esqlite3:exec("insert into test_table values(2, 'deux');", Db),
+
+    {ok, Stmt} = esqlite3:prepare("select value from test_table where key = ? order by value", Db),
+    [[{"one"}], [], [{"deux"}, {"two"}]] = esqlite3:multi_get(Stmt, [[1], [3], [2]]),
+    [] = esqlite3:multi_get(Stmt, []),
+    {error, args_wrong_length} = esqlite3:multi_get(Stmt, [[1, 2]]),
+
+    ok.
+
+kv_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    {ok, Kv} = esqlite3:kv_open("kv", Db),
+
+    not_found = esqlite3:kv_get(Kv, <<"a">>),
+    ok = esqlite3:kv_put(Kv, <<"a">>, <<"1">>),
+    ok = esqlite3:kv_put(Kv, <<"b">>, <<"2">>),
+    ok = esqlite3:kv_put(Kv, <<"c">>, <<"3">>),
+    ok = esqlite3:kv_put(Kv, <<"a">>, <<"one">>),
+    {ok, <<"one">>} = esqlite3:kv_get(Kv, <<"a">>),
+    [{ok, <<"2">>}, not_found, {ok, <<"one">>}] = esqlite3:kv_multi_get(Kv, [<<"b">>, <<"x">>, <<"a">>]),
+    [{<<"a">>, <<"one">>}, {<<"b">>, <<"2">>}] = esqlite3:kv_range(Kv, <<"a">>, <<"c">>, 10),
+    [{<<"b">>, <<"2">>}] = esqlite3:kv_range(Kv, <<"b">>, <<"z">>, 1),
+    ok = esqlite3:kv_delete(Kv, <<"a">>),
+    not_found = esqlite3:kv_get(Kv, <<"a">>),
+
+    %% the table is shared with sql
+    [{<<"b">>, <<"2">>}, {<<"c">>, <<"3">>}] = esqlite3:q("select * from kv order by key", Db),
+
+    ok.
+
+kv_bloom_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table kv(key blob primary key, value blob);", Db),
+    ok = esqlite3:exec("insert into kv values(x'01', x'02');", Db),
+    {ok, Kv} = esqlite3:kv_open("kv", Db, [{bloom, 1000}]),
+
+    {ok, <<2>>} = esqlite3:kv_get(Kv, <<1>>),
+    not_found = esqlite3:kv_get(Kv, <<"absent">>),
+    ok = esqlite3:kv_put(Kv, <<"a">>, <<"1">>),
+    {ok, <<"1">>} = esqlite3:kv_get(Kv, <<"a">>),
+
+    %% writes around the store make the filter stale
+    ok = esqlite3:exec("insert into kv values(x'03', x'04');", Db),
+    {ok, <<4>>} = esqlite3:kv_get(Kv, <<3>>),
+    [{ok, <<4>>}, not_found] = esqlite3:kv_multi_get(Kv, [<<3>>, <<"b">>]),
+    ok = esqlite3:exec("update kv set key = x'05' where key = x'03';", Db),
+    {ok, <<4>>} = esqlite3:kv_get(Kv, <<5>>),
+
+    %% other connections can write to a file
+    File = "kv_bloom_test.db",
+    file:delete(File),
+    {ok, FileDb} = esqlite3:open(File),
+    {error, bloom_needs_single_writer} = esqlite3:kv_open("kv", FileDb, [{bloom, 1000}]),
+    {ok, FileKv} = esqlite3:kv_open("kv", FileDb, [{bloom, 1000}, single_writer]),
+    not_found = esqlite3:kv_get(FileKv, <<1>>),
+    file:delete(File),
+
+    ok.
+
+pipeline_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    {ok, [ok, ok, ok, [{1, "alice"}], [{"hello"}]]} =
+	esqlite3:pipeline([{exec, "create table users(id integer primary key, name text);"
+			          "create table posts(user_id int, body text);"},
+			   {exec, "insert into users(name) values(?)", ["alice"]},
+			   {exec, "insert into posts values(?, ?)", [{'$ref', 2}, "hello"]},
+			   {query, "select * from users", []},
+			   {query, "select body from posts where user_id = ?", [{'$ref', 2}]}], Db),
+
+    {ok, [ok, [{2}]]} =
+	esqlite3:pipeline([{exec, "insert into users(name) values('bob')", []},
+			   {query, "select ?", ['$last_insert_rowid']}], Db),
+
+    {error, 2, {sqlite3_error, _}} =
+	esqlite3:pipeline([{query, "select 1", []}, {exec, "insert into nothing values(1)", []}], Db),
+    {error, 1, invalid_reference} = esqlite3:pipeline([{query, "select ?", [{'$ref', 1}]}], Db),
+
+    %% one statement per operation, a trailing comment is fine
+    {error, 1, multiple_statements} =
+	esqlite3:pipeline([{exec, "insert into users(name) values('carol'); delete from users", []}], Db),
+    {ok, [[{2}]]} = esqlite3:pipeline([{query, "select count(*) from users; -- all", []}], Db),
+
+    %% not atomic, the operations before the failing one stay
+    {error, 2, {sqlite3_error, _}} =
+	esqlite3:pipeline([{exec, "insert into users(name) values('dave')", []},
+			   {exec, "insert into nothing values(1)", []}], Db),
+    [{3}] = esqlite3:q("select count(*) from users", Db),
+
+    ok.
+
+transaction_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one int unique);", Db),
+
+    {ok, [ok, ok]} = esqlite3:transaction([{exec, "insert into test_table values(?)", [1]},
+					   {exec, "insert into test_table values(?)", [2]}], Db),
+
+    %% a failing operation rolls everything back
+    {error, 2, {sqlite3_error, _}} =
+	esqlite3:transaction([{exec, "insert into test_table values(?)", [3]},
+			      {exec, "insert into test_table values(?)", [1]}], Db),
+    [{1}, {2}] = esqlite3:q("select * from test_table order by one", Db),
+
+    %% a failing operation in a savepoint only undoes itself
+    {ok, [ok, {error, {sqlite3_error, _}}, ok]} =
+	esqlite3:transaction([{exec, "insert into test_table values(?)", [3]},
+			      {savepoint, {exec, "insert into test_table values(?)", [1]}},
+			      {exec, "insert into test_table values(?)", [4]}], Db),
+    [{1}, {2}, {3}, {4}] = esqlite3:q("select * from test_table order by one", Db),
+
+    ok.
+
+exec_script_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+
+    [ok, {changes, 1}, {changes, 2}, [{1, "one"}, {2, "two"}, {3, "three"}]] =
+	esqlite3:exec_script("create table test_table(one int, two varchar(10));
+			     insert into test_table values(1, 'one');
+			     -- two at once
+			     insert into test_table select 2, 'two' union select 3, 'three';
+			     select * from test_table order by one;", Db),
+
+    %% stops at the first error
+    [{changes, 1}, {error, {sqlite3_error, _}}] =
+	esqlite3:exec_script("delete from test_table where one = 3; select * from no_table; delete from test_table;", Db),
+    [{1, "one"}, {2, "two"}] = esqlite3:q("select * from test_table order by one", Db),
+
+    %% rows changed by triggers are not counted
+    [ok, ok, {changes, 1}, {changes, 0}, [{1}]] =
+	esqlite3:exec_script("create table log(one int);
+			     create trigger logged after insert on test_table begin insert into log values(new.one); end;
+			     /* one row, and one in log */ insert into test_table values(4, 'four');
+			     update test_table set two = 'none' where one = 5;
+			     select count(*) from log;", Db),
+
+    [] = esqlite3:exec_script(" -- nothing\n", Db),
+
+    ok.
+
+done_info_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    {done, 0, 0} = esqlite3:exec("create table test_table(id integer primary key, two varchar(10));", Db, [{done, info}]),
+    {done, 1, 1} = esqlite3:exec("insert into test_table(two) values('one');", Db, [{done, info}]),
+    {done, 1, 7} = esqlite3:exec("insert into test_table values(7, 'seven');", Db, [{done, info}], infinity),
+    ok = esqlite3:exec("insert into test_table(two) values('eight');", Db, infinity),
+
+    {ok, Update} = esqlite3:prepare("update test_table set two = ?", Db, [{done, info}]),
+    ok = esqlite3:bind(Update, ["all"]),
+    {done, 3, 8} = esqlite3:step(Update),
+
+    {ok, Insert} = esqlite3:prepare("insert into test_table(two) values(?)", Db, [{done, info}, {read_ahead, 4}]),
+    ok = esqlite3:bind(Insert, ["nine"]),
+    {done, 1, 9} = esqlite3:step(Insert),
+
+    {error, invalid_option} = esqlite3:prepare("select 1", Db, [{done, never}]),
+    {error, invalid_option} = esqlite3:exec("select 1", Db, [{done, never}]),
+    ok.
+
+subscribe_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one int, two varchar(10));", Db),
+    {ok, Sub} = esqlite3:subscribe(Db),
+
+    ok = esqlite3:exec("insert into test_table values(1, 'one');", Db),
+    receive
+	{esqlite3_changes, Sub, [{insert, <<"main">>, <<"test_table">>, 1}]} -> ok
+    after 1000 -> exit(no_changes)
+    end,
+
+    %% one message per commit
+    ok = esqlite3:exec("begin;", Db),
+    ok = esqlite3:exec("insert into test_table values(2, 'two');", Db),
+    ok = esqlite3:exec("update test_table set two = 'uno' where one = 1;", Db),
+    ok = esqlite3:exec("commit;", Db),
+    receive
+	{esqlite3_changes, Sub, [{insert, <<"main">>, <<"test_table">>, 2}, {update, <<"main">>, <<"test_table">>, 1}]} -> ok
+    after 1000 -> exit(no_changes)
+    end,
+
+    %% rolled back changes are dropped
+    ok = esqlite3:exec("begin;", Db),
+    ok = esqlite3:exec("delete from test_table;", Db),
+    ok = esqlite3:exec("rollback;", Db),
+    ok = esqlite3:exec("delete from test_table where one = 2;", Db),
+    receive
+	{esqlite3_changes, Sub, [{delete, <<"main">>, <<"test_table">>, 2}]} -> ok
+    after 1000 -> exit(no_changes)
+    end,
+
+    %% so are the changes undone by a rollback to a savepoint, or by a
+    %% statement which fails in a transaction
+    ok = esqlite3:exec("create unique index test_one on test_table(one);", Db),
+    ok = esqlite3:exec("begin;", Db),
+    ok = esqlite3:exec("insert into test_table values(3, 'three');", Db),
+    ok = esqlite3:exec("savepoint a;", Db),
+    ok = esqlite3:exec("insert into test_table values(4, 'four');", Db),
+    ok = esqlite3:exec("rollback to a;", Db),
+    ok = esqlite3:exec("release a;", Db),
+    {error, {sqlite3_error, _}} =
+	esqlite3:exec("insert into test_table select 5, 'five' union all select 1, 'uno';", Db),
+    ok = esqlite3:exec("commit;", Db),
+    receive
+	{esqlite3_changes, Sub, [{insert, <<"main">>, <<"test_table">>, _}]} -> ok
+    after 1000 -> exit(no_changes)
+    end,
+
+    %% and by a savepoint of a transaction which fails
+    {ok, [ok, {error, {sqlite3_error, _}}]} =
+	esqlite3:transaction([{exec, "insert into test_table values(?, ?)", [6, "six"]},
+			      {savepoint, {exec, "insert into test_table select ?, 'seven' union all select 1, 'uno'", [7]}}], Db),
+    receive
+	{esqlite3_changes, Sub, [{insert, <<"main">>, <<"test_table">>, _}]} -> ok
+    after 1000 -> exit(no_changes)
+    end,
+    [{1}, {3}, {6}] = esqlite3:q("select one from test_table order by one", Db),
+
+    ok = esqlite3:unsubscribe(Sub, Db),
+    {error, not_subscribed} = esqlite3:unsubscribe(Sub, Db),
+    ok = esqlite3:exec("delete from test_table;", Db),
+    receive
+	{esqlite3_changes, Sub, _} -> exit(unexpected_changes)
+    after 100 -> ok
+    end,
+
+    ok = esqlite3:close(Db),
+    {error, database_not_open} = esqlite3:subscribe(Db),
+    {error, database_not_open} = esqlite3:unsubscribe(Sub, Db),
+    ok.
+
+subscribe_overflow_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one int);", Db),
+    ok = esqlite3:exec("insert into test_table values(1);", Db),
+    [ok = esqlite3:exec("insert into test_table select one from test_table;", Db) || _ <- lists:seq(1, 17)],
+    {ok, Sub} = esqlite3:subscribe(Db),
+
+    %% too many changes in one transaction, start over
+    ok = esqlite3:exec("update test_table set one = 2;", Db),
+    receive
+	{esqlite3_overflow, Sub} -> ok
+    after 1000 -> exit(no_overflow)
+    end,
+
+    ok = esqlite3:exec("delete from test_table where rowid = 1;", Db),
+    receive
+	{esqlite3_changes, Sub, [{delete, <<"main">>, <<"test_table">>, 1}]} -> ok
+    after 1000 -> exit(no_changes)
+    end,
+    ok.
+
+cached_q_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one int, two varchar(10));", Db),
+    ok = esqlite3:exec("create table other_table(one int);", Db),
+    ok = esqlite3:exec("insert into test_table values(1, 'one');", Db),
+
+    [{1, "one"}] = esqlite3:cached_q("select * from test_table", Db),
+    [{1, "one"}] = esqlite3:cached_q("select * from test_table", Db),
+    [{"one"}] = esqlite3:cached_q("select two from test_table where one = ?", [1], Db),
+    [] = esqlite3:cached_q("select two from test_table where one = ?", [2], Db),
+
+    %% writes to other tables keep the rows
+    ok = esqlite3:exec("insert into other_table values(1);", Db),
+    [{1, "one"}] = esqlite3:cached_q("select * from test_table", Db),
+
+    ok = esqlite3:exec("insert into test_table values(2, 'two');", Db),
+    [{1, "one"}, {2, "two"}] = esqlite3:cached_q("select * from test_table order by one", Db),
+    [{"two"}] = esqlite3:cached_q("select two from test_table where one = ?", [2], Db),
+
+    %% deleting everything is seen as well
+    ok = esqlite3:exec("delete from test_table;", Db),
+    [] = esqlite3:cached_q("select * from test_table order by one", Db),
+
+    %% and so are dropped tables
+    [{1}] = esqlite3:cached_q("select * from other_table", Db),
+    ok = esqlite3:exec("drop table other_table;", Db),
+    ok = esqlite3:exec("create table other_table(one int);", Db),
+    [] = esqlite3:cached_q("select * from other_table", Db),
+
+    {error, not_a_read_only_query} = (catch esqlite3:cached_q("delete from test_table", Db)),
+
+    %% tables of attached databases are told apart from main tables
+    ok = esqlite3:exec("attach ':memory:' as aux;", Db),
+    ok = esqlite3:exec("create table aux.test_table(one int);", Db),
+    [] = esqlite3:cached_q("select * from aux.test_table", Db),
+    ok = esqlite3:exec("insert into aux.test_table values(3);", Db),
+    [{3}] = esqlite3:cached_q("select * from aux.test_table", Db),
+
+    %% volatile functions and queries without tables are not cached
+    [{A}] = esqlite3:cached_q("select random()", Db),
+    [{B}] = esqlite3:cached_q("select random()", Db),
+    true = A =/= B,
+    [{1}] = esqlite3:cached_q("select changes()", Db),
+    ok = esqlite3:exec("insert into test_table select 3, 'three' union all select 4, 'four';", Db),
+    [{2}] = esqlite3:cached_q("select changes()", Db),
+
+    ok = esqlite3:close(Db),
+    {error, database_not_open} = (catch esqlite3:cached_q("select * from other_table", Db)),
+    ok.
+
+cached_q_file_test() ->
+    file:delete("cached.db"),
+    {ok, Db} = esqlite3:open("cached.db"),
+    {ok, Other} = esqlite3:open("cached.db"),
+    ok = esqlite3:exec("create table test_table(one int);", Db),
+    ok = esqlite3:exec("insert into test_table values(1);", Db),
+
+    %% other connections could write to the file
+    {error, cache_needs_single_writer} = (catch esqlite3:cached_q("select * from test_table", [], Db)),
+    {error, invalid_option} = (catch esqlite3:cached_q("select * from test_table", [], Db, [never])),
+
+    %% the second answer comes from the cache, the write of the other
+    %% connection is not seen
+    [{1}] = esqlite3:cached_q("select * from test_table", [], Db, [single_writer]),
+    ok = esqlite3:exec("insert into test_table values(2);", Other),
+    [{1}] = esqlite3:cached_q("select * from test_table", [], Db, [single_writer]),
+    [{1}, {2}] = esqlite3:q("select * from test_table order by one", Db),
+
+    ok = esqlite3:close(Other),
+    ok.
+
+shared_q_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one int, two varchar(10));", Db),
+    ok = esqlite3:exec("insert into test_table values(1, 'one');", Db),
+
+    Self = self(),
+    Pids = [spawn(fun() ->
+			  Self ! {self(), esqlite3:shared_q("select * from test_table where one = ?", [1], Db)}
+		  end) || _ <- lists:seq(1, 20)],
+    [receive {Pid, [{1, "one"}]} -> ok after 1000 -> exit(no_rows) end || Pid <- Pids],
+
+    %% writes queued in between are seen
+    ok = esqlite3:exec("insert into test_table values(2, 'two');", Db),
+    [{2}] = esqlite3:shared_q("select count(*) from test_table", Db),
+
+    {error, not_a_read_only_query} = (catch esqlite3:shared_q("delete from test_table", Db)),
+    ok.
+
+mirror_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(name varchar(10), value int);", Db),
+    ok = esqlite3:exec("insert into test_table values('one', 1);", Db),
+    ok = esqlite3:exec("insert into test_table values('two', 2);", Db),
+
+    {ok, Mirror} = esqlite3_mirror:start_link("test_table", Db),
+    Ets = esqlite3_mirror:table(Mirror),
+    [{"one", 1}] = esqlite3_mirror:lookup("one", Ets),
+    [{"two", 2}] = esqlite3_mirror:lookup("two", Ets),
+
+    ok = esqlite3:exec("begin;", Db),
+    ok = esqlite3:exec("insert into test_table values('three', 3);", Db),
+    ok = esqlite3:exec("update test_table set value = 11 where name = 'one';", Db),
+    ok = esqlite3:exec("update test_table set name = 'deux' where name = 'two';", Db),
+    ok = esqlite3:exec("commit;", Db),
+    ok = esqlite3:exec("delete from test_table where name = 'three';", Db),
+
+    ok = esqlite3_mirror:sync(Mirror),
+    [{"one", 11}] = esqlite3_mirror:lookup("one", Ets),
+    [] = esqlite3_mirror:lookup("two", Ets),
+    [{"deux", 2}] = esqlite3_mirror:lookup("deux", Ets),
+    [] = esqlite3_mirror:lookup("three", Ets),
+
+    ok = esqlite3_mirror:stop(Mirror),
+    ok.
+
+mirror_table_name_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(name varchar(10), value int);", Db),
+    ok = esqlite3:exec("insert into test_table values('one', 1);", Db),
+
+    {ok, Mirror} = esqlite3_mirror:start_link("MAIN.Test_Table", Db),
+    Ets = esqlite3_mirror:table(Mirror),
+    [{"one", 1}] = esqlite3_mirror:lookup("one", Ets),
+
+    %% rowids above 32 bits
+    ok = esqlite3:exec("insert into test_table(rowid, name, value) values(5000000000, 'big', 2);", Db),
+    ok = esqlite3:exec("update test_table set value = 3 where rowid = 5000000000;", Db),
+
+    %% a table with the same name in another database is not mirrored
+    ok = esqlite3:exec("create temp table test_table(name varchar(10), value int);", Db),
+    ok = esqlite3:exec("insert into temp.test_table values('temp', 4);", Db),
+    ok = esqlite3:exec("delete from temp.test_table;", Db),
+    ok = esqlite3:exec("insert into temp.test_table(rowid, name, value) values(1, 'temp', 5);", Db),
+
+    ok = esqlite3_mirror:sync(Mirror),
+    [{"one", 1}] = esqlite3_mirror:lookup("one", Ets),
+    [{"big", 3}] = esqlite3_mirror:lookup("big", Ets),
+    [] = esqlite3_mirror:lookup("temp", Ets),
+
+    ok = esqlite3_mirror:stop(Mirror),
+    {error, no_such_table} = esqlite3_mirror:start_link("other.test_table", Db),
+    ok.
+
+blob_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(id integer primary key, data blob);", Db),
+    ok = esqlite3:exec("insert into test_table values(1, x'0102030405');", Db),
+    ok = esqlite3:exec("insert into test_table values(2, zeroblob(4));", Db),
+
+    {ok, Blob} = esqlite3:blob_open("test_table", "data", 1, Db),
+    5 = esqlite3:blob_size(Blob),
+    {ok, <<1, 2>>} = esqlite3:blob_read(Blob, 0, 2),
+    {ok, <<3, 4, 5>>} = esqlite3:blob_read(Blob, 2, 10),
+    eof = esqlite3:blob_read(Blob, 5, 10),
+    {error, _} = esqlite3:blob_write(Blob, 0, <<9>>),
+
+    ok = esqlite3:blob_reopen(Blob, 2),
+    4 = esqlite3:blob_size(Blob),
+    ok = esqlite3:blob_close(Blob),
+    {error, closed} = esqlite3:blob_size(Blob),
+
+    {ok, Writer} = esqlite3:blob_open("test_table", "data", 2, Db, [{mode, write}]),
+    ok = esqlite3:blob_write(Writer, 0, <<"ab">>),
+    ok = esqlite3:blob_write(Writer, 2, [<<"c">>, "d"]),
+    {error, _} = esqlite3:blob_write(Writer, 3, <<"ef">>),
+    ok = esqlite3:blob_close(Writer),
+    {ok, Select} = esqlite3:prepare("select data from test_table where id = 2", Db),
+    [{<<"abcd">>}] = esqlite3:fetchall(Select),
+    ok = esqlite3:finalize(Select),
+
+    {error, _} = esqlite3:blob_open("test_table", "data", 3, Db),
+
+    ok = esqlite3:close(Db),
+    {error, database_not_open} = esqlite3:blob_open("test_table", "data", 1, Db),
+    ok.
+
+backup_test() ->
+    File = "backup_test.db",
+    file:delete(File),
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(id integer primary key, data blob);", Db),
+    ok = esqlite3:exec("insert into test_table select 1, zeroblob(10000) union select 2, zeroblob(10000);", Db),
+
+    ok = esqlite3:backup(File, Db, [{pages, 1}, {progress, self()}]),
+    receive {esqlite3_backup, _, _, PageCount} when PageCount > 1 -> ok end,
+
+    {ok, Copy} = esqlite3:open(File),
+    {ok, Count} = esqlite3:prepare("select count(*) from test_table", Copy),
+    [{2}] = esqlite3:fetchall(Count),
+    ok = esqlite3:finalize(Count),
+
+    %% the destination stays locked
+    ok = esqlite3:exec("begin exclusive;", Copy),
+    {error, busy} = esqlite3:backup(File, Db),
+    ok = esqlite3:exec("rollback;", Copy),
+    ok = esqlite3:close(Copy),
+
+    {error, invalid_option} = esqlite3:backup(File, Db, [{pages, 0}]),
+
+    %% a restore starts the kv filters over and is told to subscribers
+    {ok, Restored} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table kv(key blob primary key, value blob);", Restored),
+    {ok, Kv} = esqlite3:kv_open("kv", Restored, [{bloom, 1000}]),
+    not_found = esqlite3:kv_get(Kv, <<1>>),
+    ok = esqlite3:exec("create table kv(key blob primary key, value blob);", Db),
+    ok = esqlite3:exec("insert into kv values(x'01', x'02');", Db),
+    ok = esqlite3:backup(File, Db),
+    {ok, Sub} = esqlite3:subscribe(Restored),
+    ok = esqlite3:backup(File, Restored, [restore]),
+    receive {esqlite3_restored, Sub} -> ok after 1000 -> exit(no_restored) end,
+    {ok, <<2>>} = esqlite3:kv_get(Kv, <<1>>),
+    ok = esqlite3:unsubscribe(Sub, Restored),
+
+    ok = esqlite3:close(Db),
+    {error, database_not_open} = esqlite3:backup(File, Db),
+    file:delete(File),
+    ok.
+
+open_in_memory_copy_test() ->
+    File = "in_memory_copy_test.db",
+    file:delete(File),
+    {ok, Db} = esqlite3:open(File),
+    ok = esqlite3:exec("create table test_table(one varchar(10), two int);", Db),
+    ok = esqlite3:exec(["insert into test_table values(", "\"hello1\"", ",", "10" ");"], Db),
+    ok = esqlite3:close(Db),
+
+    {ok, Copy} = esqlite3:open_in_memory_copy(File),
+    {ok, Select} = esqlite3:prepare("select * from test_table", Copy),
+    [{"hello1", 10}] = esqlite3:fetchall(Select),
+    ok = esqlite3:finalize(Select),
+    ok = esqlite3:exec("delete from test_table;", Copy),
+    ok = esqlite3:close(Copy),
+
+    {ok, WriteBack} = esqlite3:open_in_memory_copy(File, [write_back]),
+    ok = esqlite3:exec(["insert into test_table values(", "\"hello2\"", ",", "20" ");"], WriteBack),
+    ok = esqlite3:close(WriteBack),
+
+    {ok, Db2} = esqlite3:open(File),
+    {ok, Count} = esqlite3:prepare("select count(*) from test_table", Db2),
+    [{2}] = esqlite3:fetchall(Count),
+    ok = esqlite3:finalize(Count),
+    ok = esqlite3:close(Db2),
+
+    %% a missing file is an error, it is not created
+    {error, _} = esqlite3:open_in_memory_copy("in_memory_copy_missing.db"),
+    {error, enoent} = file:read_file_info("in_memory_copy_missing.db"),
+
+    %% the file is gone before the write back
+    {ok, Gone} = esqlite3:open_in_memory_copy(File, [write_back]),
+    ok = file:delete(File),
+    {error, _} = esqlite3:close(Gone),
+    {error, enoent} = file:read_file_info(File),
+    ok.
+
+result_set_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("begin;", Db),
+    ok = esqlite3:exec("create table test_table(one varchar(10), two int, three blob);", Db),
+    ok = esqlite3:exec(["insert into test_table values(", "\"hello1\"", ",", "10", ",", "x'01'" ");"], Db),
+    ok = esqlite3:exec(["insert into test_table values(", "\"hello2\"", ",", "11", ",", "null" ");"], Db),
+    ok = esqlite3:exec(["insert into test_table values(", "\"hello3\"", ",", "12", ",", "x'0203'" ");"], Db),
+    ok = esqlite3:exec("commit;", Db),
+
+    {ok, Stmt} = esqlite3:prepare("select * from test_table order by two", Db),
+    {ok, Rs} = esqlite3:result_set(Stmt),
+
+    3 = esqlite3:count(Rs),
+    {"hello2", 11, undefined} = esqlite3:nth(2, Rs),
+    [{"hello2", 11, undefined}, {"hello3", 12, <<2,3>>}] = esqlite3:slice(2, 5, Rs),
+    [] = esqlite3:slice(4, 1, Rs),
+    [10, 11, 12] = esqlite3:column(2, Rs),
+    ?assertError(badarg, esqlite3:nth(4, Rs)),
+
+    %% long lists are made in parts
+    ok = esqlite3:exec("create table numbers(n int);", Db),
+    ok = esqlite3:exec("insert into numbers values(1);", Db),
+    lists:foreach(fun(_) ->
+			  ok = esqlite3:exec("insert into numbers select n + (select count(*) from numbers) from numbers;", Db)
+		  end, lists:seq(1, 14)),
+    {ok, Numbers} = esqlite3:prepare("select n, n * 2 from numbers order by n", Db),
+    {ok, Big} = esqlite3:result_set(Numbers),
+    16384 = esqlite3:count(Big),
+    true = esqlite3:column(1, Big) =:= lists:seq(1, 16384),
+    true = esqlite3:slice(100, 10000, Big) =:= [{N, N * 2} || N <- lists:seq(100, 10099)],
+
+    ok.
+
+columnar_test() ->
+    {ok, Db} = esqlite3:open(":memory:"),
+    ok = esqlite3:exec("create table test_table(one varchar(10), two int, three real);", Db),
+    ok = esqlite3:exec("insert into test_table values('ab', 10, 1.5);", Db),
+    ok = esqlite3:exec("insert into test_table values(null, 11, 2);", Db),
+    ok = esqlite3:exec("insert into test_table values('cde', null, 3.5);", Db),
+
+    {ok, Stmt} = esqlite3:prepare("select * from test_table order by rowid", Db),
+    {ok, 3, [One, Two, Three]} = esqlite3:columnar(Stmt),
+
+    {text, <<"abcde">>, Offsets, <<2>>} = One,
+    <<0:64/native, 2:64/native, 2:64/native, 5:64/native>> = Offsets,
+    {integer, <<10:64/native-signed, 11:64/native-signed, _:64>>, <<4>>} = Two,
+    {float, <<1.5:64/native-float, 2.0:64/native-float, 3.5:64/native-float>>, <<0>>} = Three,
+
+    {ok, Mixed} = esqlite3:prepare("select 'ab' union all select x'0102' union all select null", Db),
+    {ok, 3, [{mixed, ["ab", <<1, 2>>, undefined]}]} = esqlite3:columnar(Mixed),
+
+    {ok, Nulls} = esqlite3:prepare("select null union all select null", Db),
+    {ok, 2, [{integer, <<0:128>>, <<3>>}]} = esqlite3:columnar(Nulls),
+
+    ok.
+
 foreach_test() ->
     {ok, Db} = esqlite3:open(":memory:"),
     ok = esqlite3:exec("begin;", Db),